@@ -0,0 +1,108 @@
+#include "accel.h"
+#include "primitive_tree.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+#include "config.h"
+
+#include <iostream>
+#include <limits>
+
+namespace rt {
+
+// Tests every primitive.
+struct brute_force_accel : accel {
+	brute_force_accel(const std::vector<primitive *> &primitives) :
+		primitives_(primitives)
+	{
+	}
+
+	bool intersect(const ray &r, intersect_info &info, primitive *&pr) const override {
+		hit_info h_min;
+		h_min.t = std::numeric_limits<float>::infinity();
+		primitive *pr_min(nullptr);
+		{
+			hit_info h;
+			for(auto *p : primitives_) {
+				if(p->hit(r, h) && h.t < h_min.t) {
+					h_min = h;
+					pr_min = p;
+				}
+			}
+		}
+		if(pr_min != nullptr) {
+			pr_min->surface_interaction(r, h_min, info);
+			pr = pr_min;
+			return true;
+		} else {
+			return false;
+		}
+	}
+
+	bool occluded(const ray &r, float t_max, const any_hit_fn &any_hit) const override {
+		hit_info h;
+		for(auto *p : primitives_) {
+			if(p->hit(r, h) && h.t <= t_max && (!any_hit || any_hit(p, h))) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	double build_time() const override {
+		return 0.0;
+	}
+
+	std::size_t memory_usage() const override {
+		return primitives_.size()*sizeof(primitive *);
+	}
+
+	void print_stats(std::ostream &os) const override {
+		os << "No acceleration structure (" << primitives_.size() << " primitives)" << std::endl;
+	}
+
+private:
+	std::vector<primitive *> primitives_;
+};
+
+void accel::intersect_packet(const ray *rays, std::size_t count, intersect_info *info, primitive **pr) const {
+	assert(count <= RT_PACKET_MAX_SIZE);
+	for(std::size_t i(0); i != count; ++i) {
+		if(!intersect(rays[i], info[i], pr[i])) {
+			pr[i] = nullptr;
+		}
+	}
+}
+
+const char *accel_name(accel_type type) {
+	switch(type) {
+		case accel_type::brute_force:
+			return "brute force";
+		case accel_type::kd_tree:
+			return "kd-tree";
+		case accel_type::bvh:
+			return "BVH";
+		case accel_type::wide_bvh:
+			return "wide BVH";
+		default:
+			assert(!"Unexpected accel_type");
+			return "";
+	}
+}
+
+std::unique_ptr<accel> make_accel(accel_type type, const std::vector<primitive *> &primitives) {
+	switch(type) {
+		case accel_type::brute_force:
+			return std::unique_ptr<accel>(new brute_force_accel(primitives));
+		case accel_type::kd_tree:
+			return std::unique_ptr<accel>(new primitive_tree(primitives));
+		case accel_type::bvh:
+			return std::unique_ptr<accel>(new bvh(primitives));
+		case accel_type::wide_bvh:
+			return make_wide_bvh(primitives);
+		default:
+			assert(!"Unexpected accel_type");
+			return nullptr;
+	}
+}
+
+}
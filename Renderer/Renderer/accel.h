@@ -0,0 +1,51 @@
+#pragma once
+
+#include "primitive.h"
+#include "ray.h"
+#include "intersect_info.h"
+
+#include <iosfwd>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace rt {
+
+// The kinds of acceleration structure scene::intersect can use.
+enum class accel_type {
+	brute_force, // Test every primitive
+	kd_tree, // primitive_tree
+	bvh, // bvh
+	wide_bvh // wide_bvh, 8 children per node with AVX2 and 4 otherwise
+};
+
+const char *accel_name(accel_type type);
+
+// Called by accel::occluded for the hits it finds, in no particular order. Returns whether the hit blocks the ray, which ends the search;
+// hits it returns false for are skipped (e.g. surfaces that an intersection shader cuts away).
+typedef std::function<bool(primitive *pr, const hit_info &h)> any_hit_fn;
+
+// A non-owning structure for finding the closest primitive hit by a ray.
+struct accel {
+	virtual ~accel() = default;
+
+	// Finds the closest primitive hit by r. Must be safe to call from several threads at once.
+	virtual bool intersect(const ray &r, intersect_info &info, primitive *&pr) const = 0;
+
+	// Finds whether any primitive is hit by r within [0, t_max], stopping at the first hit that any_hit accepts (any hit at all if any_hit is empty).
+	// Cheaper than intersect for shadow rays, since neither the closest hit nor its surface is needed. Must be safe to call from several threads at once.
+	virtual bool occluded(const ray &r, float t_max, const any_hit_fn &any_hit) const = 0;
+
+	// Finds the closest primitive hit by each of `count` (at most RT_PACKET_MAX_SIZE) rays, setting pr[i] to nullptr if rays[i] hits nothing.
+	// Structures that can traverse coherent rays together override this; by default every ray is intersected on its own. Must be safe to call from several threads at once.
+	virtual void intersect_packet(const ray *rays, std::size_t count, intersect_info *info, primitive **pr) const;
+
+	virtual double build_time() const = 0; // Seconds spent building the structure
+	virtual std::size_t memory_usage() const = 0; // Bytes used by the built structure
+	virtual void print_stats(std::ostream &os) const = 0; // Prints the build time and a one-line summary of the structure
+};
+
+// Builds an acceleration structure of the given type over `primitives`.
+std::unique_ptr<accel> make_accel(accel_type type, const std::vector<primitive *> &primitives);
+
+}
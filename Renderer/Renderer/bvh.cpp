@@ -0,0 +1,453 @@
+#include "bvh.h"
+#include "config.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+// Estimated cost of visiting a node, relative to cost_primitive ("Physically Based Rendering" Section 4.3.2).
+static auto cost_trav(0.125f);
+
+// Estimated cost of a primitive (sphere or triangle) intersection.
+static auto cost_primitive(1.0f);
+
+// Number of bins per axis the primitive centroids are sorted into when looking for a split.
+static const std::size_t num_bins(16);
+
+// Leaves never hold more primitives than this (or than one block, if blocks are bigger) unless the primitives cannot be told apart by their centroids.
+static const std::size_t max_leaf_primitives(8);
+
+namespace rt {
+
+namespace detail {
+
+static_assert(sizeof(bvh_node) == 32, "bvh_node should be 32 bytes");
+
+bool bvh_node::leaf() const {
+	return num_primitives != 0;
+}
+
+}
+
+struct build_primitive {
+	aabb bounds;
+	vec3 centroid;
+	primitive *pr;
+};
+
+// Bounds which contain nothing; aabb(empty_aabb(), b) == b.
+static aabb empty_aabb() {
+	return aabb(vec3(std::numeric_limits<float>::infinity()), vec3(-std::numeric_limits<float>::infinity()));
+}
+
+struct bin {
+	bin() :
+		bounds(empty_aabb()),
+		count(0)
+	{
+	}
+
+	aabb bounds;
+	std::size_t count;
+};
+
+// Surface area of bounds which may be empty.
+static float surface_area(const aabb &b) {
+	return b.minmax[0].x <= b.minmax[1].x ? b.surface_area() : 0.0f;
+}
+
+// Index of the bin along `axis` that the centroid c falls into, given the centroid bounds.
+static std::size_t bin_index(const aabb &centroid_bounds, std::size_t axis, const vec3 &c) {
+	auto min(centroid_bounds.minmax[0][axis]);
+	auto extent(centroid_bounds.minmax[1][axis] - min);
+	auto k(std::size_t(num_bins*((c[axis] - min)/extent)));
+	return std::min(k, num_bins - 1);
+}
+
+// Appends the subtree of prims[begin, end) to nodes and returns its depth.
+static std::size_t construct(std::vector<detail::bvh_node> &nodes, std::vector<build_primitive> &prims, std::size_t begin, std::size_t end, std::size_t block_size, std::size_t depth) {
+	// Binned SAH construction from "On fast Construction of SAH-based Bounding Volume Hierarchies" Section 3.
+	auto bounds(empty_aabb());
+	auto centroid_bounds(empty_aabb());
+	for(auto i(begin); i != end; ++i) {
+		bounds = aabb(bounds, prims[i].bounds);
+		centroid_bounds = aabb(centroid_bounds, aabb(prims[i].centroid, prims[i].centroid));
+	}
+	auto num_prims(end - begin);
+	auto blocks([=](std::size_t n) {
+		return float((n + block_size - 1)/block_size);
+	});
+	auto make_leaf([&]() {
+		nodes.emplace_back(detail::bvh_node{bounds, {std::uint32_t(begin)}, std::uint16_t(num_prims), 0});
+		return depth;
+	});
+	if(num_prims == 1 || depth == RT_BVH_MAX_DEPTH) {
+		assert(num_prims <= std::numeric_limits<std::uint16_t>::max());
+		return make_leaf();
+	}
+	// Leaves count their primitives in 16 bits. Near RT_BVH_MAX_DEPTH, a node whose SAH split could leave a child with too many primitives
+	// to fit in the levels below is split at the median instead, which halves the count at every level.
+	auto levels(RT_BVH_MAX_DEPTH - depth);
+	auto median(levels < 48 && std::uint64_t(num_prims - 1) > (std::uint64_t(std::numeric_limits<std::uint16_t>::max()) << (levels - 1))); // in 64 bits, as size_t may be 32
+	std::size_t best_axis(-1);
+	std::size_t best_split(0); // Bins [0, best_split) go to the left child
+	auto best_cost(std::numeric_limits<float>::infinity());
+	auto sa_v(bounds.surface_area());
+	for(std::size_t axis(0); axis != 3; ++axis) {
+		if(median || !(centroid_bounds.minmax[1][axis] > centroid_bounds.minmax[0][axis])) {
+			continue;
+		}
+		std::array<bin, num_bins> bins;
+		for(auto i(begin); i != end; ++i) {
+			auto &b(bins[bin_index(centroid_bounds, axis, prims[i].centroid)]);
+			b.bounds = aabb(b.bounds, prims[i].bounds);
+			++b.count;
+		}
+		// Sweep from the right to get the area and primitive count of every possible right side, then from the left to evaluate the splits.
+		std::array<float, num_bins> sa_right;
+		std::array<std::size_t, num_bins> count_right;
+		{
+			auto b(empty_aabb());
+			std::size_t count(0);
+			for(auto k(num_bins - 1); k != 0; --k) {
+				b = aabb(b, bins[k].bounds);
+				count += bins[k].count;
+				sa_right[k] = surface_area(b);
+				count_right[k] = count;
+			}
+		}
+		auto b(empty_aabb());
+		std::size_t count(0);
+		for(std::size_t k(1); k != num_bins; ++k) {
+			b = aabb(b, bins[k - 1].bounds);
+			count += bins[k - 1].count;
+			if(count == 0 || count_right[k] == 0) {
+				continue;
+			}
+			auto cost(cost_trav + (surface_area(b)*blocks(count) + sa_right[k]*blocks(count_right[k]))/sa_v*cost_primitive);
+			if(cost < best_cost) {
+				best_axis = axis;
+				best_split = k;
+				best_cost = cost;
+			}
+		}
+	}
+	if(median) {
+		// Along the axis with the largest centroid extent
+		best_axis = 0;
+		for(std::size_t axis(1); axis != 3; ++axis) {
+			if(centroid_bounds.minmax[1][axis] - centroid_bounds.minmax[0][axis] > centroid_bounds.minmax[1][best_axis] - centroid_bounds.minmax[0][best_axis]) {
+				best_axis = axis;
+			}
+		}
+	} else if(best_axis == std::size_t(-1) ? num_prims <= std::numeric_limits<std::uint16_t>::max() : cost_primitive*blocks(num_prims) <= best_cost && num_prims <= std::max(max_leaf_primitives, block_size)) {
+		return make_leaf();
+	}
+	std::size_t mid;
+	if(median) {
+		mid = begin + num_prims/2;
+		std::nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end, [&](const build_primitive &a, const build_primitive &b) {
+			return a.centroid[best_axis] < b.centroid[best_axis];
+		});
+	} else if(best_axis != std::size_t(-1)) {
+		auto it(std::partition(prims.begin() + begin, prims.begin() + end, [&](const build_primitive &p) {
+			return bin_index(centroid_bounds, best_axis, p.centroid) < best_split;
+		}));
+		mid = std::size_t(it - prims.begin());
+	} else {
+		// Too many primitives with the same centroid for one leaf, split them in half.
+		best_axis = 0;
+		mid = begin + num_prims/2;
+	}
+	auto index(nodes.size());
+	nodes.emplace_back(detail::bvh_node{bounds, {0}, 0, std::uint16_t(best_axis)});
+	auto depth_left(construct(nodes, prims, begin, mid, block_size, depth + 1));
+	nodes[index].right = std::uint32_t(nodes.size());
+	auto depth_right(construct(nodes, prims, mid, end, block_size, depth + 1));
+	return std::max(depth_left, depth_right);
+}
+
+bvh::bvh(const std::vector<primitive *> &primitives, std::size_t block_size) :
+	depth_(0)
+{
+	auto start(std::chrono::steady_clock::now());
+	if(!primitives.empty()) {
+		std::vector<build_primitive> prims;
+		prims.reserve(primitives.size());
+		for(auto *pr : primitives) {
+			auto &b(pr->bounds());
+			prims.emplace_back(build_primitive{b, (b.minmax[0] + b.minmax[1])*0.5f, pr});
+		}
+		nodes_.reserve(2*primitives.size());
+		depth_ = construct(nodes_, prims, 0, prims.size(), std::max(block_size, std::size_t(1)), 0);
+		nodes_.shrink_to_fit();
+		primitives_.reserve(prims.size());
+		for(auto &p : prims) {
+			primitives_.push_back(p.pr);
+		}
+	}
+	build_time_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool bvh::intersect(const ray &r, intersect_info &info, primitive *&pr) const {
+	// Traversal from "Physically Based Rendering" Section 4.3.5: the nearer child (by the sign of the ray direction along the split axis) is visited first,
+	// and nodes entered beyond the closest hit found so far are skipped.
+	// At most one entry is pushed per level of the tree, so a stack of RT_BVH_MAX_DEPTH entries is always big enough.
+	std::uint32_t intersect_stack[RT_BVH_MAX_DEPTH];
+	std::size_t stack_size(0);
+	if(nodes_.empty()) {
+		return false;
+	}
+	const bool dir_neg[3] = {std::signbit(r.dir.x), std::signbit(r.dir.y), std::signbit(r.dir.z)};
+	hit_info h_closest;
+	h_closest.t = std::numeric_limits<float>::infinity();
+	primitive *pr_closest(nullptr);
+	hit_info h;
+	std::uint32_t index(0);
+	for(;;) {
+		auto &node(nodes_[index]);
+		float t_enter;
+		float t_exit;
+		if(node.bounds.intersect(r, t_enter, t_exit) && t_enter <= h_closest.t + RT_RAY_EPSILON) {
+			if(node.leaf()) {
+				auto begin(primitives_.begin() + node.primitives_offset);
+				auto end(begin + node.num_primitives);
+				for(auto it(begin); it != end; ++it) {
+					if((*it)->hit(r, h) && h.t < h_closest.t) {
+						h_closest = h;
+						pr_closest = *it;
+					}
+				}
+			} else {
+				assert(stack_size != RT_BVH_MAX_DEPTH);
+				if(dir_neg[node.split_axis]) {
+					intersect_stack[stack_size++] = index + 1;
+					index = node.right;
+				} else {
+					intersect_stack[stack_size++] = node.right;
+					index = index + 1;
+				}
+				continue;
+			}
+		}
+		if(stack_size == 0) {
+			break;
+		}
+		index = intersect_stack[--stack_size];
+	}
+	if(pr_closest != nullptr) {
+		pr_closest->surface_interaction(r, h_closest, info);
+		pr = pr_closest;
+		return true;
+	}
+	return false;
+}
+
+bool bvh::occluded(const ray &r, float t_max, const any_hit_fn &any_hit) const {
+	// Same traversal as intersect, but the first accepted hit ends it and nodes are culled against t_max only.
+	std::uint32_t intersect_stack[RT_BVH_MAX_DEPTH];
+	std::size_t stack_size(0);
+	if(nodes_.empty()) {
+		return false;
+	}
+	const bool dir_neg[3] = {std::signbit(r.dir.x), std::signbit(r.dir.y), std::signbit(r.dir.z)};
+	hit_info h;
+	std::uint32_t index(0);
+	for(;;) {
+		auto &node(nodes_[index]);
+		float t_enter;
+		float t_exit;
+		if(node.bounds.intersect(r, t_enter, t_exit) && t_enter <= t_max + RT_RAY_EPSILON) {
+			if(node.leaf()) {
+				auto begin(primitives_.begin() + node.primitives_offset);
+				auto end(begin + node.num_primitives);
+				for(auto it(begin); it != end; ++it) {
+					if((*it)->hit(r, h) && h.t <= t_max && (!any_hit || any_hit(*it, h))) {
+						return true;
+					}
+				}
+			} else {
+				assert(stack_size != RT_BVH_MAX_DEPTH);
+				if(dir_neg[node.split_axis]) {
+					intersect_stack[stack_size++] = index + 1;
+					index = node.right;
+				} else {
+					intersect_stack[stack_size++] = node.right;
+					index = index + 1;
+				}
+				continue;
+			}
+		}
+		if(stack_size == 0) {
+			break;
+		}
+		index = intersect_stack[--stack_size];
+	}
+	return false;
+}
+
+// Bounds on the origins and reciprocal directions of the rays of a packet, for culling boxes that no ray of the packet can hit with interval arithmetic
+// ("Ray Tracing Deformable Scenes Using Dynamic Bounding Volume Hierarchies", Wald et al., Section 4.2).
+struct packet_interval {
+	packet_interval(const ray *rays, std::size_t count) :
+		valid(true)
+	{
+		for(std::size_t axis(0); axis != 3; ++axis) {
+			neg[axis] = std::signbit(rays[0].dir[axis]);
+			origin_min[axis] = origin_max[axis] = rays[0].origin[axis];
+			idir_min[axis] = idir_max[axis] = rays[0].idir[axis];
+			for(std::size_t i(0); i != count; ++i) {
+				auto &r(rays[i]);
+				// The bounds are only meaningful if the signs of the directions agree, and an infinite reciprocal could make 0*inf products.
+				if(std::signbit(r.dir[axis]) != neg[axis] || !std::isfinite(r.idir[axis])) {
+					valid = false;
+				}
+				origin_min[axis] = std::min(origin_min[axis], r.origin[axis]);
+				origin_max[axis] = std::max(origin_max[axis], r.origin[axis]);
+				idir_min[axis] = std::min(idir_min[axis], r.idir[axis]);
+				idir_max[axis] = std::max(idir_max[axis], r.idir[axis]);
+			}
+		}
+	}
+
+	// Whether aabb::intersect fails for every ray of the packet. Float subtraction and multiplication are monotonic, so the bounds hold exactly for the rays' own distances.
+	bool misses(const aabb &box) const {
+		if(!valid) {
+			return false;
+		}
+		auto near_max(-std::numeric_limits<float>::infinity());
+		auto far_min(std::numeric_limits<float>::infinity());
+		for(std::size_t axis(0); axis != 3; ++axis) {
+			auto near(box.minmax[neg[axis]][axis]);
+			auto far(box.minmax[!neg[axis]][axis]);
+			float t_near[4] = {(near - origin_min[axis])*idir_min[axis], (near - origin_min[axis])*idir_max[axis], (near - origin_max[axis])*idir_min[axis], (near - origin_max[axis])*idir_max[axis]};
+			float t_far[4] = {(far - origin_min[axis])*idir_min[axis], (far - origin_min[axis])*idir_max[axis], (far - origin_max[axis])*idir_min[axis], (far - origin_max[axis])*idir_max[axis]};
+			near_max = std::max(near_max, *std::min_element(std::begin(t_near), std::end(t_near)));
+			far_min = std::min(far_min, *std::max_element(std::begin(t_far), std::end(t_far)));
+		}
+		return near_max > far_min || far_min < 0.0f;
+	}
+
+	bool valid;
+	bool neg[3];
+	float origin_min[3];
+	float origin_max[3];
+	float idir_min[3];
+	float idir_max[3];
+};
+
+void bvh::intersect_packet(const ray *rays, std::size_t count, intersect_info *info, primitive **pr) const {
+	// Packet traversal from "Ray Tracing Deformable Scenes Using Dynamic Bounding Volume Hierarchies" (Wald et al.), Section 4:
+	// a node is entered as soon as one ray hits it, starting from the first ray that was active in its parent. If that ray misses, the node is
+	// skipped when interval arithmetic shows that no ray can hit it, and otherwise the remaining rays are tested until one does.
+	// Leaves are intersected with every ray from the first active one on, so the closest hits are the same as those of intersect.
+	struct stack_entry {
+		std::uint32_t index;
+		std::uint32_t first;
+	};
+	assert(count <= RT_PACKET_MAX_SIZE);
+	stack_entry intersect_stack[RT_BVH_MAX_DEPTH];
+	std::size_t stack_size(0);
+	hit_info h_closest[RT_PACKET_MAX_SIZE];
+	for(std::size_t i(0); i != count; ++i) {
+		h_closest[i].t = std::numeric_limits<float>::infinity();
+		pr[i] = nullptr;
+	}
+	if(nodes_.empty() || count == 0) {
+		return;
+	}
+	packet_interval interval(rays, count);
+	hit_info h;
+	std::uint32_t index(0);
+	std::uint32_t first(0);
+	for(;;) {
+		auto &node(nodes_[index]);
+		auto hits([&](std::uint32_t i) {
+			float t_enter;
+			float t_exit;
+			return node.bounds.intersect(rays[i], t_enter, t_exit) && t_enter <= h_closest[i].t + RT_RAY_EPSILON;
+		});
+		if(!hits(first)) {
+			if(interval.misses(node.bounds)) {
+				first = std::uint32_t(count);
+			} else {
+				for(++first; first != count && !hits(first); ++first);
+			}
+		}
+		if(first != count) {
+			if(node.leaf()) {
+				auto begin(primitives_.begin() + node.primitives_offset);
+				auto end(begin + node.num_primitives);
+				for(auto it(begin); it != end; ++it) {
+					for(auto i(first); i != count; ++i) {
+						if((*it)->hit(rays[i], h) && h.t < h_closest[i].t) {
+							h_closest[i] = h;
+							pr[i] = *it;
+						}
+					}
+				}
+			} else {
+				assert(stack_size != RT_BVH_MAX_DEPTH);
+				if(std::signbit(rays[first].dir[node.split_axis])) {
+					intersect_stack[stack_size++] = stack_entry{index + 1, first};
+					index = node.right;
+				} else {
+					intersect_stack[stack_size++] = stack_entry{node.right, first};
+					index = index + 1;
+				}
+				continue;
+			}
+		}
+		if(stack_size == 0) {
+			break;
+		}
+		index = intersect_stack[--stack_size].index;
+		first = intersect_stack[stack_size].first;
+	}
+	for(std::size_t i(0); i != count; ++i) {
+		if(pr[i] != nullptr) {
+			pr[i]->surface_interaction(rays[i], h_closest[i], info[i]);
+		}
+	}
+}
+
+double bvh::build_time() const {
+	return build_time_;
+}
+
+std::size_t bvh::memory_usage() const {
+	return nodes_.size()*sizeof(detail::bvh_node) + primitives_.size()*sizeof(primitive *);
+}
+
+void bvh::print_stats(std::ostream &os) const {
+	std::size_t leaves(0);
+	for(auto &n : nodes_) {
+		if(n.leaf()) {
+			++leaves;
+		}
+	}
+	os << "Built BVH in " << build_time_ << " sec" << std::endl;
+	os << "BVH: " << nodes_.size() << " nodes (" << leaves << " leaves, " << (leaves != 0 ? float(primitives_.size())/leaves : 0.0f) << " primitives per leaf), depth " << depth_ << " (limit " << RT_BVH_MAX_DEPTH << "), "
+	   << memory_usage()/1024.0 << " KB" << std::endl;
+}
+
+std::size_t bvh::depth() const {
+	return depth_;
+}
+
+std::size_t bvh::num_nodes() const {
+	return nodes_.size();
+}
+
+const std::vector<detail::bvh_node> &bvh::nodes() const {
+	return nodes_;
+}
+
+const std::vector<primitive *> &bvh::primitives() const {
+	return primitives_;
+}
+
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "accel.h"
+#include "aabb.h"
+
+#include <vector>
+#include <cstdint>
+
+namespace rt {
+
+namespace detail {
+
+// A node of a built bvh (32 bytes, see "Physically Based Rendering" Section 4.3.4).
+// The left child of an interior node directly follows it in bvh::nodes_.
+struct bvh_node {
+	bool leaf() const;
+
+	aabb bounds;
+	union {
+		std::uint32_t primitives_offset; // Leaves: index of the first primitive in bvh::primitives_
+		std::uint32_t right; // Interior nodes: index of the right child
+	};
+	std::uint16_t num_primitives; // 0 for interior nodes
+	std::uint16_t split_axis; // Interior nodes: the axis the children were split along, used to visit the nearer child first
+};
+
+}
+
+// A non-owning bounding volume hierarchy of primitives, built with binned SAH.
+// Unlike primitive_tree, every primitive is referenced by exactly one leaf.
+struct bvh : accel {
+	// block_size: The number of primitives intersected at once by whoever traverses the tree (see wide_bvh). The SAH counts the primitives of a leaf in whole blocks.
+	bvh(const std::vector<primitive *> &primitives, std::size_t block_size = 1);
+
+	// Safe to call from several threads at once: the traversal stack lives on the caller's stack.
+	bool intersect(const ray &r, intersect_info &info, primitive *&pr) const override;
+	bool occluded(const ray &r, float t_max, const any_hit_fn &any_hit) const override;
+	// Traverses the packet together, culling nodes with the first ray still active in them and with interval arithmetic.
+	void intersect_packet(const ray *rays, std::size_t count, intersect_info *info, primitive **pr) const override;
+
+	double build_time() const override;
+	std::size_t memory_usage() const override;
+	void print_stats(std::ostream &os) const override;
+
+	std::size_t depth() const; // Depth of the deepest leaf (never more than RT_BVH_MAX_DEPTH)
+	std::size_t num_nodes() const;
+
+	// The built tree, for deriving other structures from it (see wide_bvh).
+	const std::vector<detail::bvh_node> &nodes() const;
+	const std::vector<primitive *> &primitives() const;
+
+private:
+	std::vector<detail::bvh_node> nodes_; // nodes_[0] is the root
+	std::vector<primitive *> primitives_; // The primitives, ordered so that the primitives of every leaf are contiguous
+	std::size_t depth_;
+	double build_time_;
+};
+
+}
@@ -2,8 +2,14 @@
 
 #include <cassert>
 
-// Use a kd-tree for testing primitive intersection instead of brute-force
-#define RT_TREE
-
 // Epsilon value used with rays for preventing self-collisions and intersection with AABBs (see primitive_tree::intersect)
-#define RT_RAY_EPSILON 10e-4f
\ No newline at end of file
+#define RT_RAY_EPSILON 10e-4f
+
+// Maximum depth of the kd-tree. Nodes at this depth are always made leaves, which bounds the size of the traversal stack (see primitive_tree::intersect)
+#define RT_TREE_MAX_DEPTH 64
+
+// Maximum depth of the BVH, for the same reason (see bvh::intersect)
+#define RT_BVH_MAX_DEPTH 64
+
+// Maximum number of rays traced together by accel::intersect_packet (an 8x8 block of pixels)
+#define RT_PACKET_MAX_SIZE 64
\ No newline at end of file
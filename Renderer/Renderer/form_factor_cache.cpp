@@ -0,0 +1,99 @@
+#include "form_factor_cache.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace rt {
+
+form_factor_cache::form_factor_cache(std::size_t budget) :
+	budget_(budget),
+	bytes_(0),
+	hits_(0),
+	misses_(0)
+{
+}
+
+bool form_factor_cache::contains(std::uint32_t patch) const {
+	return rows_.count(patch) != 0;
+}
+
+void form_factor_cache::get(std::uint32_t patch, std::vector<float> &ffs) {
+	auto it(rows_.find(patch));
+	assert(it != rows_.end());
+	auto &r(it->second);
+	++hits_;
+	lru_.splice(lru_.begin(), lru_, r.lru);
+	std::fill(ffs.begin(), ffs.end(), 0.0f);
+	auto scale(r.scale/(65535.0f*65535.0f));
+	for(std::size_t e(0); e != r.indices.size(); ++e) {
+		assert(r.indices[e] < ffs.size());
+		auto v(float(r.values[e]));
+		ffs[r.indices[e]] = v*v*scale;
+	}
+}
+
+void form_factor_cache::put(std::uint32_t patch, const std::vector<float> &ffs) {
+	++misses_;
+	assert(!contains(patch));
+	row r;
+	r.scale = 0.0f;
+	for(auto ff : ffs) {
+		r.scale = std::max(r.scale, ff);
+	}
+	if(r.scale > 0.0f) {
+		for(std::size_t j(0); j != ffs.size(); ++j) {
+			if(ffs[j] > 0.0f) {
+				auto q(std::lround(std::sqrt(ffs[j]/r.scale)*65535.0f));
+				if(q != 0) {
+					r.indices.push_back(std::uint32_t(j));
+					r.values.push_back(std::uint16_t(q));
+				}
+			}
+		}
+	}
+	auto size(row_bytes(r.indices.size()));
+	if(size > budget_) {
+		return;
+	}
+	while(bytes_ + size > budget_) {
+		auto last(rows_.find(lru_.back()));
+		bytes_ -= row_bytes(last->second.indices.size());
+		rows_.erase(last);
+		lru_.pop_back();
+	}
+	r.indices.shrink_to_fit();
+	r.values.shrink_to_fit();
+	lru_.push_front(patch);
+	r.lru = lru_.begin();
+	rows_.emplace(patch, std::move(r));
+	bytes_ += size;
+}
+
+void form_factor_cache::clear() {
+	rows_.clear();
+	lru_.clear();
+	bytes_ = 0;
+}
+
+std::size_t form_factor_cache::hits() const {
+	return hits_;
+}
+
+std::size_t form_factor_cache::misses() const {
+	return misses_;
+}
+
+std::size_t form_factor_cache::bytes() const {
+	return bytes_;
+}
+
+std::size_t form_factor_cache::row_bytes(std::size_t entries) {
+	return sizeof(row) + entries*(sizeof(std::uint32_t) + sizeof(std::uint16_t));
+}
+
+void form_factor_cache::print_stats(std::ostream &os) const {
+	os << "Form factor cache: " << hits_ << " hits, " << misses_ << " misses, " << rows_.size() << " rows in " << bytes_/1024.0 << " KB" << std::endl;
+}
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
+#include <ostream>
+
+namespace rt {
+
+// A least recently used cache of the form factors of shooting patches, so that a patch shot again (lights and lit walls keep coming back
+// to the top of the unshot power heap) does not need its hemicube rendered again.
+// Rows are sparse, holding the indices of the nonzero form factors and the form factors as 16 bit fractions of the largest one in the row.
+// The fractions are square roots, which keeps the small form factors to distant patches from rounding to 0.
+struct form_factor_cache {
+	// budget: Bytes the rows may take up at most, counting their indices and values.
+	form_factor_cache(std::size_t budget);
+	form_factor_cache(const form_factor_cache &) = delete;
+
+	bool contains(std::uint32_t patch) const;
+
+	// Fills ffs with the form factors of a cached patch (ffs has room for every patch), counting a hit and making it the most recently used.
+	void get(std::uint32_t patch, std::vector<float> &ffs);
+
+	// Caches the form factors of a patch that were just computed, counting a miss. The least recently used rows are evicted to stay within the budget.
+	void put(std::uint32_t patch, const std::vector<float> &ffs);
+
+	void clear(); // Drops every row (when the patches change), keeping the counters
+
+	std::size_t hits() const;
+	std::size_t misses() const;
+	std::size_t bytes() const;
+
+	void print_stats(std::ostream &os) const;
+
+private:
+	struct row {
+		std::vector<std::uint32_t> indices;
+		std::vector<std::uint16_t> values;
+		float scale; // The largest form factor of the row
+		std::list<std::uint32_t>::iterator lru; // The patch in lru_
+	};
+
+	static std::size_t row_bytes(std::size_t entries);
+
+	std::size_t budget_;
+	std::size_t bytes_;
+	std::size_t hits_;
+	std::size_t misses_;
+	std::unordered_map<std::uint32_t, row> rows_;
+	std::list<std::uint32_t> lru_; // Cached patches, most recently used first
+};
+
+}
@@ -0,0 +1,116 @@
+#include "form_factor_matrix.h"
+
+#include <algorithm>
+#include <cassert>
+#include <thread>
+
+namespace rt {
+
+form_factor_matrix::form_factor_matrix(std::size_t patches) :
+	shooters_(patches)
+{
+}
+
+void form_factor_matrix::add_shooter(std::uint32_t i, const std::vector<float> &ffs) {
+	assert(i != 0 && i < shooters_.size() && ffs.size() == shooters_.size());
+	auto &row(shooters_[i]);
+	row.clear();
+	// Patch 0 takes what leaves the scene, which nothing gathers
+	for(std::size_t j(1); j != ffs.size(); ++j) {
+		if(ffs[j] != 0.0f) {
+			row.push_back(entry{std::uint32_t(j), ffs[j]});
+		}
+	}
+	row.shrink_to_fit();
+}
+
+void form_factor_matrix::build(const patch_states &states) {
+	auto n(shooters_.size());
+	assert(states.size() == n);
+	// Transpose the rows of the shooters into rows of the receivers, counting the entries of every receiver first
+	row_begin_.assign(n + 1, 0);
+	for(auto &row : shooters_) {
+		for(auto &e : row) {
+			++row_begin_[e.index + 1];
+		}
+	}
+	for(std::size_t j(0); j != n; ++j) {
+		row_begin_[j + 1] += row_begin_[j];
+	}
+	cols_.resize(row_begin_[n]);
+	values_.resize(row_begin_[n]);
+	std::vector<std::uint32_t> next(row_begin_.begin(), row_begin_.end() - 1);
+	for(std::uint32_t i(0); i != n; ++i) {
+		for(auto &e : shooters_[i]) {
+			auto k(next[e.index]++);
+			cols_[k] = i;
+			values_[k] = e.value*states.area(i)/states.area(e.index);
+		}
+	}
+	shooters_.clear();
+	shooters_.shrink_to_fit();
+
+	emission_.resize(n);
+	energy_.resize(n);
+	for(std::size_t i(0); i != n; ++i) {
+		emission_[i] = states.energy(i);
+		energy_[i] = states.energy(i);
+	}
+}
+
+void form_factor_matrix::iterate(patch_states &states, matrix_iteration method, std::size_t threads) {
+	auto n(energy_.size());
+	threads = std::max(std::min(threads, n/256), std::size_t(1)); // Small blocks are not worth a thread
+	previous_ = energy_;
+	auto block((n + threads - 1)/threads);
+	auto work([&](std::size_t id) {
+		auto begin(std::min(id*block, n));
+		auto end(std::min(begin + block, n));
+		for(auto j(std::max(begin, std::size_t(1))); j < end; ++j) {
+			vec3 gathered(0.0f);
+			for(auto k(row_begin_[j]); k != row_begin_[j + 1]; ++k) {
+				auto i(cols_[k]);
+				// Other threads only write their own blocks
+				auto &b(method == matrix_iteration::gauss_seidel && i >= begin && i < end ? energy_[i] : previous_[i]);
+				gathered += b*values_[k];
+			}
+			auto diff(states.diffuse(j));
+			for(std::size_t c(0); c != 3; ++c) {
+				energy_[j][c] = emission_[j][c] + diff[c]*gathered[c];
+			}
+		}
+	});
+	std::vector<std::thread> workers;
+	workers.reserve(threads - 1);
+	for(std::size_t t(1); t != threads; ++t) {
+		workers.emplace_back(work, t);
+	}
+	work(0);
+	for(auto &t : workers) {
+		t.join();
+	}
+	for(std::size_t j(1); j != n; ++j) {
+		states.set_energy(j, energy_[j]);
+		states.set_unshot_energy(j, energy_[j] - previous_[j]);
+	}
+}
+
+vec3 form_factor_matrix::emission(std::uint32_t i) const {
+	return emission_[i];
+}
+
+void form_factor_matrix::set_emission(std::uint32_t i, const vec3 &emission) {
+	emission_[i] = emission;
+}
+
+std::size_t form_factor_matrix::nonzeros() const {
+	return values_.size();
+}
+
+void form_factor_matrix::print_stats(std::ostream &os) const {
+	auto n(std::max(row_begin_.size(), std::size_t(2)) - 1);
+	os << "Form factor matrix: " << n - 1 << " rows, " << nonzeros() << " nonzeros (" << double(nonzeros())/(n - 1) << " per row), "
+		<< (row_begin_.size()*sizeof(std::uint32_t) + nonzeros()*(sizeof(std::uint32_t) + sizeof(float)))/1024.0 << " KB" << std::endl;
+}
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "patch_states.h"
+#include "vec3.h"
+
+#include <vector>
+#include <cstdint>
+#include <ostream>
+
+namespace rt {
+
+// How form_factor_matrix updates the energies in an iteration.
+enum class matrix_iteration {
+	jacobi, // Every patch gathers the energies of the previous iteration
+	gauss_seidel // Every patch gathers the energies already updated in this iteration, which converges in about half the iterations. With several threads, each one sees only the updates of its own block of patches.
+};
+
+// The form factors between every pair of patches as a sparse matrix in compressed sparse row (CSR) form, for solving the radiosity
+// equation B = E + diffuse * G B by iterating over all patches ("Radiosity and Realistic Image Synthesis", Cohen & Wallace, Chapter 5),
+// instead of shooting one patch at a time.
+// Row j of G holds F_ij A_i / A_j for every patch i that sees j, so that it gathers what i would shoot at j, with the form factors of
+// the hemicube of i. Once built, the matrix only depends on the geometry, so changing emitters or materials only needs more iterations.
+struct form_factor_matrix {
+	form_factor_matrix(std::size_t patches);
+	form_factor_matrix(const form_factor_matrix &) = delete;
+
+	// Adds the form factors from patch i to every patch (as computed by radiosity_scene), keeping only the nonzero ones.
+	void add_shooter(std::uint32_t i, const std::vector<float> &ffs);
+
+	// Turns the rows added by add_shooter into the CSR matrix. The energies of states at this point are taken as what the patches emit.
+	void build(const patch_states &states);
+
+	// One iteration on `threads` threads, each taking a block of patches. Stores the new energy of every patch in states, and the change in
+	// it as its unshot energy.
+	void iterate(patch_states &states, matrix_iteration method, std::size_t threads);
+
+	vec3 emission(std::uint32_t i) const;
+	void set_emission(std::uint32_t i, const vec3 &emission);
+
+	std::size_t nonzeros() const;
+	void print_stats(std::ostream &os) const;
+
+private:
+	struct entry {
+		std::uint32_t index;
+		float value;
+	};
+
+	std::vector<std::vector<entry>> shooters_; // Nonzero form factors of every shooter, until build
+	std::vector<std::uint32_t> row_begin_; // Start of every row in cols_ and values_, and the end of the last one
+	std::vector<std::uint32_t> cols_;
+	std::vector<float> values_;
+	std::vector<vec3> emission_;
+	std::vector<vec3> energy_;
+	std::vector<vec3> previous_; // energy_ before the current iteration
+};
+
+}
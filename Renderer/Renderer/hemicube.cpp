@@ -0,0 +1,407 @@
+#include "hemicube.h"
+#include "math.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <thread>
+
+namespace rt {
+
+std::array<mat4, 5> hemicube_views(const patch &p) {
+	static const auto near(0.1f);
+	static const auto far(10.0f);
+	auto center(p.center());
+	auto normal(p.normal());
+	auto right(normalize(cross(normal, p.surface_dir()))); // the direction facing the right face of the hemicube (arbitrarily chosen to be perpendicular to the normal)
+	auto front(normalize(cross(right, normal))); // the direction facing the front face of the hemicube
+	auto proj(mat4::perspective(radians(90.0f), 1.0f, near, far));
+	return {{
+		proj * mat4::look_at(center, center + normal, front), // top
+		proj * mat4::look_at(center, center - right, normal), // left
+		proj * mat4::look_at(center, center + right, normal), // right
+		proj * mat4::look_at(center, center - front, normal), // back
+		proj * mat4::look_at(center, center + front, normal)  // front
+	}};
+}
+
+hemicube_weights::hemicube_weights(std::size_t res, simd_level level) :
+	res_(res),
+	level_(level)
+{
+	auto s(res);
+	auto fs{float(res)};
+	auto da(4.0f/(fs*fs));
+	top_.reserve(s*s);
+	side_.reserve((s - s/2)*s);
+	for(std::size_t j(0); j != s; ++j) {
+		for(std::size_t i(0); i != s; ++i) {
+			auto x(2.0f*i/fs - 1.0f);
+			auto y(2.0f*j/fs - 1.0f);
+			auto div(x*x + y*y + 1.0f);
+			top_.push_back(da/(RT_PI*div*div));
+			if(j >= s/2) {
+				// With an odd res, row res/2 straddles the horizon
+				side_.push_back(da*std::max(y, 0.0f)/(RT_PI*div*div));
+			}
+		}
+	}
+}
+
+std::size_t hemicube_weights::res() const {
+	return res_;
+}
+
+// Adds weights[c] to ffs[items[c]] for c in [begin, end), and returns the sum of the run of cells seeing `item` that ends at `end`
+// (which the caller still has to add to ffs[item]).
+static float accumulate_cells(const std::uint32_t *items, const float *weights, std::size_t begin, std::size_t end, std::uint32_t &item, float run, std::vector<float> &ffs) {
+	for(auto c(begin); c != end; ++c) {
+		if(items[c] != item) {
+			ffs[item] += run;
+			item = items[c];
+			run = 0.0f;
+		}
+		run += weights[c];
+	}
+	return run;
+}
+
+#ifdef RT_SIMD_X86
+
+static void accumulate_sse(const std::uint32_t *items, const float *weights, std::size_t n, std::vector<float> &ffs) {
+	auto item(items[0]);
+	auto run(0.0f);
+	auto sum(_mm_setzero_ps());
+	std::size_t c(0);
+	for(; c + 4 <= n; c += 4) {
+		auto same(_mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(items + c)), _mm_set1_epi32(int(item))));
+		if(_mm_movemask_epi8(same) == 0xffff) {
+			sum = _mm_add_ps(sum, _mm_loadu_ps(weights + c));
+		} else {
+			float lanes[4];
+			_mm_storeu_ps(lanes, sum);
+			run += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+			sum = _mm_setzero_ps();
+			run = accumulate_cells(items, weights, c, c + 4, item, run, ffs);
+		}
+	}
+	float lanes[4];
+	_mm_storeu_ps(lanes, sum);
+	run += (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	run = accumulate_cells(items, weights, c, n, item, run, ffs);
+	ffs[item] += run;
+}
+
+RT_TARGET_AVX2 static void accumulate_avx2(const std::uint32_t *items, const float *weights, std::size_t n, std::vector<float> &ffs) {
+	auto item(items[0]);
+	auto run(0.0f);
+	auto sum(_mm256_setzero_ps());
+	std::size_t c(0);
+	for(; c + 8 <= n; c += 8) {
+		auto same(_mm256_cmpeq_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(items + c)), _mm256_set1_epi32(int(item))));
+		if(_mm256_movemask_epi8(same) == -1) {
+			sum = _mm256_add_ps(sum, _mm256_loadu_ps(weights + c));
+		} else {
+			float lanes[8];
+			_mm256_storeu_ps(lanes, sum);
+			run += ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+			sum = _mm256_setzero_ps();
+			run = accumulate_cells(items, weights, c, c + 8, item, run, ffs);
+		}
+	}
+	float lanes[8];
+	_mm256_storeu_ps(lanes, sum);
+	run += ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+	_mm256_zeroupper();
+	run = accumulate_cells(items, weights, c, n, item, run, ffs);
+	ffs[item] += run;
+}
+
+#endif
+
+template <bool Side>
+void hemicube_weights::accumulate(const std::uint32_t *items, std::vector<float> &ffs) const {
+	auto &weights(Side ? side_ : top_);
+	auto n(weights.size());
+	if(n == 0) {
+		return;
+	}
+#ifdef RT_SIMD_X86
+	switch(level_) {
+		case simd_level::avx2:
+			accumulate_avx2(items, weights.data(), n, ffs);
+			return;
+		case simd_level::sse:
+			accumulate_sse(items, weights.data(), n, ffs);
+			return;
+		default:
+			break;
+	}
+#endif
+	auto item(items[0]);
+	ffs[item] += accumulate_cells(items, weights.data(), 0, n, item, 0.0f, ffs);
+}
+
+template void hemicube_weights::accumulate<false>(const std::uint32_t *items, std::vector<float> &ffs) const;
+template void hemicube_weights::accumulate<true>(const std::uint32_t *items, std::vector<float> &ffs) const;
+
+hemicube_rasterizer::hemicube_rasterizer(std::size_t res, simd_level level) :
+	res_(res),
+	level_(level),
+	items_(res*res + 3),
+	depth_(res*res + 3)
+{
+}
+
+const std::uint32_t *hemicube_rasterizer::items() const {
+	return items_.data();
+}
+
+void hemicube_rasterizer::render(const mat4 &vp, const std::vector<patch_vertex> &verts) {
+	std::fill(items_.begin(), items_.end(), 0u);
+	std::fill(depth_.begin(), depth_.end(), 1.0f);
+	clip_.resize(verts.size());
+#ifdef RT_SIMD_X86
+	if(level_ != simd_level::scalar) {
+		// Same sums in the same order as mat4::operator *(const vec4 &), one vertex per register.
+		auto c0(_mm_loadu_ps(vp[0].data()));
+		auto c1(_mm_loadu_ps(vp[1].data()));
+		auto c2(_mm_loadu_ps(vp[2].data()));
+		auto c3(_mm_loadu_ps(vp[3].data()));
+		for(std::size_t i(0); i != verts.size(); ++i) {
+			auto &pos(verts[i].pos);
+			auto v(_mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(pos.x)), _mm_mul_ps(c1, _mm_set1_ps(pos.y))), _mm_mul_ps(c2, _mm_set1_ps(pos.z))), _mm_mul_ps(c3, _mm_set1_ps(1.0f))));
+			_mm_storeu_ps(&clip_[i].x, v);
+		}
+	} else
+#endif
+	{
+		for(std::size_t i(0); i != verts.size(); ++i) {
+			auto v(vp*vec4(verts[i].pos, 1.0f));
+			clip_[i] = clip_vertex{v.x, v.y, v.z, v.w};
+		}
+	}
+	// Bit k of a vertex's outcode is set if it is outside clip plane k (see plane_distance).
+	auto outcode([](const clip_vertex &v) {
+		return unsigned(v.x < -v.w) | unsigned(v.x > v.w) << 1 | unsigned(v.y < -v.w) << 2 | unsigned(v.y > v.w) << 3 | unsigned(v.z < -v.w) << 4 | unsigned(v.z > v.w) << 5;
+	});
+	for(std::size_t i(0); i + 2 < verts.size(); i += 3) {
+		auto &a(clip_[i]);
+		auto &b(clip_[i + 1]);
+		auto &c(clip_[i + 2]);
+		auto oa(outcode(a));
+		auto ob(outcode(b));
+		auto oc(outcode(c));
+		if((oa & ob & oc) != 0) {
+			continue;
+		}
+		auto item(verts[i].index);
+		if((oa | ob | oc) == 0) {
+			draw(a, b, c, item);
+		} else {
+			draw_clipped(a, b, c, oa | ob | oc, item);
+		}
+	}
+}
+
+// Signed distance of a clip space point from clip plane k, in the order -w <= x, x <= w, -w <= y, y <= w, -w <= z, z <= w.
+static float plane_distance(float x, float y, float z, float w, unsigned plane) {
+	switch(plane) {
+		case 0:
+			return w + x;
+		case 1:
+			return w - x;
+		case 2:
+			return w + y;
+		case 3:
+			return w - y;
+		case 4:
+			return w + z;
+		default:
+			return w - z;
+	}
+}
+
+void hemicube_rasterizer::draw_clipped(const clip_vertex &a, const clip_vertex &b, const clip_vertex &c, unsigned outside, std::uint32_t item) {
+	// Sutherland-Hodgman against the planes that some vertex is outside of. Every plane adds at most one vertex.
+	clip_vertex poly[2][9] = {{a, b, c}};
+	std::size_t n(3);
+	std::size_t cur(0);
+	for(unsigned plane(0); plane != 6; ++plane) {
+		if((outside & (1u << plane)) == 0) {
+			continue;
+		}
+		auto &in(poly[cur]);
+		auto &out(poly[1 - cur]);
+		std::size_t m(0);
+		for(std::size_t k(0); k != n; ++k) {
+			auto &v0(in[k]);
+			auto &v1(in[(k + 1) % n]);
+			auto d0(plane_distance(v0.x, v0.y, v0.z, v0.w, plane));
+			auto d1(plane_distance(v1.x, v1.y, v1.z, v1.w, plane));
+			if(d0 >= 0.0f) {
+				out[m++] = v0;
+			}
+			if((d0 >= 0.0f) != (d1 >= 0.0f)) {
+				auto t(d0/(d0 - d1));
+				out[m++] = clip_vertex{v0.x + (v1.x - v0.x)*t, v0.y + (v1.y - v0.y)*t, v0.z + (v1.z - v0.z)*t, v0.w + (v1.w - v0.w)*t};
+			}
+		}
+		n = m;
+		cur = 1 - cur;
+		if(n < 3) {
+			return;
+		}
+	}
+	for(std::size_t k(1); k + 1 < n; ++k) {
+		draw(poly[cur][0], poly[cur][k], poly[cur][k + 1], item);
+	}
+}
+
+void hemicube_rasterizer::draw(const clip_vertex &ca, const clip_vertex &cb, const clip_vertex &cc, std::uint32_t item) {
+	struct screen_vertex {
+		float x;
+		float y;
+		float z;
+	};
+	auto half(0.5f*float(res_));
+	auto to_screen([&](const clip_vertex &v) {
+		return screen_vertex{(v.x/v.w + 1.0f)*half, (v.y/v.w + 1.0f)*half, v.z/v.w};
+	});
+	screen_vertex v[3] = {to_screen(ca), to_screen(cb), to_screen(cc)};
+	auto area((v[1].x - v[0].x)*(v[2].y - v[0].y) - (v[2].x - v[0].x)*(v[1].y - v[0].y));
+	if(!(area != 0.0f)) {
+		return;
+	}
+	if(area < 0.0f) {
+		std::swap(v[1], v[2]);
+		area = -area;
+	}
+	// Cells whose centers (i + 0.5, j + 0.5) lie within the bounding box
+	auto i0(std::max(0, int(std::ceil(std::min({v[0].x, v[1].x, v[2].x}) - 0.5f))));
+	auto i1(std::min(int(res_) - 1, int(std::floor(std::max({v[0].x, v[1].x, v[2].x}) - 0.5f))));
+	auto j0(std::max(0, int(std::ceil(std::min({v[0].y, v[1].y, v[2].y}) - 0.5f))));
+	auto j1(std::min(int(res_) - 1, int(std::floor(std::max({v[0].y, v[1].y, v[2].y}) - 0.5f))));
+	if(i0 > i1 || j0 > j1) {
+		return;
+	}
+	// Edge k runs from v[k] to v[k + 1]. e = b*(py - y0) + a*(px - x0) is positive inside the (counterclockwise) triangle.
+	// Cells exactly on an edge belong to the triangle only if it is a top or left edge, so that they are not drawn twice.
+	float ea[3];
+	float eb[3];
+	float ex[3];
+	float ey[3];
+	bool top_left[3];
+	for(std::size_t k(0); k != 3; ++k) {
+		auto &p0(v[k]);
+		auto &p1(v[(k + 1) % 3]);
+		auto dx(p1.x - p0.x);
+		auto dy(p1.y - p0.y);
+		ea[k] = -dy;
+		eb[k] = dx;
+		ex[k] = p0.x;
+		ey[k] = p0.y;
+		top_left[k] = dy < 0.0f || (dy == 0.0f && dx < 0.0f);
+	}
+	// z = v[0].z + dzdx*(px - v[0].x) + dzdy*(py - v[0].y), linear in screen space like window depth.
+	auto dz1(v[1].z - v[0].z);
+	auto dz2(v[2].z - v[0].z);
+	auto dzdx((dz1*(v[2].y - v[0].y) - dz2*(v[1].y - v[0].y))/area);
+	auto dzdy((dz2*(v[1].x - v[0].x) - dz1*(v[2].x - v[0].x))/area);
+	for(auto j(j0); j <= j1; ++j) {
+		auto py(float(j) + 0.5f);
+		float row_e[3];
+		for(std::size_t k(0); k != 3; ++k) {
+			row_e[k] = eb[k]*(py - ey[k]);
+		}
+		auto row_z(v[0].z + dzdy*(py - v[0].y));
+		auto *items(&items_[j*res_]);
+		auto *depth(&depth_[j*res_]);
+#ifdef RT_SIMD_X86
+		if(level_ != simd_level::scalar) {
+			auto zero(_mm_setzero_ps());
+			auto last(_mm_set1_ps(float(i1) + 0.5f));
+			auto lanes(_mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+			for(auto i(i0); i <= i1; i += 4) {
+				auto px(_mm_add_ps(_mm_set1_ps(float(i) + 0.5f), lanes));
+				auto mask(_mm_cmple_ps(px, last));
+				for(std::size_t k(0); k != 3; ++k) {
+					auto e(_mm_add_ps(_mm_set1_ps(row_e[k]), _mm_mul_ps(_mm_set1_ps(ea[k]), _mm_sub_ps(px, _mm_set1_ps(ex[k])))));
+					auto in(top_left[k] ? _mm_cmpge_ps(e, zero) : _mm_cmpgt_ps(e, zero));
+					mask = _mm_and_ps(mask, in);
+				}
+				if(_mm_movemask_ps(mask) == 0) {
+					continue;
+				}
+				auto z(_mm_add_ps(_mm_set1_ps(row_z), _mm_mul_ps(_mm_set1_ps(dzdx), _mm_sub_ps(px, _mm_set1_ps(v[0].x)))));
+				auto d(_mm_loadu_ps(depth + i));
+				mask = _mm_and_ps(mask, _mm_cmplt_ps(z, d));
+				_mm_storeu_ps(depth + i, _mm_or_ps(_mm_and_ps(mask, z), _mm_andnot_ps(mask, d)));
+				auto imask(_mm_castps_si128(mask));
+				auto old(_mm_loadu_si128(reinterpret_cast<const __m128i *>(items + i)));
+				auto updated(_mm_or_si128(_mm_and_si128(imask, _mm_set1_epi32(int(item))), _mm_andnot_si128(imask, old)));
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(items + i), updated);
+			}
+			continue;
+		}
+#endif
+		for(auto i(i0); i <= i1; ++i) {
+			auto px(float(i) + 0.5f);
+			auto inside(true);
+			for(std::size_t k(0); k != 3; ++k) {
+				auto e(row_e[k] + ea[k]*(px - ex[k]));
+				inside = inside && (top_left[k] ? e >= 0.0f : e > 0.0f);
+			}
+			if(!inside) {
+				continue;
+			}
+			auto z(row_z + dzdx*(px - v[0].x));
+			if(z < depth[i]) {
+				depth[i] = z;
+				items[i] = item;
+			}
+		}
+	}
+}
+
+software_hemicube::software_hemicube(std::vector<patch_vertex> verts, std::size_t res, std::size_t threads) :
+	verts_(std::move(verts)),
+	threads_(std::min(std::max(threads, std::size_t(1)), std::size_t(5))),
+	weights_(res)
+{
+	for(std::size_t i(0); i != 5; ++i) {
+		faces_.emplace_back(res);
+	}
+}
+
+void software_hemicube::set_vertices(std::size_t first, const std::vector<patch_vertex> &verts) {
+	assert(first <= verts_.size());
+	verts_.resize(std::max(verts_.size(), first + verts.size()));
+	std::copy(verts.begin(), verts.end(), verts_.begin() + first);
+}
+
+void software_hemicube::compute(const patch &p, std::vector<float> &ffs) {
+	auto views(hemicube_views(p));
+	auto work([&](std::size_t id) {
+		for(auto face(id); face < 5; face += threads_) {
+			faces_[face].render(views[face], verts_);
+		}
+	});
+	std::vector<std::thread> workers;
+	workers.reserve(threads_ - 1);
+	for(std::size_t i(1); i != threads_; ++i) {
+		workers.emplace_back(work, i);
+	}
+	work(0);
+	for(auto &t : workers) {
+		t.join();
+	}
+	std::fill(ffs.begin(), ffs.end(), 0.0f);
+	auto res(weights_.res());
+	weights_.accumulate<false>(faces_[0].items(), ffs);
+	for(std::size_t face(1); face != 5; ++face) {
+		weights_.accumulate<true>(faces_[face].items() + (res/2)*res, ffs);
+	}
+}
+
+}
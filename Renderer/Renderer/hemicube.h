@@ -0,0 +1,88 @@
+#pragma once
+
+#include "patch.h"
+#include "patch_vertex.h"
+#include "mat4.h"
+#include "simd.h"
+
+#include <array>
+#include <vector>
+#include <cstdint>
+
+namespace rt {
+
+// "The Hemi-Cube: A Radiosity Solution for Complex Environments" (Cohen & Greenberg)
+
+// The view-projection transforms of the five faces of the hemicube over p, in the order [top, left, right, back, front].
+// The side faces look along the surface with the patch normal up, so only the upper half of their image lies above the surface.
+std::array<mat4, 5> hemicube_views(const patch &p);
+
+// The delta form factors of the cells of the hemicube faces at one resolution, computed once so that summing a face only needs table lookups.
+struct hemicube_weights {
+	// level: Instruction set used by accumulate (AVX2 or SSE, or a scalar loop if `level` has neither).
+	hemicube_weights(std::size_t res, simd_level level = cpu_simd_level());
+
+	// Adds the delta form factor of every cell of a rendered face to ffs[item], where items holds the patch index seen through each of the
+	// res x res cells, bottom row first (as read by glReadPixels). Side faces only count their upper half, so for them items starts at row res/2.
+	// Neighboring cells mostly see the same patch, so runs of cells with the same item are summed 8 (AVX2) or 4 (SSE) at a time before being added to ffs.
+	template <bool Side>
+	void accumulate(const std::uint32_t *items, std::vector<float> &ffs) const;
+
+	std::size_t res() const;
+
+private:
+	std::size_t res_;
+	simd_level level_;
+	std::vector<float> top_; // The res x res cells of the top face
+	std::vector<float> side_; // The cells of the upper half of a side face, starting at row res/2
+};
+
+// Rasterizes hemicube faces on the CPU into an item buffer with a depth test, the way hc_prog renders them into hc_index_tex:
+// triangles are clipped to the view volume, cells are covered if their center is (with a top-left rule for shared edges), and depth is compared with GL_LESS.
+// Edge functions and depths are evaluated for 4 cells at once with SSE when the CPU has it.
+struct hemicube_rasterizer {
+	hemicube_rasterizer(std::size_t res, simd_level level = cpu_simd_level());
+
+	// Renders the triangles of verts (every 3 vertices, see patch::render) through vp. Cells where nothing is drawn get item 0, the null patch.
+	void render(const mat4 &vp, const std::vector<patch_vertex> &verts);
+
+	const std::uint32_t *items() const; // res x res patch indices, bottom row first
+
+private:
+	struct clip_vertex {
+		float x;
+		float y;
+		float z;
+		float w;
+	};
+
+	void draw_clipped(const clip_vertex &a, const clip_vertex &b, const clip_vertex &c, unsigned outside, std::uint32_t item);
+	void draw(const clip_vertex &a, const clip_vertex &b, const clip_vertex &c, std::uint32_t item);
+
+	std::size_t res_;
+	simd_level level_;
+	std::vector<clip_vertex> clip_; // verts transformed to clip space
+	std::vector<std::uint32_t> items_; // Padded by 3 cells so that the last cells can be read and written 4 at a time
+	std::vector<float> depth_; // Normalized device z of the closest triangle, padded like items_
+};
+
+// Computes form factors with hemicube_rasterizer instead of OpenGL, rasterizing the five faces on up to five threads.
+struct software_hemicube {
+	// verts: The triangles of every patch, as given by patch::render with the patch's index.
+	software_hemicube(std::vector<patch_vertex> verts, std::size_t res, std::size_t threads);
+	software_hemicube(const software_hemicube &) = delete;
+
+	// Fills ffs with the form factors from p to every patch, summing the faces in the same order as radiosity_scene::render_hemicube.
+	void compute(const patch &p, std::vector<float> &ffs);
+
+	// Overwrites the vertices from `first` on with verts, appending the ones past the end (for patches that were split).
+	void set_vertices(std::size_t first, const std::vector<patch_vertex> &verts);
+
+private:
+	std::vector<patch_vertex> verts_;
+	std::size_t threads_;
+	hemicube_weights weights_;
+	std::vector<hemicube_rasterizer> faces_;
+};
+
+}
@@ -0,0 +1,296 @@
+#include "hierarchical_radiosity.h"
+#include "math.h"
+#include "config.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace rt {
+
+hierarchical_radiosity::hierarchical_radiosity(const scene &scn, float link_epsilon, float min_area) :
+	scn_(scn),
+	link_epsilon_(link_epsilon),
+	min_area_(min_area),
+	links_(0)
+{
+}
+
+void hierarchical_radiosity::add_surface(patch_fn make_patch, point_fn point, std::size_t udiv, std::size_t vdiv, grid_ptr grid) {
+	auto s{std::uint32_t(surfaces_.size())};
+	surfaces_.push_back(surface{std::move(make_patch), std::move(point), udiv, vdiv, std::move(grid), {}});
+	for(std::size_t vi(0); vi != vdiv; ++vi) {
+		for(std::size_t ui(0); ui != udiv; ++ui) {
+			auto e(add_element(s, float(ui)/udiv, float(vi)/vdiv, float(ui + 1)/udiv, float(vi + 1)/vdiv, 0));
+			surfaces_[s].roots.push_back(e);
+		}
+	}
+}
+
+std::uint32_t hierarchical_radiosity::add_element(std::uint32_t surface, float u0, float v0, float u1, float v1, std::uint32_t depth) {
+	element e;
+	e.surface = surface;
+	e.u0 = u0;
+	e.v0 = v0;
+	e.u1 = u1;
+	e.v1 = v1;
+	e.depth = depth;
+	e.children = 0;
+	auto p(surfaces_[surface].make_patch(u0, v0, u1, v1));
+	e.center = p->center();
+	e.normal = p->normal();
+	e.area = p->area();
+	auto &point(surfaces_[surface].point);
+	e.corners = {{point(u0, v0), point(u1, v0), point(u1, v1), point(u0, v1)}};
+	auto diff(p->mat().diff_color);
+	auto emiss(p->mat().emiss_color);
+	e.emission = vec3(diff.r*emiss.r, diff.g*emiss.g, diff.b*emiss.b); // like patch_states::add
+	e.reflectance = diff;
+	e.radiosity = e.emission;
+	e.gathered = vec3(0.0f);
+	e.index = 0;
+	e.owned = std::move(p);
+	elements_.push_back(std::move(e));
+	return std::uint32_t(elements_.size() - 1);
+}
+
+std::uint32_t hierarchical_radiosity::subdivide(std::uint32_t e) {
+	if(elements_[e].children == 0) {
+		// Copy what is needed, as adding elements moves them
+		auto s(elements_[e].surface);
+		auto u0(elements_[e].u0);
+		auto v0(elements_[e].v0);
+		auto u1(elements_[e].u1);
+		auto v1(elements_[e].v1);
+		auto um((u0 + u1)/2.0f);
+		auto vm((v0 + v1)/2.0f);
+		auto depth(elements_[e].depth + 1);
+		auto first(add_element(s, u0, v0, um, vm, depth));
+		add_element(s, um, v0, u1, vm, depth);
+		add_element(s, u0, vm, um, v1, depth);
+		add_element(s, um, vm, u1, v1, depth);
+		elements_[e].children = first;
+		elements_[e].owned.reset();
+	}
+	return elements_[e].children;
+}
+
+// The form factor from a to b without occlusion, estimated as from the center of a to a disk with the area of b facing the center of a
+// ("Radiosity and Realistic Image Synthesis", Cohen & Wallace). Like the patches receiving from a hemicube, a receives on either side,
+// but b only shoots from the front, so this is 0 if b faces away from a.
+static float disk_form_factor(const vec3 &a_center, const vec3 &a_normal, const vec3 &b_center, const vec3 &b_normal, float b_area) {
+	auto d(b_center - a_center);
+	auto r2(length_squared(d));
+	if(r2 <= 0.0f) {
+		return 0.0f;
+	}
+	auto dir(d/std::sqrt(r2));
+	auto ca(std::abs(dot(a_normal, dir)));
+	auto cb(-dot(b_normal, dir));
+	if(cb <= 0.0f) {
+		return 0.0f;
+	}
+	return ca*cb*b_area/(RT_PI*r2 + b_area);
+}
+
+// Whether any of b is in front of a's plane, judging by its center and corners.
+static bool in_front(const vec3 &a_center, const vec3 &a_normal, const vec3 &b_center, const std::array<vec3, 4> &b_corners) {
+	if(dot(b_center - a_center, a_normal) > RT_RAY_EPSILON) {
+		return true;
+	}
+	for(auto &c : b_corners) {
+		if(dot(c - a_center, a_normal) > RT_RAY_EPSILON) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void hierarchical_radiosity::refine() {
+	std::vector<std::uint32_t> roots;
+	for(auto &s : surfaces_) {
+		roots.insert(roots.end(), s.roots.begin(), s.roots.end());
+	}
+	for(std::size_t i(0); i != roots.size(); ++i) {
+		for(auto j(i + 1); j != roots.size(); ++j) {
+			refine(roots[i], roots[j]);
+		}
+	}
+}
+
+void hierarchical_radiosity::refine(std::uint32_t a, std::uint32_t b) {
+	auto &ea(elements_[a]);
+	auto &eb(elements_[b]);
+	// a gathers from b if some of a is in front of b, and the other way around
+	auto ab(in_front(eb.center, eb.normal, ea.center, ea.corners));
+	auto ba(in_front(ea.center, ea.normal, eb.center, eb.corners));
+	if(!ab && !ba) {
+		return;
+	}
+	auto fab(ab ? disk_form_factor(ea.center, ea.normal, eb.center, eb.normal, eb.area) : 0.0f);
+	auto fba(ba ? disk_form_factor(eb.center, eb.normal, ea.center, ea.normal, ea.area) : 0.0f);
+	// If some of a is in front of b but its center is not (or the other way around), the estimate means nothing, so that needs refining too
+	auto unknown((ab && fab <= 0.0f) || (ba && fba <= 0.0f));
+	if(unknown || std::max(fab, fba) > link_epsilon_) {
+		// Subdivide the bigger element, or the other one if the bigger one is already as small as it gets
+		auto big(elements_[a].area >= elements_[b].area ? a : b);
+		auto small(big == a ? b : a);
+		for(auto e : {big, small}) {
+			if(elements_[e].area >= 2.0f*min_area_) {
+				auto other(e == a ? b : a);
+				auto first(subdivide(e));
+				for(std::uint32_t c(0); c != 4; ++c) {
+					refine(first + c, other);
+				}
+				return;
+			}
+		}
+	}
+	if(fab <= 0.0f && fba <= 0.0f) {
+		return;
+	}
+	auto v(visibility(elements_[a], elements_[b]));
+	if(v <= 0.0f) {
+		return;
+	}
+	if(fab > 0.0f) {
+		elements_[a].links.push_back(link{b, fab*v});
+		++links_;
+	}
+	if(fba > 0.0f) {
+		elements_[b].links.push_back(link{a, fba*v});
+		++links_;
+	}
+}
+
+float hierarchical_radiosity::visibility(const element &a, const element &b) const {
+	// Rays between points spread over both elements, pairing each point of a with a different point of b
+	static const float samples[5][2] = {{0.5f, 0.5f}, {0.25f, 0.25f}, {0.75f, 0.25f}, {0.25f, 0.75f}, {0.75f, 0.75f}};
+	auto &sa(surfaces_[a.surface]);
+	auto &sb(surfaces_[b.surface]);
+	std::size_t visible(0);
+	for(std::size_t k(0); k != 5; ++k) {
+		auto &ka(samples[k]);
+		auto &kb(samples[(5 - k) % 5]);
+		auto pa(sa.point(a.u0 + ka[0]*(a.u1 - a.u0), a.v0 + ka[1]*(a.v1 - a.v0)));
+		auto pb(sb.point(b.u0 + kb[0]*(b.u1 - b.u0), b.v0 + kb[1]*(b.v1 - b.v0)));
+		// Move both points off their surfaces, towards the side the other one is on
+		auto d(pb - pa);
+		pa += a.normal*(dot(a.normal, d) >= 0.0f ? RT_RAY_EPSILON : -RT_RAY_EPSILON);
+		pb += b.normal*(dot(b.normal, d) <= 0.0f ? RT_RAY_EPSILON : -RT_RAY_EPSILON);
+		d = pb - pa;
+		auto dist(std::sqrt(length_squared(d)));
+		if(dist <= 2.0f*RT_RAY_EPSILON) {
+			++visible;
+			continue;
+		}
+		// Primitives without patches are not drawn into the hemicube either, so they do not occlude
+		ray r(pa, d/dist);
+		if(!scn_.occluded(r, dist - RT_RAY_EPSILON, [](primitive *pr, const hit_info &) { return bool(pr->radiosity_patches); })) {
+			++visible;
+		}
+	}
+	return visible/5.0f;
+}
+
+void hierarchical_radiosity::build_patches(const std::function<std::uint32_t(std::unique_ptr<patch> p, std::uint32_t surface, float u0, float v0, float u1, float v1, std::uint32_t depth)> &add_patch) {
+	for(auto &e : elements_) {
+		if(e.children == 0) {
+			e.index = add_patch(std::move(e.owned), e.surface, e.u0, e.v0, e.u1, e.v1, e.depth);
+		}
+	}
+	// Every surface's grid has a cell per element at its deepest level, and a leaf fills the cells it covers
+	for(auto &s : surfaces_) {
+		std::uint32_t depth(0);
+		std::vector<std::uint32_t> stack(s.roots);
+		std::vector<std::uint32_t> leaves;
+		while(!stack.empty()) {
+			auto e(stack.back());
+			stack.pop_back();
+			if(elements_[e].children == 0) {
+				depth = std::max(depth, elements_[e].depth);
+				leaves.push_back(e);
+			} else {
+				for(std::uint32_t c(0); c != 4; ++c) {
+					stack.push_back(elements_[e].children + c);
+				}
+			}
+		}
+		auto cols(s.udiv << depth);
+		auto rows(s.vdiv << depth);
+		auto &grid(*s.grid);
+		grid.assign(rows, std::vector<std::uint32_t>(cols, 0));
+		for(auto e : leaves) {
+			auto &el(elements_[e]);
+			auto x0(std::size_t(std::lround(el.u0*cols)));
+			auto x1(std::size_t(std::lround(el.u1*cols)));
+			auto y0(std::size_t(std::lround(el.v0*rows)));
+			auto y1(std::size_t(std::lround(el.v1*rows)));
+			for(auto y(y0); y != y1; ++y) {
+				std::fill(grid[y].begin() + x0, grid[y].begin() + x1, el.index);
+			}
+		}
+	}
+	// Initial radiosities of the inner elements
+	for(auto &s : surfaces_) {
+		for(auto e : s.roots) {
+			push_pull(e, vec3(0.0f));
+		}
+	}
+}
+
+vec3 hierarchical_radiosity::push_pull(std::uint32_t e, const vec3 &down) {
+	auto &el(elements_[e]);
+	auto gathered(down + el.gathered);
+	vec3 radiosity(0.0f);
+	if(el.children == 0) {
+		radiosity = vec3(
+			el.emission.r + el.reflectance.r*gathered.r,
+			el.emission.g + el.reflectance.g*gathered.g,
+			el.emission.b + el.reflectance.b*gathered.b
+		);
+	} else {
+		auto area(0.0f);
+		for(std::uint32_t c(0); c != 4; ++c) {
+			auto a(elements_[el.children + c].area);
+			radiosity += push_pull(el.children + c, gathered)*a;
+			area += a;
+		}
+		radiosity /= area;
+	}
+	el.radiosity = radiosity;
+	return radiosity;
+}
+
+void hierarchical_radiosity::iterate(patch_states &states) {
+	// Gather with the radiosities of the previous iteration
+	for(auto &e : elements_) {
+		e.gathered = vec3(0.0f);
+		for(auto &l : e.links) {
+			e.gathered += elements_[l.from].radiosity*l.ff;
+		}
+	}
+	for(auto &s : surfaces_) {
+		for(auto e : s.roots) {
+			push_pull(e, vec3(0.0f));
+		}
+	}
+	for(auto &e : elements_) {
+		if(e.children == 0) {
+			states.set_unshot_energy(e.index, e.radiosity - states.energy(e.index));
+			states.set_energy(e.index, e.radiosity);
+		}
+	}
+}
+
+void hierarchical_radiosity::print_stats(std::ostream &os) const {
+	std::size_t leaves(0);
+	for(auto &e : elements_) {
+		if(e.children == 0) {
+			++leaves;
+		}
+	}
+	os << "Hierarchical radiosity: " << surfaces_.size() << " surfaces, " << elements_.size() << " elements (" << leaves << " leaves), " << links_ << " links" << std::endl;
+}
+
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "scene.h"
+#include "patch.h"
+#include "patch_states.h"
+#include "vec3.h"
+
+#include <array>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+
+namespace rt {
+
+// Hierarchical radiosity ("A Rapid Hierarchical Radiosity Algorithm", Hanrahan, Salzman & Aupperle).
+// Every surface is a quadtree of elements over its (u, v) parameters. Pairs of elements are linked at the coarsest level at which
+// the form factor between them is below a bound, subdividing the bigger one otherwise, so that elements get small only where
+// they are close to something they exchange much energy with. Radiosity is then gathered over the links, pushed down the quadtrees
+// to the leaves and pulled back up as area-weighted averages.
+// The leaves are the patches of the scene.
+struct hierarchical_radiosity {
+	// Creates the patch covering [u0, u1] x [v0, v1] of a surface.
+	typedef std::function<std::unique_ptr<patch>(float u0, float v0, float u1, float v1)> patch_fn;
+	// The position on a surface at (u, v).
+	typedef std::function<vec3(float u, float v)> point_fn;
+	// The patch grid of a surface, as in primitive::radiosity_patches.
+	typedef std::shared_ptr<std::vector<std::vector<std::uint32_t>>> grid_ptr;
+
+	// scn: The scene used to find out what occludes the links.
+	// link_epsilon: Links whose estimated form factor (without occlusion) is above this are refined.
+	// min_area: Elements smaller than twice this are not subdivided.
+	hierarchical_radiosity(const scene &scn, float link_epsilon, float min_area);
+	hierarchical_radiosity(const hierarchical_radiosity &) = delete;
+
+	// Adds a surface, whose quadtrees start from udiv x vdiv elements. grid is filled in by build_patches.
+	void add_surface(patch_fn make_patch, point_fn point, std::size_t udiv, std::size_t vdiv, grid_ptr grid);
+
+	// Links every pair of surfaces, refining the links (and subdividing the elements) as needed.
+	void refine();
+
+	// Hands the patch of every leaf to add_patch, which returns its index, and fills in the grids of the surfaces with those indices.
+	// add_patch also gets where the leaf lies: its surface (numbered in the order they were added), its [u0, u1] x [v0, v1] range and its depth.
+	void build_patches(const std::function<std::uint32_t(std::unique_ptr<patch> p, std::uint32_t surface, float u0, float v0, float u1, float v1, std::uint32_t depth)> &add_patch);
+
+	// Gathers over every link once and pushes and pulls the result through the quadtrees (a Jacobi iteration),
+	// then stores the radiosity of every leaf as the energy of its patch, and the change in it as its unshot energy.
+	void iterate(patch_states &states);
+
+	void print_stats(std::ostream &os) const;
+
+private:
+	struct link {
+		std::uint32_t from; // The element gathered from
+		float ff; // Form factor to it, times the fraction of it that is visible
+	};
+
+	struct element {
+		std::uint32_t surface;
+		float u0;
+		float v0;
+		float u1;
+		float v1;
+		std::uint32_t depth; // Subdivisions from the surface's initial elements
+		std::uint32_t children; // Index of the first of 4 children, or 0 for a leaf
+		std::unique_ptr<patch> owned; // The patch of a leaf, until build_patches hands it over (subdividing an element drops its patch, as only its center, normal and area are used)
+		vec3 center;
+		vec3 normal;
+		std::array<vec3, 4> corners; // At (u0, v0), (u1, v0), (u1, v1) and (u0, v1)
+		float area;
+		vec3 emission;
+		vec3 reflectance;
+		vec3 radiosity;
+		vec3 gathered; // Sum of the radiosity gathered over the links of the element (before reflection)
+		std::uint32_t index; // Patch index of a leaf
+		std::vector<link> links;
+	};
+
+	struct surface {
+		patch_fn make_patch;
+		point_fn point;
+		std::size_t udiv;
+		std::size_t vdiv;
+		grid_ptr grid;
+		std::vector<std::uint32_t> roots;
+	};
+
+	std::uint32_t add_element(std::uint32_t surface, float u0, float v0, float u1, float v1, std::uint32_t depth);
+	std::uint32_t subdivide(std::uint32_t e); // Returns the index of the first child
+	void refine(std::uint32_t a, std::uint32_t b);
+	float visibility(const element &a, const element &b) const;
+	vec3 push_pull(std::uint32_t e, const vec3 &down);
+
+	const scene &scn_;
+	float link_epsilon_;
+	float min_area_;
+	std::vector<surface> surfaces_;
+	std::vector<element> elements_;
+	std::size_t links_;
+};
+
+}
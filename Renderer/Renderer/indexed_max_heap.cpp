@@ -0,0 +1,116 @@
+#include "indexed_max_heap.h"
+
+#include <cassert>
+#include <queue>
+#include <utility>
+
+namespace rt {
+
+indexed_max_heap::indexed_max_heap(std::vector<float> keys, std::uint32_t first) :
+	keys_(std::move(keys)),
+	pos_(keys_.size(), 0)
+{
+	assert(first <= keys_.size());
+	heap_.reserve(keys_.size() - first);
+	for(auto i(first); i < keys_.size(); ++i) {
+		pos_[i] = std::uint32_t(heap_.size());
+		heap_.push_back(i);
+	}
+	for(auto pos(heap_.size()/2); pos-- != 0;) {
+		sift_down(pos);
+	}
+}
+
+std::uint32_t indexed_max_heap::top() const {
+	assert(!heap_.empty());
+	return heap_[0];
+}
+
+void indexed_max_heap::top(std::size_t k, std::vector<std::uint32_t> &out) const {
+	// Best-first search from the root: the next largest key is always a child of one already taken, so only O(k) positions are visited.
+	out.clear();
+	auto less([&](std::size_t a, std::size_t b) {
+		return keys_[heap_[a]] < keys_[heap_[b]];
+	});
+	std::priority_queue<std::size_t, std::vector<std::size_t>, decltype(less)> candidates(less);
+	if(!heap_.empty()) {
+		candidates.push(0);
+	}
+	while(out.size() < k && !candidates.empty()) {
+		auto pos(candidates.top());
+		candidates.pop();
+		out.push_back(heap_[pos]);
+		for(auto child(2*pos + 1); child <= 2*pos + 2 && child < heap_.size(); ++child) {
+			candidates.push(child);
+		}
+	}
+}
+
+float indexed_max_heap::key(std::uint32_t index) const {
+	return keys_[index];
+}
+
+std::uint32_t indexed_max_heap::push(float key) {
+	auto index{std::uint32_t(keys_.size())};
+	keys_.push_back(key);
+	pos_.push_back(std::uint32_t(heap_.size()));
+	heap_.push_back(index);
+	sift_up(heap_.size() - 1);
+	return index;
+}
+
+void indexed_max_heap::update(std::uint32_t index, float key) {
+	assert(heap_[pos_[index]] == index);
+	auto old(keys_[index]);
+	keys_[index] = key;
+	if(key > old) {
+		sift_up(pos_[index]);
+	} else if(key < old) {
+		sift_down(pos_[index]);
+	}
+}
+
+std::size_t indexed_max_heap::size() const {
+	return heap_.size();
+}
+
+void indexed_max_heap::place(std::size_t pos, std::uint32_t index) {
+	heap_[pos] = index;
+	pos_[index] = std::uint32_t(pos);
+}
+
+void indexed_max_heap::sift_up(std::size_t pos) {
+	auto index(heap_[pos]);
+	auto key(keys_[index]);
+	while(pos != 0) {
+		auto parent((pos - 1)/2);
+		if(!(keys_[heap_[parent]] < key)) {
+			break;
+		}
+		place(pos, heap_[parent]);
+		pos = parent;
+	}
+	place(pos, index);
+}
+
+void indexed_max_heap::sift_down(std::size_t pos) {
+	auto index(heap_[pos]);
+	auto key(keys_[index]);
+	for(;;) {
+		auto child(2*pos + 1);
+		if(child >= heap_.size()) {
+			break;
+		}
+		if(child + 1 < heap_.size() && keys_[heap_[child]] < keys_[heap_[child + 1]]) {
+			++child;
+		}
+		if(!(key < keys_[heap_[child]])) {
+			break;
+		}
+		place(pos, heap_[child]);
+		pos = child;
+	}
+	place(pos, index);
+}
+
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+namespace rt {
+
+// A binary max-heap of the indices [0, n) keyed on floats, which knows where every index is so that a key can be changed in O(log n).
+struct indexed_max_heap {
+	// keys: The key of every index.
+	// first: Indices below `first` are left out of the heap (like the null patch).
+	indexed_max_heap(std::vector<float> keys = {}, std::uint32_t first = 0);
+
+	std::uint32_t top() const; // The index with the largest key (the heap must not be empty)
+	void top(std::size_t k, std::vector<std::uint32_t> &out) const; // Fills out with the (at most) k indices with the largest keys, largest first
+	float key(std::uint32_t index) const;
+	void update(std::uint32_t index, float key); // Changes the key of an index in the heap
+	std::uint32_t push(float key); // Adds the next index (one past the last) with the given key, and returns it
+	std::size_t size() const;
+
+private:
+	void sift_up(std::size_t pos);
+	void sift_down(std::size_t pos);
+	void place(std::size_t pos, std::uint32_t index);
+
+	std::vector<float> keys_; // Key of every index
+	std::vector<std::uint32_t> heap_; // Indices in heap order (the children of heap_[i] are heap_[2i+1] and heap_[2i+2])
+	std::vector<std::uint32_t> pos_; // Position of every index in heap_
+};
+
+}
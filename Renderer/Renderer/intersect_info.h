@@ -9,4 +9,11 @@ struct intersect_info {
 	material mat;
 };
 
+// What primitive::hit finds out about a hit: its distance, and whatever surface_interaction needs to fill in the rest of the intersect_info.
+struct hit_info {
+	float t;
+	float alpha; // Triangles: barycentric coordinates (see triangle::surface_interaction)
+	float beta;
+};
+
 }
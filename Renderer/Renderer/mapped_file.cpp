@@ -0,0 +1,91 @@
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace rt {
+
+#ifdef _WIN32
+
+mapped_file::mapped_file(const std::string &path) :
+	data_(nullptr),
+	size_(0),
+	file_(INVALID_HANDLE_VALUE),
+	mapping_(nullptr)
+{
+	file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if(file_ == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(file_, &size) || size.QuadPart == 0) {
+		return;
+	}
+	mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if(!mapping_) {
+		return;
+	}
+	data_ = static_cast<const char *>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+	if(data_) {
+		size_ = std::size_t(size.QuadPart);
+	}
+}
+
+mapped_file::~mapped_file() {
+	if(data_) {
+		UnmapViewOfFile(data_);
+	}
+	if(mapping_) {
+		CloseHandle(mapping_);
+	}
+	if(file_ != INVALID_HANDLE_VALUE) {
+		CloseHandle(file_);
+	}
+}
+
+#else
+
+mapped_file::mapped_file(const std::string &path) :
+	data_(nullptr),
+	size_(0)
+{
+	auto fd(open(path.c_str(), O_RDONLY));
+	if(fd == -1) {
+		return;
+	}
+	struct stat st;
+	if(fstat(fd, &st) == 0 && st.st_size > 0) {
+		auto data(mmap(nullptr, std::size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0));
+		if(data != MAP_FAILED) {
+			data_ = static_cast<const char *>(data);
+			size_ = std::size_t(st.st_size);
+		}
+	}
+	// The mapping stays valid without the descriptor
+	close(fd);
+}
+
+mapped_file::~mapped_file() {
+	if(data_) {
+		munmap(const_cast<char *>(data_), size_);
+	}
+}
+
+#endif
+
+const char *mapped_file::data() const {
+	return data_;
+}
+
+std::size_t mapped_file::size() const {
+	return size_;
+}
+
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include <cstddef>
+
+namespace rt {
+
+// A whole file mapped read-only into memory, so that reading it only pages in what is touched.
+struct mapped_file {
+	mapped_file(const std::string &path); // data() is null if the file cannot be opened or mapped
+	~mapped_file();
+	mapped_file(const mapped_file &) = delete;
+
+	const char *data() const;
+	std::size_t size() const;
+
+private:
+	const char *data_;
+	std::size_t size_;
+#ifdef _WIN32
+	void *file_; // HANDLE of the file
+	void *mapping_; // HANDLE of its file mapping
+#endif
+};
+
+}
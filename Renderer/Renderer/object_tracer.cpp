@@ -43,11 +43,23 @@ vec3 object_tracer::trace(const ray &r) {
 	return trace_(r, 0, inside_stacks_[0]);
 }
 
+vec3 object_tracer::shade(const ray &r, primitive *pr, const intersect_info &info) {
+	inside_stacks_[0].clear();
+	return shade_(r, pr, info, 0, inside_stacks_[0]);
+}
+
 vec3 object_tracer::trace_(const ray &r, std::size_t depth, const std::vector<object *> &inside_stack) {
-	vec3 L(0.0f, 0.0f, 0.0f);
 	primitive *pr;
 	intersect_info info;
-	if(scn_.intersect(r, info, pr)) {
+	if(!scn_.intersect(r, info, pr)) {
+		pr = nullptr;
+	}
+	return shade_(r, pr, info, depth, inside_stack);
+}
+
+vec3 object_tracer::shade_(const ray &r, primitive *pr, intersect_info info, std::size_t depth, const std::vector<object *> &inside_stack) {
+	vec3 L(0.0f, 0.0f, 0.0f);
+	if(pr != nullptr) {
 		auto pos(r.position(info.t));
 		L += vec3(info.mat.amb_color.r*info.mat.diff_color.r, info.mat.amb_color.g*info.mat.diff_color.g, info.mat.amb_color.b*info.mat.diff_color.b)*(1.0f - info.mat.ktran);
 		auto normal(info.normal);
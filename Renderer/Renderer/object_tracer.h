@@ -14,8 +14,12 @@ struct object_tracer {
 
 	vec3 trace(const ray &r);
 
+	// Like trace, but with the closest hit of r already found (pr is nullptr if r hits nothing), e.g. by scene::intersect_packet.
+	vec3 shade(const ray &r, primitive *pr, const intersect_info &info);
+
 private:
 	vec3 trace_(const ray &r, std::size_t depth, const std::vector<object *> &inside_stack);
+	vec3 shade_(const ray &r, primitive *pr, intersect_info info, std::size_t depth, const std::vector<object *> &inside_stack);
 
 private:
 	const scene &scn_;
@@ -17,12 +17,12 @@ const material &patch::mat() const {
 	return mat_;
 }
 
-vec3 patch::normal() const {
-	return normal_;
+void patch::set_mat(const material &mat) {
+	mat_ = mat;
 }
 
-std::unique_ptr<patch_state> patch::new_state() const {
-	return std::unique_ptr<patch_state>(new patch_state(this));
+vec3 patch::normal() const {
+	return normal_;
 }
 
 }
\ No newline at end of file
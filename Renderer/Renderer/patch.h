@@ -4,7 +4,6 @@
 #include "material.h"
 #include "object.h"
 #include "patch_vertex.h"
-#include "patch_state.h"
 
 #include <GL/glew.h>
 #include <vector>
@@ -18,6 +17,7 @@ struct patch {
 
 	object *obj() const;
 	const material &mat() const;
+	void set_mat(const material &mat);
 	vec3 normal() const;
 
 	// Render the patch to an array of triangle vertices (every 3 vertices defines a triangle).
@@ -28,8 +28,6 @@ struct patch {
 	virtual vec3 surface_dir() const = 0; // provides an arbitrary direction along the surface
 	virtual float area() const = 0;
 
-	std::unique_ptr<patch_state> new_state() const;
-	
 private:
 	object *obj_;
 	material mat_;
@@ -0,0 +1,190 @@
+#include "patch_states.h"
+#include "patch.h"
+
+#include <cassert>
+#include <cmath>
+
+namespace rt {
+
+patch_states::patch_states(simd_level level) :
+	level_(level)
+{
+	// The null patch: no energy, and nothing reflected (with an area of 1 so that receive needs no special case)
+	for(std::size_t c(0); c != 3; ++c) {
+		energy_[c].push_back(0.0f);
+		unshot_[c].push_back(0.0f);
+		diffuse_[c].push_back(0.0f);
+	}
+	area_.push_back(1.0f);
+}
+
+std::uint32_t patch_states::add(const patch &p) {
+	auto index{std::uint32_t(size())};
+	auto emiss(p.mat().emiss_color);
+	auto diff(p.mat().diff_color);
+	for(std::size_t c(0); c != 3; ++c) {
+		energy_[c].push_back(diff[c]*emiss[c]);
+		unshot_[c].push_back(diff[c]*emiss[c]);
+		diffuse_[c].push_back(diff[c]);
+	}
+	area_.push_back(p.area());
+	return index;
+}
+
+void patch_states::replace(std::size_t i, const patch &p) {
+	assert(i != 0 && i < size());
+	auto diff(p.mat().diff_color);
+	for(std::size_t c(0); c != 3; ++c) {
+		diffuse_[c][i] = diff[c];
+	}
+	area_[i] = p.area();
+}
+
+std::size_t patch_states::size() const {
+	return area_.size();
+}
+
+float patch_states::area(std::size_t i) const {
+	return area_[i];
+}
+
+vec3 patch_states::energy(std::size_t i) const {
+	return vec3(energy_[0][i], energy_[1][i], energy_[2][i]);
+}
+
+void patch_states::set_energy(std::size_t i, const vec3 &energy) {
+	for(std::size_t c(0); c != 3; ++c) {
+		energy_[c][i] = energy[c];
+	}
+}
+
+vec3 patch_states::unshot_energy(std::size_t i) const {
+	return vec3(unshot_[0][i], unshot_[1][i], unshot_[2][i]);
+}
+
+void patch_states::set_unshot_energy(std::size_t i, const vec3 &energy) {
+	for(std::size_t c(0); c != 3; ++c) {
+		unshot_[c][i] = energy[c];
+	}
+}
+
+float patch_states::unshot_power(std::size_t i) const {
+	return (std::abs(unshot_[0][i]) + std::abs(unshot_[1][i]) + std::abs(unshot_[2][i]))*area_[i];
+}
+
+vec3 patch_states::diffuse(std::size_t i) const {
+	return vec3(diffuse_[0][i], diffuse_[1][i], diffuse_[2][i]);
+}
+
+void patch_states::set_diffuse(std::size_t i, const vec3 &diffuse) {
+	assert(i != 0);
+	for(std::size_t c(0); c != 3; ++c) {
+		diffuse_[c][i] = diffuse[c];
+	}
+}
+
+void patch_states::receive_cells(const vec3 *power, const float *const *ffs, std::size_t count, std::size_t begin, std::size_t end, std::vector<std::uint32_t> &receivers) {
+	for(auto j(begin); j != end; ++j) {
+		vec3 received(0.0f);
+		auto any(false);
+		for(std::size_t s(0); s != count; ++s) {
+			received += power[s]*ffs[s][j];
+			any |= ffs[s][j] != 0.0f;
+		}
+		if(!any) {
+			continue;
+		}
+		receivers.push_back(std::uint32_t(j));
+		for(std::size_t c(0); c != 3; ++c) {
+			auto delta(received[c]*diffuse_[c][j]/area_[j]);
+			energy_[c][j] += delta;
+			unshot_[c][j] += delta;
+		}
+	}
+}
+
+#ifdef RT_SIMD_X86
+
+std::size_t patch_states::receive_sse(const vec3 *power, const float *const *ffs, std::size_t count, std::vector<std::uint32_t> &receivers) {
+	auto n(size() & ~std::size_t(3));
+	for(std::size_t j(0); j != n; j += 4) {
+		__m128 received[3] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+		auto any(_mm_setzero_ps());
+		for(std::size_t s(0); s != count; ++s) {
+			auto f(_mm_loadu_ps(ffs[s] + j));
+			any = _mm_or_ps(any, f);
+			for(std::size_t c(0); c != 3; ++c) {
+				received[c] = _mm_add_ps(received[c], _mm_mul_ps(_mm_set1_ps(power[s][c]), f));
+			}
+		}
+		auto mask(_mm_movemask_ps(_mm_cmpneq_ps(any, _mm_setzero_ps())));
+		if(mask == 0) {
+			continue;
+		}
+		for(std::size_t lane(0); lane != 4; ++lane) {
+			if(mask & (1 << lane)) {
+				receivers.push_back(std::uint32_t(j + lane));
+			}
+		}
+		auto area(_mm_loadu_ps(&area_[j]));
+		for(std::size_t c(0); c != 3; ++c) {
+			auto delta(_mm_div_ps(_mm_mul_ps(received[c], _mm_loadu_ps(&diffuse_[c][j])), area));
+			_mm_storeu_ps(&energy_[c][j], _mm_add_ps(_mm_loadu_ps(&energy_[c][j]), delta));
+			_mm_storeu_ps(&unshot_[c][j], _mm_add_ps(_mm_loadu_ps(&unshot_[c][j]), delta));
+		}
+	}
+	return n;
+}
+
+RT_TARGET_AVX2 std::size_t patch_states::receive_avx2(const vec3 *power, const float *const *ffs, std::size_t count, std::vector<std::uint32_t> &receivers) {
+	auto n(size() & ~std::size_t(7));
+	for(std::size_t j(0); j != n; j += 8) {
+		__m256 received[3] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+		auto any(_mm256_setzero_ps());
+		for(std::size_t s(0); s != count; ++s) {
+			auto f(_mm256_loadu_ps(ffs[s] + j));
+			any = _mm256_or_ps(any, f);
+			for(std::size_t c(0); c != 3; ++c) {
+				received[c] = _mm256_add_ps(received[c], _mm256_mul_ps(_mm256_set1_ps(power[s][c]), f));
+			}
+		}
+		auto mask(_mm256_movemask_ps(_mm256_cmp_ps(any, _mm256_setzero_ps(), _CMP_NEQ_UQ)));
+		if(mask == 0) {
+			continue;
+		}
+		for(std::size_t lane(0); lane != 8; ++lane) {
+			if(mask & (1 << lane)) {
+				receivers.push_back(std::uint32_t(j + lane));
+			}
+		}
+		auto area(_mm256_loadu_ps(&area_[j]));
+		for(std::size_t c(0); c != 3; ++c) {
+			auto delta(_mm256_div_ps(_mm256_mul_ps(received[c], _mm256_loadu_ps(&diffuse_[c][j])), area));
+			_mm256_storeu_ps(&energy_[c][j], _mm256_add_ps(_mm256_loadu_ps(&energy_[c][j]), delta));
+			_mm256_storeu_ps(&unshot_[c][j], _mm256_add_ps(_mm256_loadu_ps(&unshot_[c][j]), delta));
+		}
+	}
+	_mm256_zeroupper();
+	return n;
+}
+
+#endif
+
+void patch_states::receive(const vec3 *power, const float *const *ffs, std::size_t count, std::vector<std::uint32_t> &receivers) {
+	std::size_t done(0);
+#ifdef RT_SIMD_X86
+	switch(level_) {
+		case simd_level::avx2:
+			done = receive_avx2(power, ffs, count, receivers);
+			break;
+		case simd_level::sse:
+			done = receive_sse(power, ffs, count, receivers);
+			break;
+		default:
+			break;
+	}
+#endif
+	receive_cells(power, ffs, count, done, size(), receivers);
+}
+
+}
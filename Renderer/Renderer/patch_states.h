@@ -0,0 +1,54 @@
+#pragma once
+
+#include "vec3.h"
+#include "simd.h"
+
+#include <array>
+#include <vector>
+#include <cstdint>
+
+namespace rt {
+
+struct patch;
+
+// The radiosity state of every patch of a radiosity_scene, kept as one contiguous array per component (rather than an object per patch)
+// so that shooting streams over the receivers. Index 0 is the null patch, which reflects nothing.
+struct patch_states {
+	// level: Instruction set used by receive (AVX2 or SSE, or a scalar loop if `level` has neither).
+	patch_states(simd_level level = cpu_simd_level()); // Holds only the null patch
+
+	// Appends the state of p, which starts with the energy it emits, all of it unshot. Returns its index.
+	std::uint32_t add(const patch &p);
+	// Replaces the area and reflectance of patch i with those of p (which covers part of it after a split), keeping its energy and unshot energy.
+	void replace(std::size_t i, const patch &p);
+
+	std::size_t size() const;
+	float area(std::size_t i) const;
+	vec3 energy(std::size_t i) const;
+	void set_energy(std::size_t i, const vec3 &energy);
+	vec3 unshot_energy(std::size_t i) const;
+	void set_unshot_energy(std::size_t i, const vec3 &energy);
+	float unshot_power(std::size_t i) const; // The magnitude of the unshot energy (summed over the channels) times the area. Overshooting can make unshot energy negative.
+	vec3 diffuse(std::size_t i) const; // The diffuse reflectance
+	void set_diffuse(std::size_t i, const vec3 &diffuse);
+
+	// Shoots `count` patches at once: every patch j gets sum(power[s]*ffs[s][j]) times its diffuse reflectance over its area
+	// added to its energy and unshot energy, where power[s] is the unshot energy of shooter s times its area.
+	// ffs[s] holds size() form factors; a shooter's own form factor should be 0 unless it is to receive from itself.
+	// The indices of the patches with a nonzero form factor are appended to receivers. Form factors are mostly sparse, so the other patches
+	// (in runs of 8 or 4 with SIMD) are skipped without touching their state.
+	void receive(const vec3 *power, const float *const *ffs, std::size_t count, std::vector<std::uint32_t> &receivers);
+
+private:
+	void receive_cells(const vec3 *power, const float *const *ffs, std::size_t count, std::size_t begin, std::size_t end, std::vector<std::uint32_t> &receivers);
+	std::size_t receive_sse(const vec3 *power, const float *const *ffs, std::size_t count, std::vector<std::uint32_t> &receivers); // Returns the number of patches done 4 at a time
+	std::size_t receive_avx2(const vec3 *power, const float *const *ffs, std::size_t count, std::vector<std::uint32_t> &receivers); // Returns the number of patches done 8 at a time
+
+	simd_level level_;
+	std::array<std::vector<float>, 3> energy_; // Red, green and blue energy of every patch
+	std::array<std::vector<float>, 3> unshot_; // Red, green and blue unshot energy of every patch
+	std::array<std::vector<float>, 3> diffuse_; // Red, green and blue diffuse reflectance of every patch
+	std::vector<float> area_;
+};
+
+}
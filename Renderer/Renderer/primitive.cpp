@@ -18,4 +18,13 @@ object *primitive::obj() const {
 	return obj_;
 }
 
+bool primitive::intersect(const ray &r, intersect_info &info) const {
+	hit_info h;
+	if(hit(r, h)) {
+		surface_interaction(r, h, info);
+		return true;
+	}
+	return false;
+}
+
 }
\ No newline at end of file
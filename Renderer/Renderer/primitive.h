@@ -5,12 +5,12 @@
 #include "object.h"
 #include "material.h"
 #include "intersect_info.h"
-#include "patch_state.h"
 
 #include <variant.hpp> 
 
 #include <cstdint>
 #include <memory>
+#include <vector>
 
 namespace rt {
 
@@ -25,13 +25,18 @@ struct primitive {
 
 	primitive_type type() const;
 	object *obj() const;
-	virtual bool intersect(const ray &r, intersect_info &info) const = 0;
+	// Cheap hit test: finds where r first hits the primitive, without computing the normal, uv or material there.
+	virtual bool hit(const ray &r, hit_info &h) const = 0;
+	// Fills in info for a hit found by hit(). Acceleration structures only call this for the closest hit.
+	virtual void surface_interaction(const ray &r, const hit_info &h, intersect_info &info) const = 0;
+	// hit followed by surface_interaction.
+	bool intersect(const ray &r, intersect_info &info) const;
 	virtual const aabb &bounds() const = 0;
 
 public:
-	// If using radiosity, contains the patches composing this primitive.
+	// If using radiosity, contains the indices of the patches composing this primitive (in radiosity_scene::patches and radiosity_scene::states).
 	// A patch containing (u, v) is at index (floor(u*radiosity_patches[0].size()), floor(v*radiosity_patches.size())).
-	std::shared_ptr<std::vector<std::vector<patch_state *>>> radiosity_patches;
+	std::shared_ptr<std::vector<std::vector<std::uint32_t>>> radiosity_patches;
 	bool patches_u_loop; // Whether the radiosity patches are in a loop in the u direction (e.g. a sphere) and can be interpolated across the other side of the grid
 	bool patches_v_loop; // Like patches_u_loop but for the v direction
 
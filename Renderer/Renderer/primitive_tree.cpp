@@ -1,8 +1,15 @@
 #include "primitive_tree.h"
+#include "config.h"
 
+#include <cassert>
 #include <iostream>
 #include <limits>
 #include <vector>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <future>
+#include <stdexcept>
 
 // Estimated cost of traversal.
 static auto cost_trav(0.5f);
@@ -18,6 +25,24 @@ bool pt_node::leaf() const {
 	return !lr[0] && !lr[1];
 }
 
+static_assert(sizeof(pt_flat_node) == 8, "pt_flat_node should be 8 bytes");
+
+bool pt_flat_node::leaf() const {
+	return (bits & 3) == leaf_flag;
+}
+
+std::size_t pt_flat_node::split_axis() const {
+	return bits & 3;
+}
+
+std::uint32_t pt_flat_node::left() const {
+	return bits >> 2;
+}
+
+std::uint32_t pt_flat_node::num_primitives() const {
+	return bits >> 2;
+}
+
 }
 
 static std::pair<aabb, aabb> split_aabb(const aabb &bounds, size_t axis, float pos) {
@@ -38,6 +63,11 @@ static std::pair<aabb, aabb> split_aabb(const aabb &bounds, size_t axis, float p
 	};
 }
 
+// Surface area of a box with extents `ext`, computed like aabb::surface_area.
+static float surface_area(const std::array<float, 3> &ext) {
+	return 2.0f*ext[0]*ext[1] + 2.0f*ext[0]*ext[2] + 2.0f*ext[1]*ext[2];
+}
+
 // SAH cost for a split volume
 static float sah_cost(float sa_v, float sa_l, float sa_r, std::size_t prims_left, std::size_t prims_right) {
 	return cost_trav + sa_l/sa_v*cost_primitive*prims_left + sa_r/sa_v*cost_primitive*prims_right;
@@ -49,7 +79,7 @@ static float sah_cost(std::size_t prims) {
 }
 
 struct split_event {
-	enum type : int {
+	enum type : std::uint8_t {
 		minus_prim,
 		cont_prim,
 		plus_prim
@@ -59,231 +89,469 @@ struct split_event {
 		return pos < o.pos || pos == o.pos && tp < o.tp;
 	}
 
-	type tp;
 	float pos;
+	std::uint32_t prim; // Index into the primitive list
+	type tp;
 };
 
-static std::unique_ptr<detail::pt_node> construct(const std::vector<primitive *> &primitives, const aabb &bounds) {
-	// "On building fast kd-Trees for Ray Tracing, and on doing that in O(N log N)" Section 4.2 Algorithm 4
+// Sorted split events of a node, one list per axis.
+typedef std::array<std::vector<split_event>, 3> split_events;
+
+// Subtrees with at least this many primitives are built on a separate thread...
+static const std::size_t parallel_min_prims(4096);
+// ...as long as they are no deeper than this (which bounds the number of build threads).
+static const std::size_t parallel_max_depth(6);
+
+// Where a primitive goes when a node is split.
+enum split_side : std::uint8_t {
+	side_left,
+	side_right,
+	side_both
+};
+
+// State owned by one build thread.
+struct build_context {
+	build_context(const std::vector<aabb> &prim_bounds) :
+		prim_bounds(prim_bounds),
+		sides(prim_bounds.size()),
+		max_depth(0)
+	{
+	}
+
+	const std::vector<aabb> &prim_bounds;
+	std::vector<split_side> sides; // Scratch space for classifying the primitives of the node being split (indexed by primitive)
+	std::size_t max_depth;
+};
+
+// Appends the events of a primitive with (clipped) bounds `box` to each axis of `evts`.
+static void add_events(split_events &evts, std::uint32_t prim, const aabb &box) {
+	for(std::size_t axis(0); axis != 3; ++axis) {
+		auto min(box.minmax[0][axis]);
+		auto max(box.minmax[1][axis]);
+		if(min == max) {
+			evts[axis].emplace_back(split_event{min, prim, split_event::cont_prim});
+		} else {
+			evts[axis].emplace_back(split_event{min, prim, split_event::plus_prim});
+			evts[axis].emplace_back(split_event{max, prim, split_event::minus_prim});
+		}
+	}
+}
+
+static aabb clip_aabb(const aabb &a, const aabb &b) {
+	return {
+		{std::max(a.minmax[0].x, b.minmax[0].x), std::max(a.minmax[0].y, b.minmax[0].y), std::max(a.minmax[0].z, b.minmax[0].z)},
+		{std::min(a.minmax[1].x, b.minmax[1].x), std::min(a.minmax[1].y, b.minmax[1].y), std::min(a.minmax[1].z, b.minmax[1].z)}
+	};
+}
+
+// Sets `out` to the sorted union of the sorted events `only` and the unsorted events `both`.
+static void merge_events(std::vector<split_event> &out, std::vector<split_event> &only, std::vector<split_event> &both) {
+	if(both.empty()) {
+		out = std::move(only);
+		return;
+	}
+	std::sort(both.begin(), both.end());
+	out.resize(only.size() + both.size());
+	std::merge(only.begin(), only.end(), both.begin(), both.end(), out.begin());
+}
+
+static std::unique_ptr<detail::pt_node> make_leaf(const aabb &bounds, const split_events &evts) {
+	// Every primitive has exactly one plus_prim or cont_prim event per axis.
+	std::vector<std::uint32_t> prims;
+	for(auto &e : evts[0]) {
+		if(e.tp != split_event::minus_prim) {
+			prims.push_back(e.prim);
+		}
+	}
 	std::unique_ptr<detail::pt_node> node(new detail::pt_node{bounds});
-	if(primitives.size() <= 1 || bounds.surface_area() < std::numeric_limits<float>::epsilon()) {
-		node->data.emplace(detail::pt_leaf_data{primitives});
-		return node;
+	node->data.emplace(detail::pt_leaf_data{std::move(prims)});
+	return node;
+}
+
+static std::unique_ptr<detail::pt_node> construct(build_context &ctx, split_events &evts, std::size_t num_prims, const aabb &bounds, std::size_t depth) {
+	// "On building fast kd-Trees for Ray Tracing, and on doing that in O(N log N)" Section 4.2 Algorithm 4 (split search) and Section 5 (O(N log N) construction):
+	// the events of each axis are sorted once at the root, and each split partitions them into the (still sorted) event lists of the children.
+	ctx.max_depth = std::max(ctx.max_depth, depth);
+	if(num_prims <= 1 || depth == RT_TREE_MAX_DEPTH || bounds.surface_area() < std::numeric_limits<float>::epsilon()) {
+		return make_leaf(bounds, evts);
 	}
 	size_t best_split_axis(-1);
 	float best_split_pos(std::numeric_limits<float>::quiet_NaN());
 	auto best_split_side(false); // The side on which to place primitives perpendicular to the split axis: false = left, true = right
 	auto best_cost(std::numeric_limits<float>::infinity());
-	std::vector<split_event> evts;
-	// std::cout << "===" << std::endl;
+	auto sa_v(bounds.surface_area());
+	const std::array<float, 3> ext{{bounds.minmax[1].x - bounds.minmax[0].x, bounds.minmax[1].y - bounds.minmax[0].y, bounds.minmax[1].z - bounds.minmax[0].z}};
 	for(std::size_t axis(0); axis != 3; ++axis) {
-		// std::cout << "axis = " << axis << std::endl;
-		evts.clear();
-		// std::cout << "bounds.minmax[0] = " << bounds.minmax[0].x << "," << bounds.minmax[0].y << "," << bounds.minmax[0].z << std::endl;
-		// std::cout << "bounds.minmax[1] = " << bounds.minmax[1].x << "," << bounds.minmax[1].y << "," << bounds.minmax[1].z << std::endl;
-		for(auto *pr : primitives) {
-			const auto &pr_bounds(pr->bounds());
-			// std::cout << "pr_bounds.minmax[0] = " << pr_bounds.minmax[0].x << "," << pr_bounds.minmax[0].y << "," << pr_bounds.minmax[0].z << std::endl;
-			// std::cout << "pr_bounds.minmax[1] = " << pr_bounds.minmax[1].x << "," << pr_bounds.minmax[1].y << "," << pr_bounds.minmax[1].z << std::endl;
-			auto min(std::max(pr_bounds.minmax[0][axis], bounds.minmax[0][axis]));
-			auto max(std::min(pr_bounds.minmax[1][axis], bounds.minmax[1][axis]));
-			if(min == max) {
-				evts.emplace_back(split_event{split_event::cont_prim, min});
-				// std::cout << "adding event: {cont_prim, " << min << "}" << std::endl;
-			} else {
-				evts.emplace_back(split_event{split_event::plus_prim, min});
-				evts.emplace_back(split_event{split_event::minus_prim, max});
-				// std::cout << "adding event: {plus_prim, " << min << "}" << std::endl;
-				// std::cout << "adding event: {minus_prim, " << max << "}" << std::endl;
-			}
-		}
+		const auto &ev(evts[axis]);
+		auto ext_l(ext);
+		auto ext_r(ext);
+		auto axis_min(bounds.minmax[0][axis]);
+		auto axis_max(bounds.minmax[1][axis]);
 		std::size_t prims_left(0);
 		std::size_t prims_cont(0);
-		std::size_t prims_right(primitives.size());
-		std::sort(evts.begin(), evts.end());
+		std::size_t prims_right(num_prims);
 		std::size_t i(0);
-		while(i != evts.size()) {
+		while(i != ev.size()) {
 			std::size_t minus_prim(0);
 			std::size_t cont_prim(0);
 			std::size_t plus_prim(0);
-			auto pos(evts[i].pos);
-			while(i != evts.size() && evts[i].pos == pos && evts[i].tp == split_event::minus_prim) {
+			auto pos(ev[i].pos);
+			while(i != ev.size() && ev[i].pos == pos && ev[i].tp == split_event::minus_prim) {
 				++minus_prim;
 				++i;
 			}
-			while(i != evts.size() && evts[i].pos == pos && evts[i].tp == split_event::cont_prim) {
+			while(i != ev.size() && ev[i].pos == pos && ev[i].tp == split_event::cont_prim) {
 				++cont_prim;
 				++i;
 			}
-			while(i != evts.size() && evts[i].pos == pos && evts[i].tp == split_event::plus_prim) {
+			while(i != ev.size() && ev[i].pos == pos && ev[i].tp == split_event::plus_prim) {
 				++plus_prim;
 				++i;
 			}
 			prims_cont = cont_prim;
 			prims_right -= cont_prim;
 			prims_right -= minus_prim;
-			auto ch(split_aabb(bounds, axis, pos));
-			auto sa_v(bounds.surface_area());
-			auto sa_l(ch.first.surface_area());
-			auto sa_r(ch.second.surface_area());
+			ext_l[axis] = pos - axis_min;
+			ext_r[axis] = axis_max - pos;
+			auto sa_l(surface_area(ext_l));
+			auto sa_r(surface_area(ext_r));
 			auto c_side_left(sah_cost(sa_v, sa_l, sa_r, prims_left + prims_cont, prims_right));
 			auto c_side_right(sah_cost(sa_v, sa_l, sa_r, prims_left, prims_right + prims_cont));
 			auto side(c_side_right < c_side_left);
 			auto cost(std::min(c_side_left, c_side_right));
-			// std::cout << pos << ": " << plus_prim << " " << cont_prim << " " << minus_prim << " " << prims_left << " " << prims_cont << " " << prims_right;
 			if(cost < best_cost) {
-				// std::cout << " (best cost!)";
 				best_split_axis = axis;
 				best_split_side = side;
 				best_split_pos = pos;
 				best_cost = cost;
 			}
-			// std::cout << std::endl;
 			prims_left += plus_prim;
 			prims_left += cont_prim;
 		}
 	}
-	auto no_split_cost(sah_cost(primitives.size()));
+	auto no_split_cost(sah_cost(num_prims));
 	if(no_split_cost < best_cost) {
-		node->data.emplace(detail::pt_leaf_data{primitives});
-		return node;
-	} else {
-		std::vector<primitive *> primitives_left;
-		std::vector<primitive *> primitives_right;
-		for(auto *pr : primitives) {
-			const auto &pr_bounds(pr->bounds());
-			auto min(pr_bounds.minmax[0][best_split_axis]);
-			auto max(pr_bounds.minmax[1][best_split_axis]);
-			if(min == best_split_pos && max == best_split_pos) {
-				if(best_split_side) {
-					primitives_right.push_back(pr);
-				} else {
-					primitives_left.push_back(pr);
-				}
+		return make_leaf(bounds, evts);
+	}
+	// Classify the primitives using the events of the split axis.
+	auto &sides(ctx.sides);
+	for(auto &e : evts[best_split_axis]) {
+		if(e.tp != split_event::minus_prim) {
+			sides[e.prim] = side_both;
+		}
+	}
+	for(auto &e : evts[best_split_axis]) {
+		if(e.tp == split_event::minus_prim && e.pos <= best_split_pos) {
+			sides[e.prim] = side_left;
+		} else if(e.tp == split_event::plus_prim && e.pos >= best_split_pos) {
+			sides[e.prim] = side_right;
+		} else if(e.tp == split_event::cont_prim) {
+			if(e.pos < best_split_pos || e.pos == best_split_pos && !best_split_side) {
+				sides[e.prim] = side_left;
 			} else {
-				if(min < best_split_pos) {
-					primitives_left.push_back(pr);
-				} 
-				if(max > best_split_pos) {
-					primitives_right.push_back(pr);
-				} 
+				sides[e.prim] = side_right;
+			}
+		}
+	}
+	auto bounds_lr(split_aabb(bounds, best_split_axis, best_split_pos));
+	// Primitives entirely on one side keep their events; the events of straddling primitives are regenerated from their bounds clipped to each child.
+	// Deeper splits therefore classify them by their clipped bounds, which can leave a primitive out of a leaf that only its full bounds reach.
+	split_events evts_left;
+	split_events evts_right;
+	split_events evts_both_left;
+	split_events evts_both_right;
+	std::size_t prims_left(0);
+	std::size_t prims_right(0);
+	for(auto &e : evts[0]) {
+		if(e.tp == split_event::minus_prim) {
+			continue;
+		}
+		switch(sides[e.prim]) {
+			case side_left:
+				++prims_left;
+				break;
+			case side_right:
+				++prims_right;
+				break;
+			case side_both: {
+				++prims_left;
+				++prims_right;
+				const auto &pr_bounds(ctx.prim_bounds[e.prim]);
+				add_events(evts_both_left, e.prim, clip_aabb(pr_bounds, bounds_lr.first));
+				add_events(evts_both_right, e.prim, clip_aabb(pr_bounds, bounds_lr.second));
+				break;
 			}
 		}
-		// std::cout << "===" << std::endl;
-		// std::cout << "primitives.size() = " << primitives.size() << std::endl;
-		// std::cout << "no_split_cost = " << no_split_cost << ", best_cost = " << best_cost << std::endl;
-		// std::cout << "best_split_pos = " << best_split_pos << std::endl;
-		// std::cout << "primitives_left.size() = " << primitives_left.size() << std::endl;
-		// std::cout << "primitives_right.size() = " << primitives_right.size() << std::endl;
-		auto bounds_lr(split_aabb(bounds, best_split_axis, best_split_pos));
-		node->data.emplace(detail::pt_interior_data{best_split_axis, best_split_pos});
-		node->lr[0] = construct(primitives_left, bounds_lr.first);
-		node->lr[1] = construct(primitives_right, bounds_lr.second);
-		return node;
 	}
+	for(std::size_t axis(0); axis != 3; ++axis) {
+		std::vector<split_event> only_left;
+		std::vector<split_event> only_right;
+		only_left.reserve(2*prims_left);
+		only_right.reserve(2*prims_right);
+		for(auto &e : evts[axis]) {
+			switch(sides[e.prim]) {
+				case side_left:
+					only_left.push_back(e);
+					break;
+				case side_right:
+					only_right.push_back(e);
+					break;
+				default:
+					break;
+			}
+		}
+		evts[axis].clear();
+		evts[axis].shrink_to_fit();
+		merge_events(evts_left[axis], only_left, evts_both_left[axis]);
+		merge_events(evts_right[axis], only_right, evts_both_right[axis]);
+	}
+	std::unique_ptr<detail::pt_node> node(new detail::pt_node{bounds});
+	node->data.emplace(detail::pt_interior_data{best_split_axis, best_split_pos});
+	if(depth < parallel_max_depth && std::min(prims_left, prims_right) >= parallel_min_prims) {
+		// Build the left subtree on another thread, with its own build context.
+		auto left(std::async(std::launch::async, [&]() {
+			build_context left_ctx(ctx.prim_bounds);
+			auto n(construct(left_ctx, evts_left, prims_left, bounds_lr.first, depth + 1));
+			return std::make_pair(std::move(n), left_ctx.max_depth);
+		}));
+		node->lr[1] = construct(ctx, evts_right, prims_right, bounds_lr.second, depth + 1);
+		auto res(left.get());
+		node->lr[0] = std::move(res.first);
+		ctx.max_depth = std::max(ctx.max_depth, res.second);
+	} else {
+		node->lr[0] = construct(ctx, evts_left, prims_left, bounds_lr.first, depth + 1);
+		node->lr[1] = construct(ctx, evts_right, prims_right, bounds_lr.second, depth + 1);
+	}
+	return node;
 }
 
-static std::unique_ptr<detail::pt_node> construct_root(const std::vector<primitive *> &primitives) {
+static std::unique_ptr<detail::pt_node> construct_root(const std::vector<primitive *> &primitives, std::size_t &max_depth) {
 	if(primitives.size() == 0) {
 		return nullptr;
 	}
-	auto bounds((*primitives.begin())->bounds());
-	for(auto it(primitives.begin()+1); it != primitives.end(); ++it) {
-		bounds = aabb(bounds, (*it)->bounds());
+	std::vector<aabb> prim_bounds;
+	prim_bounds.reserve(primitives.size());
+	for(auto *pr : primitives) {
+		prim_bounds.push_back(pr->bounds());
+	}
+	auto bounds(prim_bounds[0]);
+	for(auto it(prim_bounds.begin()+1); it != prim_bounds.end(); ++it) {
+		bounds = aabb(bounds, *it);
+	}
+	split_events evts;
+	for(std::size_t axis(0); axis != 3; ++axis) {
+		evts[axis].reserve(2*primitives.size());
+	}
+	for(std::size_t i(0); i != prim_bounds.size(); ++i) {
+		add_events(evts, std::uint32_t(i), prim_bounds[i]);
 	}
-	return construct(primitives, bounds);
+	{
+		// The only full sorts of the build.
+		auto sort_y(std::async(std::launch::async, [&]() {
+			std::sort(evts[1].begin(), evts[1].end());
+		}));
+		auto sort_z(std::async(std::launch::async, [&]() {
+			std::sort(evts[2].begin(), evts[2].end());
+		}));
+		std::sort(evts[0].begin(), evts[0].end());
+		sort_y.get();
+		sort_z.get();
+	}
+	build_context ctx(prim_bounds);
+	auto root(construct(ctx, evts, primitives.size(), bounds, 0));
+	max_depth = ctx.max_depth;
+	return root;
 }
 
 primitive_tree::primitive_tree(const std::vector<primitive *> &primitives) :
-	root_(construct_root(primitives))
+	primitives_(primitives),
+	depth_(0),
+	build_memory_usage_(0)
 {
+	auto start(std::chrono::steady_clock::now());
+	auto root(construct_root(primitives, depth_));
+	if(root) {
+		bounds_.emplace(root->bounds);
+		nodes_.emplace_back();
+		flatten(*root, 0);
+	}
+	build_time_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void primitive_tree::flatten(const detail::pt_node &node, std::uint32_t index) {
+	build_memory_usage_ += sizeof(detail::pt_node);
+	if(node.leaf()) {
+		auto &d(mpark::get<detail::pt_leaf_data>(*node.data));
+		build_memory_usage_ += d.primitives.capacity()*sizeof(std::uint32_t);
+		// Beyond these the counts would wrap around in the flat node, silently corrupting the tree
+		if(d.primitives.size() >= detail::pt_flat_node::max_field || primitive_indices_.size() + d.primitives.size() > std::numeric_limits<std::uint32_t>::max()) {
+			throw std::runtime_error("Too many primitive references for primitive_tree");
+		}
+		auto &n(nodes_[index]);
+		n.primitives_offset = std::uint32_t(primitive_indices_.size());
+		n.bits = (std::uint32_t(d.primitives.size()) << 2) | detail::pt_flat_node::leaf_flag;
+		primitive_indices_.insert(primitive_indices_.end(), d.primitives.begin(), d.primitives.end());
+	} else {
+		auto &d(mpark::get<detail::pt_interior_data>(*node.data));
+		if(nodes_.size() + 1 >= detail::pt_flat_node::max_field) {
+			throw std::runtime_error("Too many nodes for primitive_tree");
+		}
+		auto left(std::uint32_t(nodes_.size()));
+		nodes_.emplace_back();
+		nodes_.emplace_back();
+		auto &n(nodes_[index]);
+		n.split_pos = d.split_pos;
+		n.bits = (left << 2) | std::uint32_t(d.split_axis);
+		flatten(*node.lr[0], left);
+		flatten(*node.lr[1], left + 1);
+	}
+}
+
+std::size_t primitive_tree::depth() const {
+	return depth_;
+}
+
+double primitive_tree::build_time() const {
+	return build_time_;
+}
+
+std::size_t primitive_tree::num_nodes() const {
+	return nodes_.size();
+}
+
+std::size_t primitive_tree::memory_usage() const {
+	return nodes_.size()*sizeof(detail::pt_flat_node) + primitive_indices_.size()*sizeof(std::uint32_t) + primitives_.size()*sizeof(primitive *);
+}
+
+std::size_t primitive_tree::build_memory_usage() const {
+	return build_memory_usage_;
+}
+
+void primitive_tree::print_stats(std::ostream &os) const {
+	os << "Built kd-tree in " << build_time_ << " sec" << std::endl;
+	os << "kd-tree: " << nodes_.size() << " nodes, depth " << depth_ << " (limit " << RT_TREE_MAX_DEPTH << "), "
+	   << memory_usage()/1024.0 << " KB (" << build_memory_usage_/1024.0 << " KB before flattening)" << std::endl;
 }
 
 struct stack_entry {
-	detail::pt_node *node;
+	const detail::pt_flat_node *node;
 	float t_enter;
 	float t_exit;
 };
 
-bool primitive_tree::intersect(const ray &r, intersect_info &info, primitive *&pr) const {
-	static std::vector<stack_entry> intersect_stack;
+// Visits the leaves pierced by r within [0, t_max] from front to back, calling leaf(node, t_enter, t_exit) until it returns true.
+template <typename Leaf>
+bool primitive_tree::traverse(const ray &r, float t_max, Leaf leaf) const {
 	// Traversal algorithm from "Review: Kd-tree Traversal Algorithms for Ray Tracing" Section 3.2
-	if(!root_) {
+	// At most one entry is pushed per level of the tree, so a stack of RT_TREE_MAX_DEPTH entries is always big enough.
+	stack_entry intersect_stack[RT_TREE_MAX_DEPTH];
+	std::size_t stack_size(0);
+	if(nodes_.empty()) {
 		return false;
 	}
-	intersect_stack.clear();
-	detail::pt_node *node;
+	const detail::pt_flat_node *node;
 	float t_enter;
 	float t_exit;
-	node = root_.get();
-	if(!node->bounds.intersect(r, t_enter, t_exit)) {
+	node = &nodes_[0];
+	if(!bounds_->intersect(r, t_enter, t_exit) || t_enter > t_max) {
 		return false;
 	}
-	intersect_stack.emplace_back(stack_entry{node, t_enter, t_exit});
-	while(!intersect_stack.empty()) {
+	t_exit = std::min(t_exit, t_max);
+	intersect_stack[stack_size++] = stack_entry{node, t_enter, t_exit};
+	while(stack_size != 0) {
 		{
-			auto &entry(*intersect_stack.rbegin());
+			auto &entry(intersect_stack[--stack_size]);
 			node = entry.node;
 			t_enter = entry.t_enter;
 			t_exit = entry.t_exit;
-			intersect_stack.pop_back();
 		}
 		while(!node->leaf()) {
-			auto &d(mpark::get<detail::pt_interior_data>(*node->data));
-			auto t((d.split_pos - r.origin[d.split_axis])*r.idir[d.split_axis]);
-			auto b(r.origin[d.split_axis] > d.split_pos);
-			auto near(node->lr[b].get());
-			auto far(node->lr[!b].get());
+			auto axis(node->split_axis());
+			auto t((node->split_pos - r.origin[axis])*r.idir[axis]);
+			auto b(r.origin[axis] > node->split_pos);
+			auto children(&nodes_[node->left()]);
+			auto near(children + b);
+			auto far(children + !b);
 			if(t >= t_exit + RT_RAY_EPSILON || t < 0) {
 				node = near;
 			} else if(t <= t_enter - RT_RAY_EPSILON) {
 				node = far;
 			} else {
-				intersect_stack.emplace_back(stack_entry{far, t, t_exit});
+				assert(stack_size != RT_TREE_MAX_DEPTH);
+				intersect_stack[stack_size++] = stack_entry{far, t, t_exit};
 				node = near;
 				t_exit = t;
 			}
 		}
-		auto &d(mpark::get<detail::pt_leaf_data>(*node->data));
-		intersect_info info_closest;
-		info_closest.t = std::numeric_limits<float>::infinity();
+		if(leaf(*node, t_enter, t_exit)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool primitive_tree::intersect(const ray &r, intersect_info &info, primitive *&pr) const {
+	return traverse(r, std::numeric_limits<float>::infinity(), [&](const detail::pt_flat_node &node, float t_enter, float t_exit) {
+		// Primitives can straddle several leaves, so only hits inside this leaf are taken: a closer hit may still be found in a later one.
+		hit_info h_closest;
+		h_closest.t = std::numeric_limits<float>::infinity();
 		primitive *pr_closest(nullptr);
 		{
-			intersect_info info;
-			for(auto pr : d.primitives) {
-				if(pr->intersect(r, info) && info.t < info_closest.t && info.t >= t_enter - RT_RAY_EPSILON && info.t <= t_exit + RT_RAY_EPSILON) {
-					info_closest = info;
+			hit_info h;
+			auto begin(primitive_indices_.begin() + node.primitives_offset);
+			auto end(begin + node.num_primitives());
+			for(auto it(begin); it != end; ++it) {
+				auto pr(primitives_[*it]);
+				if(pr->hit(r, h) && h.t < h_closest.t && h.t >= t_enter - RT_RAY_EPSILON && h.t <= t_exit + RT_RAY_EPSILON) {
+					h_closest = h;
 					pr_closest = pr;
 				}
 			}
 		}
 		if(pr_closest != nullptr) {
-			info = info_closest;
+			pr_closest->surface_interaction(r, h_closest, info);
 			pr = pr_closest;
 			return true;
 		}
-	}
-	return false;
+		return false;
+	});
+}
+
+bool primitive_tree::occluded(const ray &r, float t_max, const any_hit_fn &any_hit) const {
+	return traverse(r, t_max, [&](const detail::pt_flat_node &node, float, float) {
+		// Any hit before t_max blocks the ray, even one outside this leaf.
+		hit_info h;
+		auto begin(primitive_indices_.begin() + node.primitives_offset);
+		auto end(begin + node.num_primitives());
+		for(auto it(begin); it != end; ++it) {
+			auto pr(primitives_[*it]);
+			if(pr->hit(r, h) && h.t <= t_max && (!any_hit || any_hit(pr, h))) {
+				return true;
+			}
+		}
+		return false;
+	});
 }
 
-static void print_node(std::ostream &os, const detail::pt_node &n, int indent) {
+static void print_node(std::ostream &os, const std::vector<detail::pt_flat_node> &nodes, const std::vector<std::uint32_t> &primitive_indices, const std::vector<primitive *> &primitives, std::uint32_t index, const aabb &bounds, int indent) {
 	auto print_indent([&]() {
 		for(auto i(0); i != indent; ++i) {
 			os << "    ";
 		}
 	});
+	auto &n(nodes[index]);
 	print_indent();
-	std::cout << "// ptr: " << &n << std::endl;
+	std::cout << "// index: " << index << std::endl;
 	print_indent();
-	std::cout << "// bounds min: {" << n.bounds.minmax[0].x << "," << n.bounds.minmax[0].y << "," << n.bounds.minmax[0].z << "}" << std::endl;
+	std::cout << "// bounds min: {" << bounds.minmax[0].x << "," << bounds.minmax[0].y << "," << bounds.minmax[0].z << "}" << std::endl;
 	print_indent();
-	std::cout << "// bounds max: {" << n.bounds.minmax[1].x << "," << n.bounds.minmax[1].y << "," << n.bounds.minmax[1].z << "}" << std::endl;
+	std::cout << "// bounds max: {" << bounds.minmax[1].x << "," << bounds.minmax[1].y << "," << bounds.minmax[1].z << "}" << std::endl;
 	print_indent();
-	std::cout << "// sa: " << n.bounds.surface_area() << std::endl;
+	std::cout << "// sa: " << bounds.surface_area() << std::endl;
 	print_indent();
 	if(n.leaf()) {
-		auto &d(mpark::get<detail::pt_leaf_data>(*n.data));
-		for(auto prim : d.primitives) {
+		for(std::uint32_t i(0); i != n.num_primitives(); ++i) {
+			auto prim(primitives[primitive_indices[n.primitives_offset + i]]);
 			os << prim << " {" << std::endl;
 			print_indent(); os << "    ";
 			std::cout << "// bounds min: {" << prim->bounds().minmax[0].x << "," << prim->bounds().minmax[0].y << "," << prim->bounds().minmax[0].z << "}" << std::endl;
@@ -296,9 +564,8 @@ static void print_node(std::ostream &os, const detail::pt_node &n, int indent) {
 			print_indent();
 		}
 	} else {
-		auto &d(mpark::get<detail::pt_interior_data>(*n.data));
 		os << "split ";
-		switch(d.split_axis) {
+		switch(n.split_axis()) {
 			case 0:
 				os << "x";
 				break;
@@ -311,12 +578,13 @@ static void print_node(std::ostream &os, const detail::pt_node &n, int indent) {
 			default:
 				assert(!"Unexpected split axis");
 		}
-		os << " @ " << d.split_pos << " -> {" << std::endl;
-		print_node(os, *n.lr[0], indent + 1);
+		auto bounds_lr(split_aabb(bounds, n.split_axis(), n.split_pos));
+		os << " @ " << n.split_pos << " -> {" << std::endl;
+		print_node(os, nodes, primitive_indices, primitives, n.left(), bounds_lr.first, indent + 1);
 		os << std::endl;
 		print_indent();
 		os << "}, {" << std::endl;
-		print_node(os, *n.lr[1], indent + 1);
+		print_node(os, nodes, primitive_indices, primitives, n.left() + 1, bounds_lr.second, indent + 1);
 		os << std::endl;
 		print_indent();
 		os << "}";
@@ -324,8 +592,8 @@ static void print_node(std::ostream &os, const detail::pt_node &n, int indent) {
 }
 
 std::ostream &operator <<(std::ostream &os, const primitive_tree &tree) {
-	if(tree.root_) {
-		print_node(os, *tree.root_, 0);
+	if(!tree.nodes_.empty()) {
+		print_node(os, tree.nodes_, tree.primitive_indices_, tree.primitives_, 0, *tree.bounds_, 0);
 	} else {
 		os << "(empty)";
 	}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "accel.h"
 #include "primitive.h"
 #include "aabb.h"
 #include "intersect_info.h"
@@ -10,6 +11,7 @@
 #include <memory>
 #include <iosfwd>
 #include <vector>
+#include <cstdint>
 
 namespace rt {
 
@@ -23,12 +25,12 @@ struct pt_interior_data {
 };
 
 struct pt_leaf_data {
-	std::vector<primitive *> primitives;
+	std::vector<std::uint32_t> primitives; // Indices into the primitive list the tree was built from
 };
 
 typedef mpark::variant<pt_interior_data, pt_leaf_data> pt_node_data;
 
-// A node of a primitive_tree.
+// A node of a primitive_tree while it is being built.
 struct pt_node {
 	bool leaf() const;
 
@@ -38,17 +40,55 @@ struct pt_node {
 	std::array<std::unique_ptr<pt_node>, 2> lr;
 };
 
+// A node of a built primitive_tree (8 bytes, see "Physically Based Rendering" Section 4.4).
+// The two children of an interior node are stored next to each other in primitive_tree::nodes_.
+struct pt_flat_node {
+	static const std::uint32_t leaf_flag = 3;
+	static const std::uint32_t max_field = std::uint32_t(1) << 30; // left() and num_primitives() must be below this to fit in bits
+
+	bool leaf() const;
+	std::size_t split_axis() const;
+	std::uint32_t left() const; // Index of the left child; the right child is at left() + 1
+	std::uint32_t num_primitives() const;
+
+	union {
+		float split_pos; // Interior nodes
+		std::uint32_t primitives_offset; // Leaves: index of the first primitive in primitive_tree::primitive_indices_
+	};
+	std::uint32_t bits; // Low 2 bits: split axis, or leaf_flag for leaves. High 30 bits: left() for interior nodes, num_primitives() for leaves.
+};
+
 }
 
 // A non-owning kd-tree of primitives.
-struct primitive_tree {
+struct primitive_tree : accel {
 	primitive_tree(const std::vector<primitive *> &primitives);
 
-	bool intersect(const ray &r, intersect_info &info, primitive *&pr) const;
+	// Safe to call from several threads at once: the traversal stack lives on the caller's stack.
+	bool intersect(const ray &r, intersect_info &info, primitive *&pr) const override;
+	bool occluded(const ray &r, float t_max, const any_hit_fn &any_hit) const override;
+
+	double build_time() const override; // Seconds spent building the tree
+	std::size_t memory_usage() const override; // Bytes used by the flattened tree
+	void print_stats(std::ostream &os) const override;
+
+	std::size_t depth() const; // Depth of the deepest leaf (never more than RT_TREE_MAX_DEPTH)
+	std::size_t num_nodes() const;
+	std::size_t build_memory_usage() const; // Bytes the tree used in its pointer-based form, before being flattened
 
 private:
-	std::unique_ptr<detail::pt_node> root_;
+	template <typename Leaf>
+	bool traverse(const ray &r, float t_max, Leaf leaf) const;
+	void flatten(const detail::pt_node &node, std::uint32_t index);
+
+	std::vector<detail::pt_flat_node> nodes_; // nodes_[0] is the root
+	std::vector<std::uint32_t> primitive_indices_; // Primitives of all leaves, as indices into primitives_
+	std::vector<primitive *> primitives_;
+	optional<aabb> bounds_;
+	std::size_t depth_;
+	std::size_t build_memory_usage_;
+	double build_time_;
 	friend std::ostream &operator <<(std::ostream &os, const primitive_tree &tree);
 };
 
-}
\ No newline at end of file
+}
@@ -2,7 +2,7 @@
 
 #include "ray.h"
 #include "vec3.h"
-#include "scene.h"
+#include "radiosity_scene.h"
 
 #include <utility>
 #include <tuple>
@@ -15,8 +15,10 @@ static const auto rot_max_depth(5);
 // Intersection shaders are not supported by this tracer.
 template <bool Interpolate>
 struct radiosity_object_tracer {
+	// scn: A radiosity_scene (taken as a scene to be constructed like the other tracers).
 	radiosity_object_tracer(const scene &scn) :
-		scn_(scn)
+		scn_(static_cast<const radiosity_scene &>(scn)),
+		ambient_(scn_.params.ambient ? scn_.ambient() : vec3(0.0f))
 	{
 	}
 
@@ -24,12 +26,24 @@ struct radiosity_object_tracer {
 		return trace_(r, 0);
 	}
 
+	// Like trace, but with the closest hit of r already found (pr is nullptr if r hits nothing), e.g. by scene::intersect_packet.
+	vec3 shade(const ray &r, primitive *pr, const intersect_info &info) {
+		return shade_(r, pr, info, 0);
+	}
+
 private:
 	vec3 trace_(const ray &r, std::size_t depth) {
-		vec3 L(0.0f, 0.0f, 0.0f);
 		primitive *pr;
 		intersect_info info;
-		if(scn_.intersect(r, info, pr)) {
+		if(!scn_.intersect(r, info, pr)) {
+			pr = nullptr;
+		}
+		return shade_(r, pr, info, depth);
+	}
+
+	vec3 shade_(const ray &r, primitive *pr, const intersect_info &info, std::size_t depth) {
+		vec3 L(0.0f, 0.0f, 0.0f);
+		if(pr != nullptr) {
 			auto pos(r.position(info.t));
 			vec3 diffuse;
 			material mat;
@@ -52,14 +66,21 @@ private:
 		return L;
 	}
 
-	const scene &scn_;
+	const radiosity_scene &scn_;
+	vec3 ambient_; // Added to every patch times its diffuse reflectance (see radiosity_scene::ambient)
+
+	vec3 energy(std::uint32_t i) const {
+		auto e(scn_.states.energy(i));
+		auto d(scn_.states.diffuse(i));
+		return vec3(e.r + d.r*ambient_.r, e.g + d.g*ambient_.g, e.b + d.b*ambient_.b);
+	}
 
 	// Returns interpolated radiosity color, material, and normal.
-	static std::tuple<vec3, material, vec3> patch_info(primitive *pr, float u, float v) {
-		auto &states(*pr->radiosity_patches);
+	std::tuple<vec3, material, vec3> patch_info(primitive *pr, float u, float v) const {
+		auto &indices(*pr->radiosity_patches);
 		if(Interpolate) {
-			auto x(u*states[0].size()-0.5f);
-			auto y(v*states.size()-0.5f);
+			auto x(u*indices[0].size()-0.5f);
+			auto y(v*indices.size()-0.5f);
 			auto x1{int(x)};
 			auto y1{int(y)};
 			float tmp;
@@ -70,53 +91,58 @@ private:
 				if(std::signbit(xf)) {
 					x2 = int(x1 - 1);
 					if(x2 < 0) {
-						x2 = states[0].size() - 1;
+						x2 = indices[0].size() - 1;
 					}
 				} else {
-					x2 = int(x1 + 1) % states[0].size();
+					x2 = int(x1 + 1) % indices[0].size();
 				}
 			} else {
 				if(std::signbit(xf)) {
 					x2 = std::max(0, int(x1 - 1));
 				} else {
-					x2 = std::min(int(x1 + 1), int(states[0].size() - 1));
+					x2 = std::min(int(x1 + 1), int(indices[0].size() - 1));
 				}
 			}
 			if(pr->patches_v_loop) {
 				if(std::signbit(yf)) {
 					y2 = int(y1 - 1);
 					if(y2 < 0) {
-						y2 = states.size() - 1;
+						y2 = indices.size() - 1;
 					}
 				} else {
-					y2 = int(y1 + 1) % states.size();
+					y2 = int(y1 + 1) % indices.size();
 				}
 			} else {
 				if(std::signbit(yf)) {
 					y2 = std::max(0, int(y1 - 1));
 				} else {
-					y2 = std::min(int(y1 + 1), int(states.size() - 1));
+					y2 = std::min(int(y1 + 1), int(indices.size() - 1));
 				}
 			}
-			auto *a(states[y1][x1]);
-			auto *b(states[y1][x2]);
-			auto *c(states[y2][x1]);
-			auto *d(states[y2][x2]);
+			auto a(indices[y1][x1]);
+			auto b(indices[y1][x2]);
+			auto c(indices[y2][x1]);
+			auto d(indices[y2][x2]);
+			auto &pa(*scn_.patches[a]);
+			auto &pb(*scn_.patches[b]);
+			auto &pc(*scn_.patches[c]);
+			auto &pd(*scn_.patches[d]);
 			xf = std::abs(xf);
 			yf = std::abs(yf);
 			auto sa((1.0f - yf)*(1.0f - xf));
 			auto sb((1.0f - yf)*xf);
 			auto sc(yf*(1.0f - xf));
 			auto sd(yf*xf);
-			auto color(a->energy*sa + b->energy*sb + c->energy*sc + d->energy*sd);
-			auto mat(material::interpolate(a->p->mat(), sa, b->p->mat(), sb, c->p->mat(), sc, d->p->mat(), sd));
-			auto normal(normalize(a->p->normal()*sa + b->p->normal()*sb + c->p->normal()*sc + d->p->normal()*sd));
+			auto color(energy(a)*sa + energy(b)*sb + energy(c)*sc + energy(d)*sd);
+			auto mat(material::interpolate(pa.mat(), sa, pb.mat(), sb, pc.mat(), sc, pd.mat(), sd));
+			auto normal(normalize(pa.normal()*sa + pb.normal()*sb + pc.normal()*sc + pd.normal()*sd));
 			return std::make_tuple(color, mat, normal);
 		} else {
-			auto x{std::min(int(u*states[0].size()), int(states[0].size() - 1))};
-			auto y{std::min(int(v*states.size()), int(states.size() - 1))};
-			auto *st(states[y][x]);
-			return std::make_tuple(st->energy, st->p->mat(), st->p->normal());
+			auto x{std::min(int(u*indices[0].size()), int(indices[0].size() - 1))};
+			auto y{std::min(int(v*indices.size()), int(indices.size() - 1))};
+			auto i(indices[y][x]);
+			auto &p(*scn_.patches[i]);
+			return std::make_tuple(energy(i), p.mat(), p.normal());
 		}
 	}
 };
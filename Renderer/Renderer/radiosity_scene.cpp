@@ -8,24 +8,37 @@
 #include "gl.h"
 #include "mat4.h"
 #include "shadow_tracer.h"
+#include "hemicube.h"
+#include "radiosity_snapshot.h"
 
+#include <algorithm>
+#include <array>
 #include <cstddef>
+#include <cstdio>
 #include <vector>
 #include <numeric>
+#include <stdexcept>
+#include <thread>
 
 namespace rt {
 
-// hemicube top face vertex shader
+// hemicube vertex shader: instance i draws face i into its rows of hc_index_tex (see hemicube_row_offset), so that one draw call renders all the faces
 static const char *hc_vert_shader = R"GLSL(
 #version 140
-uniform mat4 vp; // view-projection transform
+uniform mat4 vp[5]; // view-projection transforms of the faces, which also move them to their rows of hc_index_tex
+uniform vec2 rows[5]; // normalized device y range of every face in hc_index_tex
 in vec3 pos;
 in uint index;
 flat out uint v_index;
+out float gl_ClipDistance[2];
 
 void main() {
 	v_index = index;
-	gl_Position = vp * vec4(pos, 1.0);
+	vec4 p = vp[gl_InstanceID]*vec4(pos, 1.0);
+	// Keep faces from drawing over each other
+	gl_ClipDistance[0] = p.y - rows[gl_InstanceID].x*p.w;
+	gl_ClipDistance[1] = rows[gl_InstanceID].y*p.w - p.y;
+	gl_Position = p;
 }
 )GLSL";
 
@@ -40,6 +53,62 @@ void main() {
 }
 )GLSL";
 
+// hemicube reduction vertex shader: one vertex per cell of index_tex, carrying delta form factors (the same formula as hemicube_weights)
+// to the texel of the patch seen through the cell, so that additive blending sums the form factors.
+// Neighboring cells mostly see the same patch, so the cell starting a run of cells with the same patch (cut every 32 cells) draws the run's sum,
+// and the other cells are clipped away. This keeps many points from being blended into the same texel.
+static const char *hc_reduce_vert_shader = R"GLSL(
+#version 140
+uniform usampler2D index_tex;
+uniform int res; // hemicube resolution
+uniform ivec2 ffs_size; // size of the form factor texture
+out float v_ff;
+
+const int max_run = 32;
+
+float delta_ff(int i, int j, bool side) {
+	float fs = float(res);
+	float x = 2.0*float(i)/fs - 1.0;
+	float y = 2.0*float(j)/fs - 1.0;
+	float da = 4.0/(fs*fs);
+	float div = x*x + y*y + 1.0;
+	return (side ? da*max(y, 0.0) : da)/(3.14159265*div*div); // with an odd res, side row res/2 straddles the horizon, as in hemicube_weights
+}
+
+void main() {
+	int row = gl_VertexID/res;
+	int i = gl_VertexID - row*res;
+	// The top face, followed by the upper halves of the side faces
+	bool side = row >= res;
+	int half_rows = res - res/2;
+	int j = side ? res/2 + (row - res) % half_rows : row; // the row of the face
+	uint index = texelFetch(index_tex, ivec2(i, row), 0).r;
+	if(i % max_run != 0 && texelFetch(index_tex, ivec2(i - 1, row), 0).r == index) {
+		gl_Position = vec4(2.0, 2.0, 2.0, 1.0); // outside the view volume
+		v_ff = 0.0;
+		return;
+	}
+	v_ff = delta_ff(i, j, side);
+	int end = min(res, (i/max_run + 1)*max_run);
+	for(int k = i + 1; k < end && texelFetch(index_tex, ivec2(k, row), 0).r == index; ++k) {
+		v_ff += delta_ff(k, j, side);
+	}
+	int texel_row = int(index)/ffs_size.x;
+	vec2 texel = vec2(int(index) - texel_row*ffs_size.x, texel_row) + 0.5;
+	gl_Position = vec4(2.0*texel/vec2(ffs_size) - 1.0, 0.0, 1.0);
+}
+)GLSL";
+
+static const char *hc_reduce_frag_shader = R"GLSL(
+#version 140
+in float v_ff;
+out float f_ff;
+
+void main() {
+	f_ff = v_ff;
+}
+)GLSL";
+
 static const char *hc_debug_vert_shader = R"GLSL(
 #version 140
 in vec2 pos;
@@ -57,11 +126,16 @@ static const char *hc_debug_frag_shader = R"GLSL(
 uniform usampler2D tex;
 uniform sampler1D colors;
 uniform uint highlight;
+uniform int res; // hemicube resolution
+uniform int row_offset; // see hemicube_row_offset
+uniform bool side;
 in vec2 v_texcoord;
 out vec4 f_color;
 
 void main() {
-	uint index = texture(tex, v_texcoord).r;
+	ivec2 cell = min(ivec2(v_texcoord*float(res)), ivec2(res - 1));
+	// The lower half of side faces is not rendered.
+	uint index = side && cell.y < res/2 ? 0u : texelFetch(tex, ivec2(cell.x, cell.y + row_offset), 0).r;
 	if(index > 0u) {
 		float s = highlight != 0u ? (index == highlight ? 1.0 : 0.3) : 1.0;
 		f_color = vec4(s*texelFetch(colors, int(index), 0).rgb, 1.0);
@@ -97,6 +171,20 @@ void main() {
 }
 )GLSL";
 
+// The faces of the hemicube are rendered into one hc_res wide texture, hc_index_tex: the top face takes the first hc_res rows,
+// and the upper halves of the side faces (the only part counted, see hemicube_weights) follow in face order.
+// Row j of face f is drawn into row j + hemicube_row_offset(f, res) of the texture.
+static std::size_t hemicube_rows(std::size_t res) {
+	return res + 4*(res - res/2);
+}
+
+static std::ptrdiff_t hemicube_row_offset(std::size_t face, std::size_t res) {
+	if(face == 0) {
+		return 0;
+	}
+	return std::ptrdiff_t(res + (face - 1)*(res - res/2)) - std::ptrdiff_t(res/2);
+}
+
 struct viewport_guard {
 	viewport_guard(GLint x, GLint y, GLint width, GLint height) {
 		XGL(glGetIntegerv(GL_VIEWPORT, orig_));
@@ -111,28 +199,133 @@ private:
 	GLint orig_[4];
 };
 
-radiosity_scene::radiosity_scene(SceneIO *io, const params_type &params, const shader_bindings &bindings) :
-	scene(io, bindings),
-	params(params)
+radiosity_scene::radiosity_scene(SceneIO *io, const params_type &params, const shader_bindings &bindings, const radiosity_snapshot *snapshot) :
+	scene(io, bindings, params.accel),
+	params(params),
+	form_factors_ready(false)
 {
-	init_patches();
-	init_hemicube();
+	init_patches(snapshot);
+	{
+		std::vector<float> power(states.size(), 0.0f);
+		unshot_power_total = 0.0;
+		for(std::size_t i(1); i != states.size(); ++i) {
+			power[i] = states.unshot_power(i);
+			unshot_power_total += power[i];
+		}
+		emitted_power = unshot_power_total;
+		shot_power = 0.0;
+		landed_power = 0.0;
+		unshot_power_heap = indexed_max_heap(std::move(power), 1);
+		if(snapshot_restored) {
+			emitted_power = snapshot->emitted_power();
+			shot_power = snapshot->shot_power();
+			landed_power = snapshot->landed_power();
+		}
+	}
+	// A restored scene may only be rendered, which needs no form factors (nor, with the hemicube, an OpenGL context)
+	if(!snapshot_restored) {
+		init_form_factors();
+	}
+}
+
+void radiosity_scene::init_form_factors() {
+	if(form_factors_ready) {
+		return;
+	}
+	form_factors_ready = true;
+	if(hierarchy) {
+		// Its links hold every form factor it uses, so it needs no form factor engine (nor, with the hemicube, an OpenGL context)
+		return;
+	}
+	switch(params.form_factors) {
+		case form_factor_method::hemicube:
+			init_hemicube();
+			if(!params.hc_gpu_reduction) {
+				pixel_buf.resize(params.hc_res * hemicube_rows(params.hc_res));
+				hc_weights.reset(new hemicube_weights(params.hc_res));
+			}
+			break;
+		case form_factor_method::ray_cast:
+			rc_ffs.reset(new ray_cast_form_factors(*this, params.ff_rays, ff_threads()));
+			break;
+		case form_factor_method::software_hemicube: {
+			auto verts(render_patches());
+			// An engine rasterizes at most 5 faces at once, so threads beyond that go to more engines, which step_batch runs on different shooters
+			auto threads(ff_threads());
+			auto engines(std::max(threads/5, std::size_t(1)));
+			for(std::size_t e(0); e != engines; ++e) {
+				sw_hemicubes.emplace_back(new software_hemicube(verts, params.hc_res, threads/engines));
+			}
+			break;
+		}
+		default:
+			assert(!"Unexpected form_factor_method");
+	}
 	ffs_buf.resize(patches.size());
-	pixel_buf.resize(params.hc_res * params.hc_res);
+	if(params.solver == radiosity_solver::matrix) {
+		build_form_factor_matrix();
+		if(snapshot_restored) {
+			// The restored energies are already solved, so the patches emit what their materials do (like patch_states::add)
+			for(std::uint32_t i(1); i != patches.size(); ++i) {
+				auto mat(patches[i]->mat());
+				ff_matrix->set_emission(i, vec3(mat.diff_color.r*mat.emiss_color.r, mat.diff_color.g*mat.emiss_color.g, mat.diff_color.b*mat.emiss_color.b));
+			}
+		}
+	} else if(params.ff_cache_bytes != 0) {
+		ff_cache.reset(new form_factor_cache(params.ff_cache_bytes));
+	}
+}
+
+void radiosity_scene::build_form_factor_matrix() {
+	ff_matrix.reset(new form_factor_matrix(patches.size()));
+	// In batches, so that the patches are spread over several hemicubes in flight, or over the software_hemicube engines
+	auto batch(std::max(std::max(params.shooters_per_step, sw_hemicubes.size()), std::size_t(16)));
+	if(batch_ffs_bufs.size() < batch) {
+		batch_ffs_bufs.resize(batch, std::vector<float>(patches.size()));
+	}
+	std::vector<const patch *> ps;
+	for(std::size_t first(1); first < patches.size(); first += batch) {
+		auto count(std::min(batch, patches.size() - first));
+		ps.clear();
+		for(std::size_t s(0); s != count; ++s) {
+			ps.push_back(patches[first + s].get());
+		}
+		compute_form_factors(ps, batch_ffs_bufs);
+		for(std::size_t s(0); s != count; ++s) {
+			ff_matrix->add_shooter(std::uint32_t(first + s), batch_ffs_bufs[s]);
+		}
+	}
+	ff_matrix->build(states);
+}
+
+std::size_t radiosity_scene::ff_threads() const {
+	return params.ff_threads != 0 ? params.ff_threads : std::thread::hardware_concurrency();
 }
 
 radiosity_scene::~radiosity_scene() {
+	if(!hc_prog) {
+		// The hemicube was never set up (see init_form_factors)
+		return;
+	}
 	XGL(glDeleteVertexArrays(1, &hc_vao));
 	XGL(glDeleteBuffers(1, &hc_vbo));
 	XGL(glDeleteFramebuffers(1, &hc_fbo));
 	XGL(glDeleteTextures(1, &hc_index_tex));
 	XGL(glDeleteTextures(1, &hc_depth_tex));
+	if(params.hc_gpu_reduction) {
+		XGL(glDeleteVertexArrays(1, &hc_reduce_vao));
+		XGL(glDeleteFramebuffers(1, &hc_ffs_fbo));
+		XGL(glDeleteTextures(1, &hc_ffs_tex));
+		XGL(glDeleteBuffers(1, &hc_ffs_pbo));
+	}
 
 	XGL(glDeleteVertexArrays(1, &hc_debug_vao));
 	XGL(glDeleteBuffers(1, &hc_debug_vbo));
 }
 
 void radiosity_scene::debug_render_patches(std::size_t highlight, float aspect) {
+	assert(params.form_factors == form_factor_method::hemicube);
+	init_form_factors();
 	XGL(glUseProgram(debug_prog->prog));
 	XGL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
 	XGL(glEnable(GL_DEPTH_TEST));
@@ -148,10 +341,10 @@ void radiosity_scene::debug_render_patches(std::size_t highlight, float aspect)
 		colors_buf.resize(3*patches.size());
 		for(auto i(1); i != states.size(); ++i) {
 			auto c(3*i);
-			auto &s(states[i]);
-			colors_buf[c] = std::min(s->energy.r, 1.0f);
-			colors_buf[c+1] = std::min(s->energy.g, 1.0f);
-			colors_buf[c+2] = std::min(s->energy.b, 1.0f);
+			auto e(states.energy(i));
+			colors_buf[c] = std::min(e.r, 1.0f);
+			colors_buf[c+1] = std::min(e.g, 1.0f);
+			colors_buf[c+2] = std::min(e.b, 1.0f);
 		}
 		XGL(glTexImage1D(GL_TEXTURE_1D, 0, GL_RGB, colors_buf.size()/3, 0, GL_RGB, GL_FLOAT, colors_buf.data()));
 	}
@@ -165,6 +358,8 @@ void radiosity_scene::debug_render_patches(std::size_t highlight, float aspect)
 }
 
 void radiosity_scene::debug_render_hemicube(std::size_t patch_index, std::size_t face, std::size_t highlight) {
+	assert(params.form_factors == form_factor_method::hemicube);
+	init_form_factors();
 	compute_form_factors(*patches[patch_index], ffs_buf, std::function<void(std::size_t)>([&](std::size_t f) {
 		if(f != face) {
 			return;
@@ -173,8 +368,11 @@ void radiosity_scene::debug_render_hemicube(std::size_t patch_index, std::size_t
 		auto tex_loc(glGetUniformLocation(hc_debug_prog->prog, "tex"));
 		auto colors_loc(glGetUniformLocation(hc_debug_prog->prog, "colors"));
 		auto highlight_loc(glGetUniformLocation(hc_debug_prog->prog, "highlight"));
+		XGL(glUniform1i(glGetUniformLocation(hc_debug_prog->prog, "res"), GLint(params.hc_res)));
+		XGL(glUniform1i(glGetUniformLocation(hc_debug_prog->prog, "row_offset"), GLint(hemicube_row_offset(f, params.hc_res))));
+		XGL(glUniform1i(glGetUniformLocation(hc_debug_prog->prog, "side"), f != 0));
 		XGL(glActiveTexture(GL_TEXTURE0));
-		XGL(glBindTexture(GL_TEXTURE_2D, hc_index_tex)); 
+		XGL(glBindTexture(GL_TEXTURE_2D, hc_index_tex));
 		XGL(glActiveTexture(GL_TEXTURE1));
 		XGL(glBindTexture(GL_TEXTURE_1D, hc_debug_colors_tex));
 		{
@@ -182,10 +380,10 @@ void radiosity_scene::debug_render_hemicube(std::size_t patch_index, std::size_t
 			colors_buf.resize(3*patches.size());
 			for(auto i(1); i != states.size(); ++i) {
 				auto c(3*i);
-				auto &s(states[i]);
-				colors_buf[c] = s->energy.r;
-				colors_buf[c+1] = s->energy.g;
-				colors_buf[c+2] = s->energy.b;
+				auto e(states.energy(i));
+				colors_buf[c] = e.r;
+				colors_buf[c+1] = e.g;
+				colors_buf[c+2] = e.b;
 			}
 			XGL(glTexImage1D(GL_TEXTURE_1D, 0, GL_RGB, colors_buf.size(), 0, GL_RGB, GL_FLOAT, colors_buf.data()));
 		}
@@ -204,61 +402,389 @@ void radiosity_scene::debug_render_hemicube(std::size_t patch_index, std::size_t
 }
 
 void radiosity_scene::step() {
-	// "A Progressive Refinement Approach to Fast Radiosity Image Generation"
-	if(patches.size() < 2) {
+	step_batch(1);
+}
+
+void radiosity_scene::step_batch(std::size_t k) {
+	if(patches.size() < 2 || k == 0) {
 		return;
 	}
-	// Find patch with the most unshot energy
-	patch_state *shooter(states[1].get());
-	std::size_t shooter_index(1);
-	for(auto i(2); i != states.size(); ++i) {
-		auto &st(states[i]);
-		if(st->unshot_energy_total*st->p->area() > shooter->unshot_energy_total*st->p->area()) {
-			shooter = st.get();
-			shooter_index = i;
-		}
-	}
-	// Compute form factors for that patch
-	compute_form_factors(*shooter->p, ffs_buf);
-	// Shoot
-	auto shooter_area(shooter->p->area());
-	auto shoot([&](std::size_t j) {
-		auto &st(states[j]);
-		auto k(ffs_buf[j]*shooter_area/st->p->area());
-		vec3 delta{
-			shooter->unshot_energy.r*st->p->mat().diff_color.r*k,
-			shooter->unshot_energy.g*st->p->mat().diff_color.g*k,
-			shooter->unshot_energy.b*st->p->mat().diff_color.b*k
-		};
-		st->energy += delta;
-		st->unshot_energy += delta;
-		st->unshot_energy_total += delta.r + delta.g + delta.b;
+	init_form_factors();
+	if(hierarchy || ff_matrix) {
+		for(std::size_t i(0); i != k; ++i) {
+			if(hierarchy) {
+				hierarchy->iterate(states);
+			} else {
+				ff_matrix->iterate(states, params.iteration, ff_threads());
+			}
+		}
+		for(std::uint32_t i(1); i != states.size(); ++i) {
+			update_unshot_power(i);
+		}
+		return;
+	}
+	// "A Progressive Refinement Approach to Fast Radiosity Image Generation"
+	// Find the k patches with the most unshot power
+	std::vector<std::uint32_t> shooter_indices;
+	unshot_power_heap.top(k, shooter_indices);
+	// Patches without unshot energy have nothing to shoot
+	while(shooter_indices.size() > 1 && unshot_power_heap.key(shooter_indices.back()) <= 0.0f) {
+		shooter_indices.pop_back();
+	}
+	k = shooter_indices.size();
+	// Compute form factors for those patches, except for the ones ff_cache has from an earlier step, which go last
+	if(ff_cache) {
+		std::stable_partition(shooter_indices.begin(), shooter_indices.end(), [&](std::uint32_t i) {
+			return !ff_cache->contains(i);
+		});
+	}
+	std::vector<const patch *> shooters;
+	shooters.reserve(k);
+	for(auto i : shooter_indices) {
+		if(ff_cache && ff_cache->contains(i)) {
+			break;
+		}
+		shooters.push_back(patches[i].get());
+	}
+	if(batch_ffs_bufs.size() < k) {
+		batch_ffs_bufs.resize(k, std::vector<float>(patches.size()));
+	}
+	if(ff_cache) {
+		// Before caching the new rows, which may evict these
+		for(auto s(shooters.size()); s != k; ++s) {
+			ff_cache->get(shooter_indices[s], batch_ffs_bufs[s]);
+		}
+	}
+	if(!shooters.empty()) {
+		compute_form_factors(shooters, batch_ffs_bufs);
+		if(ff_cache) {
+			for(std::size_t s(0); s != shooters.size(); ++s) {
+				ff_cache->put(shooter_indices[s], batch_ffs_bufs[s]);
+			}
+		}
+	}
+	// Shoot them all in one pass over the patches. The shooters keep what they shoot at themselves as unshot energy, and receive from each other.
+	// Overshooting leaves the energy of a shooter as it is, with what it sent too many as negative unshot energy.
+	std::vector<vec3> power; // The unshot energy of every shooter times its area
+	std::vector<const float *> ffs;
+	power.reserve(k);
+	ffs.reserve(k);
+	for(std::size_t s(0); s != k; ++s) {
+		auto i(shooter_indices[s]);
+		auto &buf(batch_ffs_bufs[s]);
+		auto unshot(states.unshot_energy(i));
+		power.push_back(unshot*(params.overshoot*states.area(i)));
+		auto p(double(params.overshoot*states.unshot_power(i)));
+		shot_power += p;
+		landed_power += p*(1.0 - buf[0]);
+		states.set_unshot_energy(i, unshot*(1.0f - params.overshoot + params.overshoot*buf[i]));
+		buf[i] = 0.0f;
+		ffs.push_back(buf.data());
+	}
+	receivers.clear();
+	states.receive(power.data(), ffs.data(), k, receivers);
+	for(auto j : receivers) {
+		if(j != 0) {
+			update_unshot_power(j);
+		}
+	}
+	for(auto i : shooter_indices) {
+		update_unshot_power(i);
+	}
+}
+
+void radiosity_scene::update_unshot_power(std::uint32_t i) {
+	auto power(states.unshot_power(i));
+	unshot_power_total += double(power) - double(unshot_power_heap.key(i));
+	unshot_power_heap.update(i, power);
+}
+
+vec3 radiosity_scene::ambient() const {
+	vec3 unshot(0.0f);
+	vec3 reflectance(0.0f);
+	auto area(0.0f);
+	for(std::size_t i(1); i < states.size(); ++i) {
+		auto a(states.area(i));
+		unshot += states.unshot_energy(i)*a;
+		reflectance += states.diffuse(i)*a;
+		area += a;
+	}
+	if(area <= 0.0f) {
+		return vec3(0.0f);
+	}
+	// Until something is shot, assume the scene is closed
+	auto landed{shot_power > 0.0 ? float(landed_power/shot_power) : 1.0f};
+	vec3 result;
+	for(std::size_t c(0); c != 3; ++c) {
+		// Energy landing on patches with the average reflectance r keeps bouncing: l + (l r) l + (l r)^2 l + ... = l/(1 - l r)
+		auto r(std::min(landed*reflectance[c]/area, 0.999f));
+		result[c] = std::max(landed*unshot[c]/area/(1.0f - r), 0.0f);
+	}
+	return result;
+}
+
+float radiosity_scene::residual() const {
+	if(emitted_power <= 0.0) {
+		return 0.0f;
+	}
+	// Rounding in the running sum may take it a hair below 0
+	return float(std::max(unshot_power_total, 0.0)/emitted_power);
+}
+
+// Doubles the resolution of a grid of patch indices, every cell becoming 2 x 2 cells of the same patch.
+static void double_grid(std::vector<std::vector<std::uint32_t>> &cells) {
+	std::vector<std::vector<std::uint32_t>> doubled;
+	doubled.reserve(2*cells.size());
+	for(auto &row : cells) {
+		std::vector<std::uint32_t> r;
+		r.reserve(2*row.size());
+		for(auto i : row) {
+			r.push_back(i);
+			r.push_back(i);
+		}
+		doubled.push_back(r);
+		doubled.push_back(std::move(r));
+	}
+	cells = std::move(doubled);
+}
+
+std::size_t radiosity_scene::refine() {
+	init_form_factors();
+	if(hierarchy || ff_matrix || patches.size() < 2) {
+		return 0;
+	}
+	// Find the patches to split: those across a cell edge of a grid from a patch with a much different energy
+	std::vector<bool> split(patches.size(), false);
+	auto differ([&](std::uint32_t a, std::uint32_t b) {
+		if(a == b) {
+			return false;
+		}
+		auto ea(states.energy(a));
+		auto eb(states.energy(b));
+		auto sa(ea.r + ea.g + ea.b);
+		auto sb(eb.r + eb.g + eb.b);
+		return std::abs(sa - sb) > params.refine_threshold*std::max(sa, sb);
+	});
+	auto mark([&](std::uint32_t a, std::uint32_t b) {
+		for(auto i : {a, b}) {
+			if(patch_cells[i].level < params.refine_levels) {
+				split[i] = true;
+			}
+		}
 	});
-	for(auto j(1); j != shooter_index; ++j) {
-		shoot(j);
+	for(auto &g : grids) {
+		auto &cells(*g.indices);
+		for(std::size_t y(0); y != cells.size(); ++y) {
+			for(std::size_t x(0); x != cells[y].size(); ++x) {
+				auto i(cells[y][x]);
+				if(x + 1 != cells[y].size() && differ(i, cells[y][x + 1])) {
+					mark(i, cells[y][x + 1]);
+				}
+				if(y + 1 != cells.size() && differ(i, cells[y + 1][x])) {
+					mark(i, cells[y + 1][x]);
+				}
+			}
+		}
+	}
+	std::vector<std::uint32_t> split_indices;
+	for(std::uint32_t i(1); i != patches.size(); ++i) {
+		if(split[i]) {
+			split_indices.push_back(i);
+		}
+	}
+	if(split_indices.empty()) {
+		return 0;
+	}
+
+	// Split them into quarters, the first one in place of the patch and the others at the end.
+	// For now the quarters keep the energy and unshot energy of the patch, and only the cells of the patch change in its grid.
+	std::vector<std::uint32_t> quarters; // Every new patch, including those in place of a split one
+	std::vector<vec3> energies; // The energy of the split patch of every quarter
+	auto first_new{std::uint32_t(patches.size())};
+	for(auto i : split_indices) {
+		auto cell(patch_cells[i]);
+		auto &g(grids[cell.grid]);
+		auto um((cell.u0 + cell.u1)/2.0f);
+		auto vm((cell.v0 + cell.v1)/2.0f);
+		std::array<patch_cell, 4> cells {{
+			{cell.grid, cell.u0, cell.v0, um, vm, cell.level + 1},
+			{cell.grid, um, cell.v0, cell.u1, vm, cell.level + 1},
+			{cell.grid, cell.u0, vm, um, cell.v1, cell.level + 1},
+			{cell.grid, um, vm, cell.u1, cell.v1, cell.level + 1}
+		}};
+		auto energy(states.energy(i));
+		auto unshot(states.unshot_energy(i));
+		auto &indices(*g.indices);
+		// Make the grid fine enough for a quarter to cover whole cells, and find the cell of the patch at its own level
+		auto quarter_cols(g.udiv << (cell.level + 1));
+		auto quarter_rows(g.vdiv << (cell.level + 1));
+		while(indices[0].size() < quarter_cols || indices.size() < quarter_rows) {
+			double_grid(indices);
+		}
+		auto cell_x(std::size_t(std::lround(cell.u0*(g.udiv << cell.level))));
+		auto cell_y(std::size_t(std::lround(cell.v0*(g.vdiv << cell.level))));
+		for(auto &q : cells) {
+			auto p(g.make_patch(q.u0, q.v0, q.u1, q.v1));
+			std::uint32_t index;
+			if(&q == &cells[0]) {
+				index = i;
+				states.replace(i, *p);
+				patches[i] = std::move(p);
+				patch_cells[i] = q;
+			} else {
+				index = add_patch(std::move(p));
+				states.set_energy(index, energy);
+				states.set_unshot_energy(index, unshot);
+				unshot_power_heap.push(0.0f);
+				patch_cells.push_back(q);
+			}
+			quarters.push_back(index);
+			energies.push_back(energy);
+			// Cells per quarter along each side, and the quarter at level + 1
+			auto sx(indices[0].size()/quarter_cols);
+			auto sy(indices.size()/quarter_rows);
+			auto qx(2*cell_x + (&q - cells.data())%2);
+			auto qy(2*cell_y + (&q - cells.data())/2);
+			auto x0(qx*sx), x1(x0 + sx);
+			auto y0(qy*sy), y1(y0 + sy);
+			assert(x0 < x1 && x1 <= indices[0].size() && y0 < y1 && y1 <= indices.size());
+			for(auto y(y0); y != y1; ++y) {
+				std::fill(indices[y].begin() + x0, indices[y].begin() + x1, index);
+			}
+		}
+	}
+
+	// Extend what depends on the number of patches. Cached form factors are all stale, as patches next to a split one see its quarters instead.
+	if(ff_cache) {
+		ff_cache->clear();
+	}
+	ffs_buf.resize(patches.size());
+	for(auto &buf : batch_ffs_bufs) {
+		buf.resize(patches.size());
+	}
+	if(params.form_factors == form_factor_method::hemicube && params.hc_gpu_reduction) {
+		size_form_factor_slots();
+	}
+	if(!patch_vertex_offsets.empty()) {
+		// A patch split in place renders as many vertices as before (a quarter has the same shape), so it overwrites its own
+		std::vector<patch_vertex> verts;
+		for(auto i : split_indices) {
+			verts.clear();
+			patches[i]->render(verts, i);
+			assert(verts.size() == patch_vertex_offsets[i + 1] - patch_vertex_offsets[i]);
+			write_patch_vertices(patch_vertex_offsets[i], verts);
+		}
+		verts.clear();
+		auto end(patch_vertex_offsets.back());
+		for(auto i(first_new); i != patches.size(); ++i) {
+			patches[i]->render(verts, i);
+			patch_vertex_offsets.push_back(end + verts.size());
+		}
+		write_patch_vertices(end, verts);
+	}
+
+	// Only the quarters get form factors, with which they gather what the other patches have shot so far: by reciprocity
+	// (F_ij A_i = F_ji A_j), patch j shooting energy B at quarter i has it receive B F_ij. The difference from the energy of
+	// the split patch is left unshot, so that shooting it corrects what the split patch shot before.
+	std::vector<vec3> shot(states.size());
+	for(std::size_t j(1); j != states.size(); ++j) {
+		shot[j] = states.energy(j) - states.unshot_energy(j);
 	}
-	for(auto j(shooter_index+1); j != states.size(); ++j) {
-		shoot(j);
+	const std::size_t batch(16);
+	if(batch_ffs_bufs.size() < batch) {
+		batch_ffs_bufs.resize(batch, std::vector<float>(patches.size()));
+	}
+	std::vector<const patch *> ps;
+	for(std::size_t first(0); first < quarters.size(); first += batch) {
+		auto count(std::min(batch, quarters.size() - first));
+		ps.clear();
+		for(std::size_t q(0); q != count; ++q) {
+			ps.push_back(patches[quarters[first + q]].get());
+		}
+		compute_form_factors(ps, batch_ffs_bufs);
+		for(std::size_t q(0); q != count; ++q) {
+			auto i(quarters[first + q]);
+			auto &buf(batch_ffs_bufs[q]);
+			vec3 gathered(0.0f);
+			for(std::size_t j(1); j != buf.size(); ++j) {
+				if(buf[j] != 0.0f && j != i) {
+					gathered += shot[j]*buf[j];
+				}
+			}
+			auto diff(states.diffuse(i));
+			auto emiss(patches[i]->mat().emiss_color);
+			vec3 energy;
+			for(std::size_t c(0); c != 3; ++c) {
+				energy[c] = diff[c]*(emiss[c] + gathered[c]);
+			}
+			states.set_energy(i, energy);
+			states.set_unshot_energy(i, states.unshot_energy(i) + energy - energies[first + q]);
+		}
+	}
+	for(auto i : quarters) {
+		update_unshot_power(i);
+	}
+	return split_indices.size();
+}
+
+void radiosity_scene::set_patch_material(std::uint32_t i, const vec3 &emiss_color, const vec3 &diff_color) {
+	init_form_factors();
+	if(!ff_matrix) {
+		throw std::runtime_error("set_patch_material needs radiosity_solver::matrix");
+	}
+	if(i == 0 || i >= patches.size()) {
+		throw std::runtime_error("Unexpected patch index");
+	}
+	auto mat(patches[i]->mat());
+	mat.emiss_color = emiss_color;
+	mat.diff_color = diff_color;
+	patches[i]->set_mat(mat);
+	vec3 emission(diff_color.r*emiss_color.r, diff_color.g*emiss_color.g, diff_color.b*emiss_color.b); // like patch_states::add
+	auto old(ff_matrix->emission(i));
+	ff_matrix->set_emission(i, emission);
+	states.set_diffuse(i, diff_color);
+	// Leave the change as unshot energy so that residual does not read as converged, and measure it against the new emitted power
+	states.set_unshot_energy(i, states.unshot_energy(i) + emission - old);
+	update_unshot_power(i);
+	emitted_power = 0.0;
+	for(std::uint32_t j(1); j != patches.size(); ++j) {
+		auto e(ff_matrix->emission(j));
+		emitted_power += double(std::abs(e.r) + std::abs(e.g) + std::abs(e.b))*states.area(j);
+	}
+}
+
+bool radiosity_scene::restored() const {
+	return snapshot_restored;
+}
+
+void radiosity_scene::print_stats(std::ostream &os) const {
+	os << "Radiosity: " << patches.size() - 1 << " patches" << std::endl;
+	if(hierarchy) {
+		hierarchy->print_stats(os);
+	}
+	if(ff_matrix) {
+		ff_matrix->print_stats(os);
+	}
+	if(ff_cache) {
+		ff_cache->print_stats(os);
 	}
-	shooter->unshot_energy = shooter->unshot_energy*ffs_buf[shooter_index];
-	shooter->unshot_energy_total = shooter->unshot_energy.r + shooter->unshot_energy.g + shooter->unshot_energy.b;
 }
 
 void radiosity_scene::random_colors() {
 	prng rng(1775203, 1631191, 2512649, 1160207);
 	for(auto i(1); i != states.size(); ++i) {
-		auto c(3*i);
-		auto &s(states[i]);
-		s->energy.r = (rng() % 10000)/10000.0f; 
-		s->energy.g = (rng() % 10000)/10000.0f;
-		s->energy.b = (rng() % 10000)/10000.0f;
+		auto r((rng() % 10000)/10000.0f);
+		auto g((rng() % 10000)/10000.0f);
+		auto b((rng() % 10000)/10000.0f);
+		states.set_energy(i, vec3(r, g, b));
 	}
 }
 
-void radiosity_scene::init_patches() {
-	patches.emplace_back(nullptr);
-	states.emplace_back(new patch_state());
-	// Create patches and patch states
+void radiosity_scene::init_patches(const radiosity_snapshot *snapshot) {
+	patches.emplace_back(nullptr); // states already holds the null patch
+	patch_cells.emplace_back();
+	// Every surface gets its grid first, and a function making its patches, which only runs unless a snapshot is restored
+	std::vector<std::function<void()>> subdivide;
 	for(auto &&obj : objects) {
 		if(obj->primitives.size() == 0) {
 			continue;
@@ -267,7 +793,7 @@ void radiosity_scene::init_patches() {
 			case type_triangle: {
 				if(obj->primitives.size() >= 2) {
 					for(std::size_t i(0); i < obj->primitives.size(); i += 2) {
-						auto patch_states(std::make_shared<std::vector<std::vector<patch_state *>>>());
+						auto patch_indices(std::make_shared<std::vector<std::vector<std::uint32_t>>>());
 						// Consider every two triangles to be a quad (same algorithm as in scene.cpp)
 						auto i0(i - (i % 2));
 						auto i1(i - (i % 2) + 1);
@@ -310,7 +836,7 @@ void radiosity_scene::init_patches() {
 						auto md(t0->mat->mat(obj.get(), id));
 						auto nd(t0->normal->normal(id));
 
-						auto pmn([&](float u, float v, vec3 &pos, material &mat, vec3 &normal) {
+						auto pmn([=](float u, float v, vec3 &pos, material &mat, vec3 &normal) {
 							if(u < 1.0f - v) {
 								auto alpha(1.0f - u - v);
 								auto beta(u);
@@ -327,45 +853,49 @@ void radiosity_scene::init_patches() {
 								normal = nc*alpha + nd*beta + nb*gamma;
 							}
 						});
-						vec3 pos1; material mat1; vec3 normal1;
-						vec3 pos2; material mat2; vec3 normal2;
-						vec3 pos3; material mat3; vec3 normal3;
-						vec3 pos4; material mat4; vec3 normal4;
-						std::size_t udiv, vdiv;
-						std::tie(udiv, vdiv) = quad_patch::subdivisions(va, vb, vc, vd, params.patch_area);
-						patch_states->resize(vdiv);
-						auto u_step(1.0f/udiv);
-						auto v_step(1.0f/vdiv);
-						for(std::size_t vi(0); vi != vdiv; ++vi) {
-							auto v(vi*v_step);
-							(*patch_states)[vi].resize(udiv);
-							for(std::size_t ui(0); ui != udiv; ++ui) {
-								auto u(ui*u_step);
-								pmn(u, v, pos1, mat1, normal1);
-								pmn(u + u_step, v, pos2, mat2, normal2);
-								pmn(u + u_step, v + v_step, pos3, mat3, normal3);
-								pmn(u, v + v_step, pos4, mat4, normal4);
-								auto c((pos1 + pos2 + pos3 + pos4)/4.0f);
-								auto normal(normalize(normal1 + normal2 + normal3 + normal4));
-								vec2 uv(u + u_step/2.0f, v + v_step/2.0f);
-								shader_params par {
-									c,
-									normal,
-									uv
-								};
-								auto mat(material::interpolate(mat1, 0.25f, mat2, 0.25f, mat3, 0.25f, mat4, 0.25f));
-								obj->mat_shader(mat, par);
-								std::unique_ptr<quad_patch> patch(new quad_patch(obj.get(), mat, normal, {pos1, pos2, pos3, pos4}));
-								auto st(patch->new_state());
-								(*patch_states)[vi][ui] = st.get();
-								states.emplace_back(std::move(st));
-								patches.emplace_back(std::move(patch));
-							}
+						auto o(obj.get());
+						auto make_patch([=](float u0, float v0, float u1, float v1) {
+							vec3 pos1; material mat1; vec3 normal1;
+							vec3 pos2; material mat2; vec3 normal2;
+							vec3 pos3; material mat3; vec3 normal3;
+							vec3 pos4; material mat4; vec3 normal4;
+							pmn(u0, v0, pos1, mat1, normal1);
+							pmn(u1, v0, pos2, mat2, normal2);
+							pmn(u1, v1, pos3, mat3, normal3);
+							pmn(u0, v1, pos4, mat4, normal4);
+							auto c((pos1 + pos2 + pos3 + pos4)/4.0f);
+							auto normal(normalize(normal1 + normal2 + normal3 + normal4));
+							vec2 uv((u0 + u1)/2.0f, (v0 + v1)/2.0f);
+							shader_params par {
+								c,
+								normal,
+								uv
+							};
+							auto mat(material::interpolate(mat1, 0.25f, mat2, 0.25f, mat3, 0.25f, mat4, 0.25f));
+							o->mat_shader(mat, par);
+							return std::unique_ptr<patch>(new quad_patch(o, mat, normal, {pos1, pos2, pos3, pos4}));
+						});
+						std::size_t udiv(1), vdiv(1);
+						if(params.solver != radiosity_solver::hierarchical) {
+							std::tie(udiv, vdiv) = quad_patch::subdivisions(va, vb, vc, vd, params.patch_area);
 						}
-						t0->radiosity_patches = patch_states;
+						auto grid{std::uint32_t(grids.size())};
+						grids.push_back(patch_grid{make_patch, patch_indices, udiv, vdiv});
+						subdivide.push_back([=]() {
+							if(hierarchy) {
+								hierarchy->add_surface(make_patch, [=](float u, float v) {
+									vec3 pos; material mat; vec3 normal;
+									pmn(u, v, pos, mat, normal);
+									return pos;
+								}, udiv, vdiv, patch_indices);
+							} else {
+								add_patches(grid, udiv, vdiv);
+							}
+						});
+						t0->radiosity_patches = patch_indices;
 						t0->patches_u_loop = false;
 						t0->patches_v_loop = false;
-						t1->radiosity_patches = patch_states;
+						t1->radiosity_patches = patch_indices;
 						t1->patches_u_loop = false;
 						t1->patches_v_loop = false;
 					}
@@ -374,36 +904,41 @@ void radiosity_scene::init_patches() {
 			}
 			case type_sphere: {
 				for(auto i(0); i != obj->primitives.size(); ++i) {
-					auto patch_states(std::make_shared<std::vector<std::vector<patch_state *>>>());
+					auto patch_indices(std::make_shared<std::vector<std::vector<std::uint32_t>>>());
 					auto sph(static_cast<sphere *>(obj->primitives[i]));
-					std::size_t udiv, vdiv;
-					std::tie(udiv, vdiv) = sphere_patch::subdivisions(sph->radius, params.patch_area);
-					patch_states->resize(vdiv);
-					auto u_step(1.0f/udiv);
-					auto v_step(1.0f/vdiv);
-					for(std::size_t vi(0); vi != vdiv; ++vi) {
-						auto v(vi*v_step);
-						(*patch_states)[vi].resize(udiv);
-						for(std::size_t ui(0); ui != udiv; ++ui) {
-							auto u(ui*u_step);
-							auto pos(sphere::pos(sph->center, sph->radius, u + u_step/2.0f, v + v_step/2.0f));
-							auto normal(normalize(pos - sph->center));
-							vec2 uv(u + u_step/2.0f, v + v_step/2.0f);
-							shader_params par {
-								pos,
-								normal,
-								uv
-							};
-							auto mat(obj->materials[0]);
-							obj->mat_shader(mat, par);
-							std::unique_ptr<sphere_patch> patch(new sphere_patch(obj.get(), mat, u, u + u_step, v, v + v_step, sph->center, sph->radius));
-							auto st(patch->new_state());
-							(*patch_states)[vi][ui] = st.get();
-							states.emplace_back(std::move(st));
-							patches.emplace_back(std::move(patch));
-						}
+					auto o(obj.get());
+					auto center(sph->center);
+					auto radius(sph->radius);
+					auto make_patch([=](float u0, float v0, float u1, float v1) {
+						auto pos(sphere::pos(center, radius, (u0 + u1)/2.0f, (v0 + v1)/2.0f));
+						auto normal(normalize(pos - center));
+						vec2 uv((u0 + u1)/2.0f, (v0 + v1)/2.0f);
+						shader_params par {
+							pos,
+							normal,
+							uv
+						};
+						auto mat(o->materials[0]);
+						o->mat_shader(mat, par);
+						return std::unique_ptr<patch>(new sphere_patch(o, mat, u0, u1, v0, v1, center, radius));
+					});
+					// The hierarchy starts from 8 x 4 elements, so that none is curved much
+					std::size_t udiv(8), vdiv(4);
+					if(params.solver != radiosity_solver::hierarchical) {
+						std::tie(udiv, vdiv) = sphere_patch::subdivisions(radius, params.patch_area);
 					}
-					sph->radiosity_patches = patch_states;
+					auto grid{std::uint32_t(grids.size())};
+					grids.push_back(patch_grid{make_patch, patch_indices, udiv, vdiv});
+					subdivide.push_back([=]() {
+						if(hierarchy) {
+							hierarchy->add_surface(make_patch, [=](float u, float v) {
+								return sphere::pos(center, radius, u, v);
+							}, udiv, vdiv, patch_indices);
+						} else {
+							add_patches(grid, udiv, vdiv);
+						}
+					});
+					sph->radiosity_patches = patch_indices;
 					sph->patches_u_loop = true;
 					sph->patches_v_loop = true;
 				}
@@ -411,6 +946,80 @@ void radiosity_scene::init_patches() {
 			}
 		}
 	}
+	snapshot_restored = snapshot && restore_patches(*snapshot);
+	if(snapshot_restored) {
+		return;
+	}
+	if(params.solver == radiosity_solver::hierarchical) {
+		hierarchy.reset(new hierarchical_radiosity(*this, params.hr_link_epsilon, params.patch_area));
+	}
+	for(auto &fn : subdivide) {
+		fn();
+	}
+	if(hierarchy) {
+		// Every surface has its grid of patch indices by now, so refining can tell which primitives occlude.
+		// The surfaces were added in the order of grids.
+		hierarchy->refine();
+		hierarchy->build_patches([&](std::unique_ptr<patch> p, std::uint32_t surface, float u0, float v0, float u1, float v1, std::uint32_t depth) {
+			patch_cells.push_back(patch_cell{surface, u0, v0, u1, v1, depth});
+			return add_patch(std::move(p));
+		});
+	}
+}
+
+std::uint32_t radiosity_scene::add_patch(std::unique_ptr<patch> p) {
+	auto index(states.add(*p));
+	patches.emplace_back(std::move(p));
+	return index;
+}
+
+void radiosity_scene::add_patches(std::uint32_t grid, std::size_t udiv, std::size_t vdiv) {
+	auto &make_patch(grids[grid].make_patch);
+	auto &indices(grids[grid].indices);
+	indices->resize(vdiv);
+	auto u_step(1.0f/udiv);
+	auto v_step(1.0f/vdiv);
+	for(std::size_t vi(0); vi != vdiv; ++vi) {
+		auto v(vi*v_step);
+		(*indices)[vi].resize(udiv);
+		for(std::size_t ui(0); ui != udiv; ++ui) {
+			auto u(ui*u_step);
+			(*indices)[vi][ui] = add_patch(make_patch(u, v, u + u_step, v + v_step));
+			patch_cells.push_back(patch_cell{grid, u, v, u + u_step, v + v_step, 0});
+		}
+	}
+}
+
+bool radiosity_scene::restore_patches(const radiosity_snapshot &snapshot) {
+	// radiosity_snapshot::open checked everything else against the grid count of the snapshot
+	if(snapshot.grids() != grids.size()) {
+		printf("Radiosity snapshot has %u grids but the scene has %u, solving again.\n", unsigned(snapshot.grids()), unsigned(grids.size()));
+		return false;
+	}
+	auto cells(snapshot.cells());
+	for(std::size_t i(1); i != snapshot.patches(); ++i) {
+		auto &c(cells[i]);
+		patch_cells.push_back(patch_cell{c.grid, c.u0, c.v0, c.u1, c.v1, c.level});
+		add_patch(grids[c.grid].make_patch(c.u0, c.v0, c.u1, c.v1));
+	}
+	auto sizes(snapshot.grid_sizes());
+	auto indices(snapshot.grid_indices());
+	for(auto &g : grids) {
+		g.indices->assign(sizes->rows, std::vector<std::uint32_t>(sizes->cols));
+		for(auto &row : *g.indices) {
+			std::copy(indices, indices + sizes->cols, row.begin());
+			indices += sizes->cols;
+		}
+		++sizes;
+	}
+	for(std::size_t i(1); i != states.size(); ++i) {
+		auto e(snapshot.energy(0) + i);
+		auto u(snapshot.unshot(0) + i);
+		auto n(snapshot.patches());
+		states.set_energy(i, vec3(e[0], e[n], e[2*n]));
+		states.set_unshot_energy(i, vec3(u[0], u[n], u[2*n]));
+	}
+	return true;
 }
 
 void radiosity_scene::init_hemicube() {
@@ -427,34 +1036,23 @@ void radiosity_scene::init_hemicube() {
 	XGL(glGenBuffers(1, &hc_debug_vbo));
 	XGL(glGenTextures(1, &hc_debug_colors_tex));
 
-	auto pos_loc(glGetAttribLocation(hc_prog->prog, "pos"));
-	XGL_POST();
-	auto index_loc(glGetAttribLocation(hc_prog->prog, "index"));
-	XGL_POST();
-
-	XGL(glBindVertexArray(hc_vao));
-	XGL(glBindBuffer(GL_ARRAY_BUFFER, hc_vbo));
 	{
-		std::vector<patch_vertex> verts;
-		for(auto i(1); i != patches.size(); ++i) {
-			patches[i]->render(verts, i);
-		}
+		auto verts(render_patches());
+		XGL(glBindBuffer(GL_ARRAY_BUFFER, hc_vbo));
 		XGL(glBufferData(GL_ARRAY_BUFFER, verts.size()*sizeof(patch_vertex), verts.data(), GL_STATIC_DRAW));
+		XGL(glBindBuffer(GL_ARRAY_BUFFER, 0));
 		hc_num_indices = verts.size();
 	}
-	XGL(glEnableVertexAttribArray(pos_loc));
-	XGL(glEnableVertexAttribArray(index_loc));
-	XGL(glVertexAttribPointer(pos_loc, 3, GL_FLOAT, GL_FALSE, sizeof(patch_vertex), reinterpret_cast<const GLvoid *>(offsetof(patch_vertex, pos))));
-	XGL(glVertexAttribIPointer(index_loc, 1, GL_UNSIGNED_INT, sizeof(patch_vertex), reinterpret_cast<const GLvoid *>(offsetof(patch_vertex, index))));
-	XGL(glBindVertexArray(0));
+	bind_hemicube_vertices();
 
+	auto height(hemicube_rows(params.hc_res));
 	XGL(glBindTexture(GL_TEXTURE_2D, hc_index_tex));
-	XGL(glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, params.hc_res, params.hc_res, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr));
+	XGL(glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, params.hc_res, height, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr));
 	XGL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
 	XGL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
 
 	XGL(glBindTexture(GL_TEXTURE_2D, hc_depth_tex));
-	XGL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, params.hc_res, params.hc_res, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr));
+	XGL(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, params.hc_res, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, nullptr));
 	XGL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
 	XGL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
 
@@ -463,6 +1061,31 @@ void radiosity_scene::init_hemicube() {
 	XGL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, hc_depth_tex, 0));
 	XGL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
 
+	if(params.hc_gpu_reduction) {
+		hc_reduce_prog = gl_program::compile(hc_reduce_vert_shader, hc_reduce_frag_shader, {{"f_ff", 0}});
+		XGL(glGenVertexArrays(1, &hc_reduce_vao));
+		XGL(glGenFramebuffers(1, &hc_ffs_fbo));
+		XGL(glGenTextures(1, &hc_ffs_tex));
+		XGL(glGenBuffers(1, &hc_ffs_pbo));
+
+		XGL(glBindTexture(GL_TEXTURE_2D, hc_ffs_tex));
+		XGL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+		XGL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+		hc_ffs_width = 0;
+		hc_ffs_height = 0;
+		hc_ffs_slots = 0;
+		size_form_factor_slots();
+
+		XGL(glBindFramebuffer(GL_FRAMEBUFFER, hc_ffs_fbo));
+		XGL(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, hc_ffs_tex, 0));
+		XGL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+
+		XGL(glUseProgram(hc_reduce_prog->prog));
+		XGL(glUniform1i(glGetUniformLocation(hc_reduce_prog->prog, "index_tex"), 0));
+		XGL(glUniform1i(glGetUniformLocation(hc_reduce_prog->prog, "res"), GLint(params.hc_res)));
+		XGL(glUseProgram(0));
+	}
+
 	{
 		static float debug_verts[] = {
 			-1.0f, -1.0f, 0.0f, 0.0f,
@@ -492,87 +1115,289 @@ void radiosity_scene::init_hemicube() {
 	XGL(glTexParameteri(GL_TEXTURE_1D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
 }
 
-template <bool Side>
-static void read_fb(std::vector<GLuint> &pixel_buf, std::vector<float> &ffs, const radiosity_scene::params_type &params) {
-	assert(pixel_buf.size() >= params.hc_res*params.hc_res);
+void radiosity_scene::bind_hemicube_vertices() {
+	auto pos_loc(glGetAttribLocation(hc_prog->prog, "pos"));
+	XGL_POST();
+	auto index_loc(glGetAttribLocation(hc_prog->prog, "index"));
+	XGL_POST();
+
+	XGL(glBindVertexArray(hc_vao));
+	XGL(glBindBuffer(GL_ARRAY_BUFFER, hc_vbo));
+	XGL(glEnableVertexAttribArray(pos_loc));
+	XGL(glEnableVertexAttribArray(index_loc));
+	XGL(glVertexAttribPointer(pos_loc, 3, GL_FLOAT, GL_FALSE, sizeof(patch_vertex), reinterpret_cast<const GLvoid *>(offsetof(patch_vertex, pos))));
+	XGL(glVertexAttribIPointer(index_loc, 1, GL_UNSIGNED_INT, sizeof(patch_vertex), reinterpret_cast<const GLvoid *>(offsetof(patch_vertex, index))));
+	XGL(glBindVertexArray(0));
+	XGL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+}
+
+std::vector<patch_vertex> radiosity_scene::render_patches() {
+	std::vector<patch_vertex> verts;
+	patch_vertex_offsets.assign(2, 0); // The null patch has no vertices
+	for(auto i(1); i != patches.size(); ++i) {
+		patches[i]->render(verts, i);
+		patch_vertex_offsets.push_back(verts.size());
+	}
+	return verts;
+}
+
+void radiosity_scene::write_patch_vertices(std::size_t first, const std::vector<patch_vertex> &verts) {
+	if(params.form_factors == form_factor_method::hemicube) {
+		auto size(first + verts.size());
+		if(size > hc_num_indices) {
+			// Move hc_vbo into a bigger buffer, copying what it holds on the GPU
+			GLuint vbo;
+			XGL(glGenBuffers(1, &vbo));
+			XGL(glBindBuffer(GL_COPY_WRITE_BUFFER, vbo));
+			XGL(glBufferData(GL_COPY_WRITE_BUFFER, size*sizeof(patch_vertex), nullptr, GL_STATIC_DRAW));
+			XGL(glBindBuffer(GL_COPY_READ_BUFFER, hc_vbo));
+			XGL(glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, hc_num_indices*sizeof(patch_vertex)));
+			XGL(glBindBuffer(GL_COPY_READ_BUFFER, 0));
+			XGL(glBindBuffer(GL_COPY_WRITE_BUFFER, 0));
+			XGL(glDeleteBuffers(1, &hc_vbo));
+			hc_vbo = vbo;
+			hc_num_indices = size;
+			bind_hemicube_vertices();
+		}
+		XGL(glBindBuffer(GL_ARRAY_BUFFER, hc_vbo));
+		XGL(glBufferSubData(GL_ARRAY_BUFFER, first*sizeof(patch_vertex), verts.size()*sizeof(patch_vertex), verts.data()));
+		XGL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+	}
+	for(auto &sw : sw_hemicubes) {
+		sw->set_vertices(first, verts);
+	}
+}
+
+void radiosity_scene::size_form_factor_slots() {
+	// Rows of 1024 texels, which every OpenGL 3 implementation supports
+	auto width(GLsizei(std::min(patches.size(), std::size_t(1024))));
+	auto height(GLsizei((patches.size() + width - 1)/width));
+	if(width == hc_ffs_width && height == hc_ffs_height) {
+		return;
+	}
+	hc_ffs_width = width;
+	hc_ffs_height = height;
+	auto slots(std::max(hc_ffs_slots, std::size_t(1)));
+	hc_ffs_slots = 0;
+	reserve_form_factor_slots(slots);
+	XGL(glUseProgram(hc_reduce_prog->prog));
+	XGL(glUniform2i(glGetUniformLocation(hc_reduce_prog->prog, "ffs_size"), hc_ffs_width, hc_ffs_height));
+	XGL(glUseProgram(0));
+}
+
+static void read_hemicube(std::vector<GLuint> &pixel_buf, std::vector<float> &ffs, const hemicube_weights &weights) {
+	auto s(weights.res());
+	auto rows(hemicube_rows(s));
+	assert(pixel_buf.size() >= s*rows);
+	XGL(glReadBuffer(GL_COLOR_ATTACHMENT0));
+	XGL(glReadPixels(0, 0, s, rows, GL_RED_INTEGER, GL_UNSIGNED_INT, pixel_buf.data()));
+	weights.accumulate<false>(pixel_buf.data(), ffs);
+	for(std::size_t face(1); face != 5; ++face) {
+		weights.accumulate<true>(&pixel_buf[(s/2 + hemicube_row_offset(face, s))*s], ffs);
+	}
+}
+
+void radiosity_scene::reserve_form_factor_slots(std::size_t slots) {
+	if(slots <= hc_ffs_slots) {
+		return;
+	}
+	GLint max_size;
+	XGL(glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size));
+	slots = std::max(std::min(slots, std::size_t(max_size/hc_ffs_height)), std::size_t(1));
+	if(slots <= hc_ffs_slots) {
+		return;
+	}
+	hc_ffs_slots = slots;
+	auto height(GLsizei(hc_ffs_height*slots));
+	XGL(glBindTexture(GL_TEXTURE_2D, hc_ffs_tex));
+	XGL(glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, hc_ffs_width, height, 0, GL_RED, GL_FLOAT, nullptr));
+	XGL(glBindTexture(GL_TEXTURE_2D, 0));
+	XGL(glBindBuffer(GL_PIXEL_PACK_BUFFER, hc_ffs_pbo));
+	XGL(glBufferData(GL_PIXEL_PACK_BUFFER, hc_ffs_width*height*sizeof(float), nullptr, GL_STREAM_READ));
+	XGL(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+}
+
+void radiosity_scene::clear_form_factors() {
+	static const float zero[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+	XGL(glBindFramebuffer(GL_FRAMEBUFFER, hc_ffs_fbo));
+	XGL(glClearBufferfv(GL_COLOR, 0, zero));
+	XGL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+}
+
+void radiosity_scene::reduce_hemicube(std::size_t slot) {
+	assert(slot < hc_ffs_slots);
 	auto s(params.hc_res);
-	auto fs{float(params.hc_res)};
-	auto da(4.0f/(fs*fs));
+	viewport_guard vg(0, GLint(slot*hc_ffs_height), hc_ffs_width, hc_ffs_height);
+	XGL(glBindFramebuffer(GL_FRAMEBUFFER, hc_ffs_fbo));
+	XGL(glEnable(GL_BLEND));
+	XGL(glBlendFunc(GL_ONE, GL_ONE));
+	XGL(glUseProgram(hc_reduce_prog->prog));
+	XGL(glActiveTexture(GL_TEXTURE0));
+	XGL(glBindTexture(GL_TEXTURE_2D, hc_index_tex));
+	XGL(glBindVertexArray(hc_reduce_vao));
+	XGL(glDrawArrays(GL_POINTS, 0, GLsizei(s*hemicube_rows(s))));
+	XGL(glBindVertexArray(0));
+	XGL(glDisable(GL_BLEND));
+	XGL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+}
+
+void radiosity_scene::read_form_factors(std::vector<float> *bufs, std::size_t count) {
+	assert(count <= hc_ffs_slots);
+	auto slot_size(std::size_t(hc_ffs_width*hc_ffs_height));
+	XGL(glBindFramebuffer(GL_FRAMEBUFFER, hc_ffs_fbo));
 	XGL(glReadBuffer(GL_COLOR_ATTACHMENT0));
-	XGL(glReadPixels(0, 0, s, s, GL_RED_INTEGER, GL_UNSIGNED_INT, pixel_buf.data()));
-	for(std::size_t j(Side ? s/2 : 0); j != s; ++j) {
-		for(std::size_t i(0); i != s; ++i) {
-			auto x(2.0f*i/fs - 1.0f);
-			auto y(2.0f*j/fs - 1.0f);
-			if(Side) {
-				assert(y >= 0.0f);
+	XGL(glBindBuffer(GL_PIXEL_PACK_BUFFER, hc_ffs_pbo));
+	XGL(glReadPixels(0, 0, hc_ffs_width, GLsizei(hc_ffs_height*count), GL_RED, GL_FLOAT, nullptr));
+	XGL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+	auto data(static_cast<const float *>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, count*slot_size*sizeof(float), GL_MAP_READ_BIT)));
+	XGL_POST();
+	for(std::size_t i(0); i != count; ++i) {
+		assert(bufs[i].size() <= slot_size);
+		std::copy(data + i*slot_size, data + i*slot_size + bufs[i].size(), bufs[i].begin());
+	}
+	XGL(glUnmapBuffer(GL_PIXEL_PACK_BUFFER));
+	XGL(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+}
+
+void radiosity_scene::compute_form_factors(const patch &p, std::vector<float> &buf, optional<std::function<void(std::size_t face)>> debug_fn) {
+	assert(buf.size() == patches.size());
+	switch(params.form_factors) {
+		case form_factor_method::hemicube:
+			render_hemicube(p, buf, debug_fn);
+			break;
+		case form_factor_method::ray_cast:
+			assert(!debug_fn);
+			rc_ffs->compute(p, buf);
+			break;
+		case form_factor_method::software_hemicube:
+			assert(!debug_fn);
+			sw_hemicubes[0]->compute(p, buf);
+			break;
+		default:
+			assert(!"Unexpected form_factor_method");
+	}
+}
+
+void radiosity_scene::compute_form_factors(const std::vector<const patch *> &ps, std::vector<std::vector<float>> &bufs) {
+	assert(bufs.size() >= ps.size());
+	switch(params.form_factors) {
+		case form_factor_method::hemicube:
+			render_hemicubes(ps, bufs);
+			break;
+		case form_factor_method::ray_cast:
+			// The rays of one patch already keep every thread busy
+			for(std::size_t i(0); i != ps.size(); ++i) {
+				rc_ffs->compute(*ps[i], bufs[i]);
 			}
-			auto div(x*x + y*y + 1.0f);
-			auto df(Side ? da*y/(RT_PI*div*div) : da/(RT_PI*div*div));
-			ffs[pixel_buf[j*s + i]] += df;
+			break;
+		case form_factor_method::software_hemicube: {
+			// Each engine computes every engines-th patch
+			auto engines(std::min(sw_hemicubes.size(), ps.size()));
+			auto work([&](std::size_t id) {
+				for(auto i(id); i < ps.size(); i += engines) {
+					sw_hemicubes[id]->compute(*ps[i], bufs[i]);
+				}
+			});
+			std::vector<std::thread> workers;
+			workers.reserve(engines - 1);
+			for(std::size_t i(1); i < engines; ++i) {
+				workers.emplace_back(work, i);
+			}
+			work(0);
+			for(auto &t : workers) {
+				t.join();
+			}
+			break;
 		}
+		default:
+			assert(!"Unexpected form_factor_method");
 	}
 }
 
-void radiosity_scene::compute_form_factors(const patch &p, std::vector<float> &buf, optional<std::function<void(std::size_t face)>> debug_fn) {
-	static const auto near(0.1f);
-	static const auto far(10.0f);
-	auto center(p.center());
-	auto normal(p.normal());
-	auto right(normalize(cross(normal, p.surface_dir()))); // the direction facing the right face of the hemicube (arbitrarily chosen to be perpendicular to the normal)
-	auto front(normalize(cross(right, normal))); // the direction facing the front face of the hemicube
-	auto proj(mat4::perspective(radians(90.0f), 1.0f, near, far));
-	auto vp_loc(glGetUniformLocation(hc_prog->prog, "vp"));
-	XGL_POST();
+void radiosity_scene::render_hemicube(const patch &p, std::vector<float> &buf, optional<std::function<void(std::size_t face)>> debug_fn) {
 	assert(buf.size() == patches.size());
-	std::fill(buf.begin(), buf.end(), 0.0f);
-	// top 
-	{
-		auto vp(proj*mat4::look_at(center, center + normal, front));
-		{
-			viewport_guard vg(0, 0, params.hc_res, params.hc_res);
-			XGL(glEnable(GL_DEPTH_TEST));
-			XGL(glBindFramebuffer(GL_FRAMEBUFFER, hc_fbo));
-			XGL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
-			XGL(glUseProgram(hc_prog->prog));
-			XGL(glUniformMatrix4fv(vp_loc, 1, GL_FALSE, reinterpret_cast<float *>(&vp.data)));
-			XGL(glBindVertexArray(hc_vao));
-			XGL(glDrawArrays(GL_TRIANGLES, 0, hc_num_indices));
-			read_fb<false>(pixel_buf, buf, params);
-			XGL(glBindVertexArray(0));
-			XGL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
-			XGL(glDisable(GL_DEPTH_TEST));
-		}
-		if(debug_fn) {
-			(*debug_fn)(0);
-		}
-	}
-	std::array<mat4, 4> side_vps = {
-		proj * mat4::look_at(center, center - right, normal), // left
-		proj * mat4::look_at(center, center + right, normal), // right
-		proj * mat4::look_at(center, center - front, normal), // back
-		proj * mat4::look_at(center, center + front, normal)  // front
-	};
-	std::size_t face(1);
-	for(const auto &vp : side_vps) {
-		{
-			viewport_guard vg(0, 0, params.hc_res, params.hc_res);
-			XGL(glEnable(GL_DEPTH_TEST));
-			XGL(glBindFramebuffer(GL_FRAMEBUFFER, hc_fbo));
-			XGL(glUseProgram(hc_prog->prog));
-			XGL(glBindVertexArray(hc_vao));
-			XGL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
-			XGL(glUniformMatrix4fv(vp_loc, 1, GL_FALSE, reinterpret_cast<const float *>(&vp.data)));
-			XGL(glDrawArrays(GL_TRIANGLES, 0, hc_num_indices));
-			read_fb<true>(pixel_buf, buf, params); 
-			XGL(glBindVertexArray(0));
-			XGL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
-			XGL(glDisable(GL_DEPTH_TEST));
-		}
-		if(debug_fn) {
+	if(params.hc_gpu_reduction) {
+		clear_form_factors();
+	} else {
+		std::fill(buf.begin(), buf.end(), 0.0f);
+	}
+	draw_hemicube(p);
+	if(params.hc_gpu_reduction) {
+		reduce_hemicube(0);
+	} else {
+		XGL(glBindFramebuffer(GL_FRAMEBUFFER, hc_fbo));
+		read_hemicube(pixel_buf, buf, *hc_weights);
+		XGL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+	}
+	if(debug_fn) {
+		for(std::size_t face(0); face != 5; ++face) {
 			(*debug_fn)(face);
 		}
-		++face;
+	}
+	if(params.hc_gpu_reduction) {
+		// The only read back of the shot: one float per patch instead of the hemicube's cells.
+		read_form_factors(&buf, 1);
+	}
+}
+
+void radiosity_scene::render_hemicubes(const std::vector<const patch *> &ps, std::vector<std::vector<float>> &bufs) {
+	if(!params.hc_gpu_reduction) {
+		// Every hemicube has to be read back before the next one is drawn anyway
+		for(std::size_t i(0); i != ps.size(); ++i) {
+			render_hemicube(*ps[i], bufs[i], {});
+		}
+		return;
+	}
+	// Reduce every hemicube into its own slot of hc_ffs_tex, so that the hemicubes are all in flight and read back together
+	reserve_form_factor_slots(ps.size());
+	for(std::size_t first(0); first < ps.size(); first += hc_ffs_slots) {
+		auto count(std::min(hc_ffs_slots, ps.size() - first));
+		clear_form_factors();
+		for(std::size_t i(0); i != count; ++i) {
+			assert(bufs[first + i].size() == patches.size());
+			draw_hemicube(*ps[first + i]);
+			reduce_hemicube(i);
+		}
+		read_form_factors(&bufs[first], count);
+	}
+}
+
+void radiosity_scene::draw_hemicube(const patch &p) {
+	auto res(params.hc_res);
+	auto height(hemicube_rows(res));
+	auto views(hemicube_views(p));
+	std::array<float, 2*5> rows;
+	for(std::size_t face(0); face != views.size(); ++face) {
+		// Move the rows of the face by its row offset, in a viewport of `height` rows
+		auto offset(float(hemicube_row_offset(face, res)));
+		auto first(face == 0 ? 0.0f : float(res/2));
+		auto fh{float(height)};
+		views[face] = mat4::translate(0.0f, (float(res) + 2.0f*offset)/fh - 1.0f, 0.0f)*mat4::scale(1.0f, float(res)/fh, 1.0f)*views[face];
+		rows[2*face] = 2.0f*(first + offset)/fh - 1.0f;
+		rows[2*face + 1] = 2.0f*(float(res) + offset)/fh - 1.0f;
+	}
+	auto vp_loc(glGetUniformLocation(hc_prog->prog, "vp"));
+	XGL_POST();
+	auto rows_loc(glGetUniformLocation(hc_prog->prog, "rows"));
+	XGL_POST();
+	// All five faces in one draw call
+	{
+		viewport_guard vg(0, 0, GLint(res), GLint(height));
+		XGL(glEnable(GL_DEPTH_TEST));
+		XGL(glEnable(GL_CLIP_DISTANCE0));
+		XGL(glEnable(GL_CLIP_DISTANCE1));
+		XGL(glBindFramebuffer(GL_FRAMEBUFFER, hc_fbo));
+		XGL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
+		XGL(glUseProgram(hc_prog->prog));
+		XGL(glUniformMatrix4fv(vp_loc, GLsizei(views.size()), GL_FALSE, reinterpret_cast<const float *>(views.data())));
+		XGL(glUniform2fv(rows_loc, GLsizei(views.size()), rows.data()));
+		XGL(glBindVertexArray(hc_vao));
+		XGL(glDrawArraysInstanced(GL_TRIANGLES, 0, hc_num_indices, GLsizei(views.size())));
+		XGL(glBindVertexArray(0));
+		XGL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+		XGL(glDisable(GL_CLIP_DISTANCE1));
+		XGL(glDisable(GL_CLIP_DISTANCE0));
+		XGL(glDisable(GL_DEPTH_TEST));
 	}
 }
 
@@ -2,11 +2,18 @@
 
 #include "camera.h"
 #include "patch.h"
+#include "patch_states.h"
 #include "scene_io.h"
 #include "scene.h"
 #include "shader_bindings.h"
 #include "gl.h"
 #include "gl_program.h"
+#include "ray_cast_form_factors.h"
+#include "hemicube.h"
+#include "indexed_max_heap.h"
+#include "hierarchical_radiosity.h"
+#include "form_factor_cache.h"
+#include "form_factor_matrix.h"
 
 #include <optional.hpp>
 
@@ -14,52 +21,196 @@
 #include <cstdint>
 #include <memory>
 #include <functional>
+#include <ostream>
+#include <string>
 
 namespace rt {
 
 using std::experimental::optional;
 
+struct radiosity_snapshot;
+
+// How radiosity_scene computes the form factors of a shooting patch.
+enum class form_factor_method {
+	hemicube, // Render the scene's patches onto a hemicube with OpenGL ("The Hemi-Cube: A Radiosity Solution for Complex Environments")
+	ray_cast, // Cast rays through the acceleration structure on the CPU (see ray_cast_form_factors), which needs no OpenGL context
+	software_hemicube // Rasterize the hemicube on the CPU (see software_hemicube), which needs no OpenGL context either and matches hemicube
+};
+
+// How radiosity_scene solves for the energy of the patches.
+enum class radiosity_solver {
+	progressive, // Shoot the patches with the most unshot power one after another, with params_type::patch_area patches everywhere
+	hierarchical, // Subdivide the surfaces only where the form factors between them need it, and gather over links between them (see hierarchical_radiosity)
+	matrix // Compute the form factors of every patch once, and gather over all of them at every step (see form_factor_matrix)
+};
+
 struct radiosity_scene : scene {
 	struct params_type {
 		float patch_area = 0.05f; // The desired patch area.
-		std::size_t hc_res = 512; // Number of cells in the X and Y direction on the hemicube face
+		std::size_t hc_res = 512; // Number of cells in the X and Y direction on the hemicube face (hemicube and software_hemicube)
+		bool hc_gpu_reduction = false; // With form_factor_method::hemicube, sum the delta form factors on the GPU and read back only the form factors, instead of reading back and summing every face on the CPU. Faster on real GPUs, but slower where OpenGL itself runs on the CPU (like Mesa's llvmpipe).
+		accel_type accel = accel_type::kd_tree; // The acceleration structure used for tracing rays through the scene
+		form_factor_method form_factors = form_factor_method::hemicube; // ignored by radiosity_solver::hierarchical, unless a snapshot is restored (see radiosity_scene)
+		std::size_t ff_rays = 4096; // With form_factor_method::ray_cast, the number of rays cast per shooting patch
+		std::size_t ff_threads = 0; // The number of threads computing form factors on the CPU (0 for one per hardware thread). software_hemicube uses at most 5, one per face.
+		std::size_t ff_cache_bytes = std::size_t(64) << 20; // Memory for the form factors of patches shot before, which are reused when they shoot again instead of being computed (0 to compute them every time, see form_factor_cache)
+		std::size_t shooters_per_step = 1; // The number of patches load_radiosity_scene shoots at once (see step_batch)
+		float target_residual = 0.0f; // load_radiosity_scene stops once residual() is at most this (0 to run all of its steps unless everything is shot)
+		double time_budget = 0.0; // load_radiosity_scene stops after this many seconds of radiosity steps (0 for no limit)
+		float overshoot = 1.0f; // Over-relaxation factor: a shooter sends this multiple of its unshot energy and keeps the rest (negative above 1) to shoot back later. 1 for plain progressive refinement; about 1.2 converges several times faster in box.ascii, less so with the noisy form factors of ray_cast.
+		radiosity_solver solver = radiosity_solver::progressive;
+		matrix_iteration iteration = matrix_iteration::gauss_seidel; // With radiosity_solver::matrix, how a step updates the energies (on ff_threads threads)
+		float hr_link_epsilon = 0.02f; // With radiosity_solver::hierarchical, links whose estimated form factor is above this are refined, down to elements of about patch_area. Lower values give more patches and links.
+		std::size_t refine_steps = 0; // With radiosity_solver::progressive, load_radiosity_scene calls refine after every this many steps (0 never)
+		std::size_t refine_passes = 1; // The number of times load_radiosity_scene calls refine at most
+		float refine_threshold = 0.25f; // refine splits neighboring patches whose energies (summed over the channels) differ by more than this fraction of the larger one
+		std::size_t refine_levels = 2; // The number of times refine may split a patch of the initial grid
+		std::string snapshot; // load_radiosity_scene restores the solved scene from this file if it was saved for the same scene file and settings (see radiosity_snapshot), and otherwise solves the scene and saves it there (empty for neither)
+		bool ambient = false; // Whether radiosity_object_tracer adds the ambient term (see ambient) to the energy of the patches, which makes images after few steps closer to the converged one
 	};
 
 	// io: Scene information.
 	// bindings: Shader bindings.
+	// snapshot: The solved patches to restore instead of subdividing the surfaces (see radiosity_snapshot), or null. It is ignored if it does
+	// not have a grid for every surface (see restored). A restored scene has no hierarchy or form factor matrix, so stepping it further
+	// shoots progressively (with params.form_factors).
 	// Each pair of triangle primitives will be treated as a quad for subdivision purposes (if the pair does not form a valid quad it will be discarded).
-	radiosity_scene(SceneIO *io, const params_type &params = {}, const shader_bindings &bindings = {});
+	radiosity_scene(SceneIO *io, const params_type &params = {}, const shader_bindings &bindings = {}, const radiosity_snapshot *snapshot = nullptr);
 	~radiosity_scene();
 	radiosity_scene(const radiosity_scene &) = delete;
 	
+	// The debug functions need form_factor_method::hemicube, and a solver other than radiosity_solver::hierarchical.
 	void debug_render_patches(std::size_t highlight, float aspect); // Render patch locations to the current OpenGL context. `highlight` specifies the index of the patch to highlight (or 0 not to highlight any patches).
 	void debug_render_hemicube(std::size_t patch_index, std::size_t face, std::size_t highlight); // Render a face of a patch's hemicube to the current OpenGL context. `face` order is [top, left, right, back, front].
 	
-	// Perform a light bouncing step.
+	// Perform a light bouncing step. With radiosity_solver::hierarchical or radiosity_solver::matrix, that is one iteration of gathering
+	// over every link or row, after which the unshot energy of a patch is how much its energy changed (so that residual keeps falling as the
+	// iterations converge).
 	void step();
 
+	// Perform a light bouncing step from the k patches with the most unshot power at once: their form factors are computed together
+	// (k hemicubes in flight with one read back, or on several software_hemicube engines), and then all k are shot in one pass over the patches.
+	// Shooters that are also receivers get the others' energy from before the step, so one step_batch(k) converges a bit slower per shot than
+	// k calls to step(), but saves the synchronization between them.
+	void step_batch(std::size_t k);
+
+	// The unshot power left in the scene as a fraction of the power emitted by its light sources (0 when nothing is emitted).
+	float residual() const;
+
+	// An estimate of the energy that every patch will still receive, times its reflectance: the area-weighted average unshot energy,
+	// after bouncing around the scene at its area-weighted average reflectance ("A Progressive Refinement Approach to Fast Radiosity Image Generation").
+	// That assumes a closed scene, so every bounce is also scaled by the fraction of the power shot so far that hit a patch rather than the null patch.
+	// Computed from every patch on each call.
+	vec3 ambient() const;
+
+	// With radiosity_solver::matrix, changes the emissive and diffuse colors of patch i, in its material (which radiosity_object_tracer shades with)
+	// and in what it emits and reflects. The form factors stay, so stepping until residual is low again re-solves the scene for the new lighting.
+	// The surfaces keep their materials, so patches made from them again (by restoring a snapshot) get the old colors.
+	// Throws std::runtime_error with another solver, or for patch 0 or an index past the last patch.
+	void set_patch_material(std::uint32_t i, const vec3 &emiss_color, const vec3 &diff_color);
+
+	// With radiosity_solver::progressive, splits every patch whose energy differs too much from that of a neighbor in its primitive's grid
+	// (see params_type::refine_threshold) into 2 x 2 patches, and returns how many were split. Only the new patches get form factors,
+	// from which they gather what has been shot so far. The grids, hemicube vertices and form factor buffers are extended, not rebuilt.
+	std::size_t refine();
+
+	// Whether the constructor restored the patches of its snapshot. A restored scene only sets up its form factor engine (and, with
+	// radiosity_solver::matrix, computes its matrix) when something first needs form factors, so rendering it needs neither.
+	bool restored() const;
+
+	void print_stats(std::ostream &os) const;
+
 	// Set random colors (seeded by index) on all patches.
 	void random_colors();
 
 private:
-	void init_patches();
+	typedef std::function<std::unique_ptr<patch>(float u0, float v0, float u1, float v1)> patch_fn; // makes the patch covering [u0, u1] x [v0, v1] of a primitive
+	typedef std::shared_ptr<std::vector<std::vector<std::uint32_t>>> grid_ptr; // patch indices over the (u, v) parameters of a primitive (see primitive::radiosity_patches)
+
+	// The grid of patches of a surface, with what refine and restoring a snapshot need to make its patches
+	struct patch_grid {
+		patch_fn make_patch;
+		grid_ptr indices;
+		std::size_t udiv, vdiv; // The patches at level 0, so a grid is always udiv x vdiv times a power of 2
+	};
+
+	// Where a patch lies in its grid
+	struct patch_cell {
+		std::uint32_t grid;
+		float u0;
+		float v0;
+		float u1;
+		float v1;
+		std::uint32_t level; // The number of times the patch of the initial grid has been split
+	};
+
+	void init_patches(const radiosity_snapshot *snapshot);
+	std::uint32_t add_patch(std::unique_ptr<patch> p); // adds p to patches and states, returning its index
+	void add_patches(std::uint32_t grid, std::size_t udiv, std::size_t vdiv); // fills grids[grid] with udiv x vdiv patches
+	bool restore_patches(const radiosity_snapshot &snapshot); // makes the patches and grids of a snapshot, with its energies, unless it does not fit the grids (returning false)
+	std::vector<patch_vertex> render_patches(); // renders every patch with its index (see patch::render), filling in patch_vertex_offsets
+	void write_patch_vertices(std::size_t first, const std::vector<patch_vertex> &verts); // writes verts over hc_vbo and the vertices of sw_hemicubes from `first` on, growing them as needed
+	void update_unshot_power(std::uint32_t i); // updates the key of patch i in unshot_power_heap, and unshot_power_total, after its unshot energy changed
 	void init_hemicube(); // prepares the necessary OpenGL objects to render hemicube faces
+	void bind_hemicube_vertices(); // points the attributes of hc_vao at hc_vbo
+	void size_form_factor_slots(); // makes hc_ffs_tex big enough for every patch, keeping the number of slots
+	void init_form_factors(); // sets up the form factor engine of params.form_factors, and ff_matrix or ff_cache, unless that was done already
+	void build_form_factor_matrix(); // computes the form factors of every patch into ff_matrix
 	void compute_form_factors(const patch &p, std::vector<float> &buf, optional<std::function<void(std::size_t face)>> debug_fn = {});
+	void compute_form_factors(const std::vector<const patch *> &ps, std::vector<std::vector<float>> &bufs); // fills bufs[i] with the form factors of ps[i]
+	std::size_t ff_threads() const;
+	void render_hemicube(const patch &p, std::vector<float> &buf, optional<std::function<void(std::size_t face)>> debug_fn); // compute_form_factors for form_factor_method::hemicube
+	void render_hemicubes(const std::vector<const patch *> &ps, std::vector<std::vector<float>> &bufs); // batched compute_form_factors for form_factor_method::hemicube
+	void draw_hemicube(const patch &p); // renders the faces of p's hemicube into hc_index_tex
+	void reserve_form_factor_slots(std::size_t slots); // makes room for up to `slots` hemicubes in hc_ffs_tex (as many as GL_MAX_TEXTURE_SIZE allows)
+	void clear_form_factors(); // zeroes every slot of hc_ffs_tex
+	void reduce_hemicube(std::size_t slot); // adds the delta form factors of the faces in hc_index_tex to a slot of hc_ffs_tex
+	void read_form_factors(std::vector<float> *bufs, std::size_t count); // reads the first `count` slots of hc_ffs_tex back into bufs[0..count)
 
 public:
 	const params_type params;
 
 	std::vector<std::unique_ptr<patch>> patches; // Array of patches in the scene. The 0th index is reserved as a "null" patch (where light escapes to infinity).
-	std::vector<std::unique_ptr<patch_state>> states; // Array of patch states in the scene. The 0th index is reserved for the null patch's state.
+	patch_states states; // The radiosity state of every patch in the scene, indexed like patches. step and step_batch keep unshot_power_heap up to date with the unshot energy.
 
 private:
+	bool snapshot_restored; // see restored
+	bool form_factors_ready; // whether init_form_factors has run
+	std::unique_ptr<hierarchical_radiosity> hierarchy; // the element quadtrees and links with radiosity_solver::hierarchical
+	std::vector<patch_grid> grids; // the grids of patches of every surface
+	std::vector<patch_cell> patch_cells; // the cell of every patch, indexed like patches
+	std::vector<std::size_t> patch_vertex_offsets; // the first vertex of every patch in hc_vbo or sw_hemicubes, indexed like patches, and one past the last vertex (empty with form_factor_method::ray_cast)
+
+	indexed_max_heap unshot_power_heap; // patch indices keyed on unshot power (see patch_states::unshot_power), so that finding the next shooter takes no scan
+	double unshot_power_total; // sum of the keys of unshot_power_heap
+	double emitted_power; // unshot_power_total before the first step
+	double shot_power; // power shot by all the steps so far
+	double landed_power; // the part of shot_power that hit a patch (for ambient)
+
 	std::unique_ptr<gl_program> hc_prog; // shader program for rendering hemicube faces
 	GLuint hc_vao; // patch vertex array for rendering hemicube faces
 	GLuint hc_vbo; // patch vertex buffer for rendering hemicube faces
 	std::size_t hc_num_indices; // number of indices in hc_vao
 	GLuint hc_fbo; // framebuffer for rendering hemicube faces
-	GLuint hc_index_tex; // texture to which patch indices are rendered when rendering hemicube faces
-	GLuint hc_depth_tex; // renderbuffer used as z-buffer when rendering hemicube faces
+	GLuint hc_index_tex; // texture to which patch indices are rendered when rendering hemicube faces (see hemicube_row_offset in radiosity_scene.cpp)
+	GLuint hc_depth_tex; // texture used as z-buffer when rendering hemicube faces
+	std::unique_ptr<hemicube_weights> hc_weights; // delta form factors of the hemicube cells at params.hc_res (without params.hc_gpu_reduction)
+
+	// params.hc_gpu_reduction fields
+	std::unique_ptr<gl_program> hc_reduce_prog; // shader program drawing a point per hemicube cell onto the texel of its patch in hc_ffs_tex
+	GLuint hc_reduce_vao; // empty vertex array for hc_reduce_prog, which only uses gl_VertexID
+	GLuint hc_ffs_fbo; // framebuffer for summing form factors
+	GLuint hc_ffs_tex; // R32F texture holding the form factor of every patch for hc_ffs_slots hemicubes (patch i of slot s at texel (i % hc_ffs_width, s*hc_ffs_height + i / hc_ffs_width))
+	GLuint hc_ffs_pbo; // pixel pack buffer that hc_ffs_tex is read into
+	GLsizei hc_ffs_width; // width of hc_ffs_tex
+	GLsizei hc_ffs_height; // height of a slot of hc_ffs_tex
+	std::size_t hc_ffs_slots; // number of hemicubes that hc_ffs_tex and hc_ffs_pbo have room for
+
+	std::unique_ptr<form_factor_matrix> ff_matrix; // the form factors of every patch with radiosity_solver::matrix
+	std::unique_ptr<form_factor_cache> ff_cache; // form factors of earlier shooters (unless params.ff_cache_bytes is 0)
+
+	std::unique_ptr<ray_cast_form_factors> rc_ffs; // form factor engine for form_factor_method::ray_cast
+	std::vector<std::unique_ptr<software_hemicube>> sw_hemicubes; // form factor engines for form_factor_method::software_hemicube (several when there are threads to spare for step_batch)
 
 	// debug fields
 	std::unique_ptr<gl_program> debug_prog; // shader program for debug_render_patches
@@ -69,7 +220,11 @@ private:
 	GLuint hc_debug_colors_tex; // 1D texture for storing patch colors
 
 	std::vector<float> ffs_buf; // buffer used for storing form factors
-	std::vector<GLuint> pixel_buf; // buffer used for reading pixels from hemicube face framebuffers
+	std::vector<std::vector<float>> batch_ffs_bufs; // buffers used for storing the form factors of the shooters of step_batch
+	std::vector<std::uint32_t> receivers; // buffer used for the indices of the patches receiving energy in step_batch
+	std::vector<GLuint> pixel_buf; // buffer used for reading hc_index_tex (without params.hc_gpu_reduction)
+
+	friend struct radiosity_snapshot; // which saves the patches, grids and energies
 };
 
 }
\ No newline at end of file
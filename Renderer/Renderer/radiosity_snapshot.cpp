@@ -0,0 +1,234 @@
+#include "radiosity_snapshot.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace rt {
+
+static const char snapshot_magic[8] = {'R', 'T', 'R', 'A', 'D', 'S', 'N', 'P'};
+
+static std::size_t align8(std::size_t bytes) {
+	return (bytes + 7) & ~std::size_t(7);
+}
+
+template<class T>
+static void append(std::vector<char> &bytes, const T &value) {
+	auto p(reinterpret_cast<const char *>(&value));
+	bytes.insert(bytes.end(), p, p + sizeof(T));
+}
+
+radiosity_snapshot::layout::layout(const header &h) {
+	std::size_t patches(h.patches);
+	cells = sizeof(header) + align8(h.settings_size);
+	energy = cells + patches*sizeof(cell);
+	unshot = energy + 3*patches*sizeof(float);
+	grid_sizes = unshot + 3*patches*sizeof(float);
+	grid_indices = grid_sizes + h.grids*sizeof(grid_size);
+	end = grid_indices + std::size_t(h.grid_cells)*sizeof(std::uint32_t);
+}
+
+radiosity_snapshot::radiosity_snapshot(std::unique_ptr<mapped_file> file) :
+	file_(std::move(file)),
+	layout_(head())
+{
+}
+
+const radiosity_snapshot::header &radiosity_snapshot::head() const {
+	return *reinterpret_cast<const header *>(file_->data());
+}
+
+std::unique_ptr<radiosity_snapshot> radiosity_snapshot::open(const std::string &path, std::uint64_t scene_hash, const std::vector<char> &settings) {
+	std::unique_ptr<mapped_file> file(new mapped_file(path));
+	if(!file->data()) {
+		printf("No radiosity snapshot '%s' to restore.\n", path.c_str());
+		return nullptr;
+	}
+	auto &h(*reinterpret_cast<const header *>(file->data()));
+	if(file->size() < sizeof(header) || std::memcmp(h.magic, snapshot_magic, sizeof(snapshot_magic)) != 0) {
+		printf("File '%s' is not a radiosity snapshot.\n", path.c_str());
+		return nullptr;
+	}
+	if(h.version != version) {
+		printf("Radiosity snapshot '%s' is version %u, program is version %u.\n", path.c_str(), h.version, version);
+		return nullptr;
+	}
+	if(h.scene_hash != scene_hash || h.settings_size != settings.size() || sizeof(header) + settings.size() > file->size() ||
+		std::memcmp(file->data() + sizeof(header), settings.data(), settings.size()) != 0) {
+		printf("Radiosity snapshot '%s' was saved for another scene file or other settings.\n", path.c_str());
+		return nullptr;
+	}
+	if(h.patches == 0 || h.grid_cells > file->size()/sizeof(std::uint32_t) || layout(h).end != file->size()) {
+		printf("Radiosity snapshot '%s' is truncated.\n", path.c_str());
+		return nullptr;
+	}
+	std::unique_ptr<radiosity_snapshot> snapshot(new radiosity_snapshot(std::move(file)));
+	if(!snapshot->valid()) {
+		printf("Radiosity snapshot '%s' is corrupt.\n", path.c_str());
+		return nullptr;
+	}
+	return snapshot;
+}
+
+bool radiosity_snapshot::valid() const {
+	// Every cell lies in a grid and inside [0, 1] x [0, 1]
+	auto c(cells());
+	for(std::size_t i(1); i != patches(); ++i) {
+		if(c[i].grid >= grids() || !(0.0f <= c[i].u0 && c[i].u0 < c[i].u1 && c[i].u1 <= 1.0f && 0.0f <= c[i].v0 && c[i].v0 < c[i].v1 && c[i].v1 <= 1.0f)) {
+			return false;
+		}
+	}
+	// The grids are not empty, fill the index array exactly, and hold indices of patches other than the null patch
+	std::uint64_t cells(0);
+	for(std::size_t g(0); g != grids(); ++g) {
+		auto &size(grid_sizes()[g]);
+		if(size.rows == 0 || size.cols == 0) {
+			return false;
+		}
+		cells += std::uint64_t(size.rows)*size.cols;
+	}
+	if(cells != head().grid_cells) {
+		return false;
+	}
+	auto indices(grid_indices());
+	return std::all_of(indices, indices + cells, [&](std::uint32_t i) {
+		return i != 0 && i < patches();
+	});
+}
+
+bool radiosity_snapshot::save(const std::string &path, std::uint64_t scene_hash, const std::vector<char> &settings, const radiosity_scene &scn) {
+	header h;
+	std::memcpy(h.magic, snapshot_magic, sizeof(snapshot_magic));
+	h.version = version;
+	h.settings_size = std::uint32_t(settings.size());
+	h.scene_hash = scene_hash;
+	h.patches = std::uint32_t(scn.patches.size());
+	h.grids = std::uint32_t(scn.grids.size());
+	h.grid_cells = 0;
+	for(auto &g : scn.grids) {
+		h.grid_cells += g.indices->empty() ? 0 : g.indices->size()*(*g.indices)[0].size();
+	}
+	h.emitted_power = scn.emitted_power;
+	h.shot_power = scn.shot_power;
+	h.landed_power = scn.landed_power;
+
+	// The arrays are copied into one buffer so that the file is written at once
+	layout l(h);
+	std::vector<char> bytes(l.end, 0);
+	std::memcpy(bytes.data(), &h, sizeof(h));
+	std::memcpy(bytes.data() + sizeof(h), settings.data(), settings.size());
+	auto cells(reinterpret_cast<cell *>(bytes.data() + l.cells));
+	auto energy(reinterpret_cast<float *>(bytes.data() + l.energy));
+	auto unshot(reinterpret_cast<float *>(bytes.data() + l.unshot));
+	for(std::size_t i(0); i != h.patches; ++i) {
+		auto &c(scn.patch_cells[i]);
+		cells[i] = cell{c.grid, c.u0, c.v0, c.u1, c.v1, c.level};
+		auto e(scn.states.energy(i));
+		auto u(scn.states.unshot_energy(i));
+		for(std::size_t ch(0); ch != 3; ++ch) {
+			energy[ch*h.patches + i] = e[ch];
+			unshot[ch*h.patches + i] = u[ch];
+		}
+	}
+	auto sizes(reinterpret_cast<grid_size *>(bytes.data() + l.grid_sizes));
+	auto indices(reinterpret_cast<std::uint32_t *>(bytes.data() + l.grid_indices));
+	for(auto &g : scn.grids) {
+		auto &rows(*g.indices);
+		*sizes++ = grid_size{std::uint32_t(rows.size()), std::uint32_t(rows.empty() ? 0 : rows[0].size())};
+		for(auto &row : rows) {
+			indices = std::copy(row.begin(), row.end(), indices);
+		}
+	}
+
+	FILE *fp;
+	fopen_s(&fp, path.c_str(), "wb");
+	if(!fp) {
+		printf("Can't open file '%s' for writing.\n", path.c_str());
+		return false;
+	}
+	auto written(fwrite(bytes.data(), 1, bytes.size(), fp));
+	fclose(fp);
+	if(written != bytes.size()) {
+		printf("Error writing radiosity snapshot '%s'.\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+std::uint64_t radiosity_snapshot::hash_file(const char *filename) {
+	mapped_file file(filename);
+	if(!file.data()) {
+		return 0;
+	}
+	std::uint64_t hash(14695981039346656037ull);
+	for(std::size_t i(0); i != file.size(); ++i) {
+		hash ^= std::uint8_t(file.data()[i]);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+std::vector<char> radiosity_snapshot::settings(const radiosity_scene::params_type &params, std::size_t steps) {
+	std::vector<char> bytes;
+	append(bytes, params.patch_area);
+	append(bytes, std::uint64_t(params.hc_res));
+	append(bytes, std::uint32_t(params.hc_gpu_reduction)); // sums the form factors in another order
+	append(bytes, std::uint32_t(params.form_factors));
+	append(bytes, std::uint64_t(params.ff_rays));
+	append(bytes, std::uint64_t(params.ff_cache_bytes)); // cached rows are rounded to 16 bits
+	append(bytes, std::uint64_t(params.shooters_per_step));
+	append(bytes, params.target_residual);
+	append(bytes, params.time_budget);
+	append(bytes, params.overshoot);
+	append(bytes, std::uint32_t(params.solver));
+	append(bytes, std::uint32_t(params.iteration));
+	append(bytes, params.hr_link_epsilon);
+	append(bytes, std::uint64_t(params.refine_steps));
+	append(bytes, std::uint64_t(params.refine_passes));
+	append(bytes, params.refine_threshold);
+	append(bytes, std::uint64_t(params.refine_levels));
+	append(bytes, std::uint64_t(steps));
+	return bytes;
+}
+
+std::size_t radiosity_snapshot::patches() const {
+	return head().patches;
+}
+
+std::size_t radiosity_snapshot::grids() const {
+	return head().grids;
+}
+
+const radiosity_snapshot::cell *radiosity_snapshot::cells() const {
+	return reinterpret_cast<const cell *>(file_->data() + layout_.cells);
+}
+
+const float *radiosity_snapshot::energy(std::size_t channel) const {
+	return reinterpret_cast<const float *>(file_->data() + layout_.energy) + channel*patches();
+}
+
+const float *radiosity_snapshot::unshot(std::size_t channel) const {
+	return reinterpret_cast<const float *>(file_->data() + layout_.unshot) + channel*patches();
+}
+
+const radiosity_snapshot::grid_size *radiosity_snapshot::grid_sizes() const {
+	return reinterpret_cast<const grid_size *>(file_->data() + layout_.grid_sizes);
+}
+
+const std::uint32_t *radiosity_snapshot::grid_indices() const {
+	return reinterpret_cast<const std::uint32_t *>(file_->data() + layout_.grid_indices);
+}
+
+double radiosity_snapshot::emitted_power() const {
+	return head().emitted_power;
+}
+
+double radiosity_snapshot::shot_power() const {
+	return head().shot_power;
+}
+
+double radiosity_snapshot::landed_power() const {
+	return head().landed_power;
+}
+
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "radiosity_scene.h"
+#include "mapped_file.h"
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <memory>
+
+namespace rt {
+
+// The solved energies of a radiosity_scene with its patch layout, saved to a file so that rendering the scene again (from another camera,
+// say) does not need to solve it again. The file starts with a version and a hash of the scene file it was solved from, followed by
+// the settings it was solved with (see settings), and is only used for the same ones. The rest is arrays in native byte order that
+// radiosity_scene reads straight from the mapped file:
+//   cell cells[patches] (including the null patch), float energy[3][patches], float unshot[3][patches],
+//   grid_size grid_sizes[grids], std::uint32_t indices[grid_cells] (every grid's rows one after another).
+struct radiosity_snapshot {
+	static const std::uint32_t version = 1; // Bump when the layout changes
+
+	// Where a patch lies in the grid of its surface (see radiosity_scene::patch_cell)
+	struct cell {
+		std::uint32_t grid;
+		float u0;
+		float v0;
+		float u1;
+		float v1;
+		std::uint32_t level;
+	};
+
+	struct grid_size {
+		std::uint32_t rows;
+		std::uint32_t cols;
+	};
+
+	// Maps the snapshot at path, and returns it if it was saved by this version for a scene file hashing to scene_hash and the same settings,
+	// and its arrays are consistent (printing why not otherwise).
+	static std::unique_ptr<radiosity_snapshot> open(const std::string &path, std::uint64_t scene_hash, const std::vector<char> &settings);
+
+	// Saves scn, solved from a scene file hashing to scene_hash with settings, to path.
+	static bool save(const std::string &path, std::uint64_t scene_hash, const std::vector<char> &settings, const radiosity_scene &scn);
+
+	static std::uint64_t hash_file(const char *filename); // FNV-1a hash of the contents of a file (0 if it cannot be read)
+
+	// The parameters that change the solution, and the steps load_radiosity_scene runs. Shader bindings are not included, as they are
+	// functions: scenes loaded with different ones need different snapshots.
+	static std::vector<char> settings(const radiosity_scene::params_type &params, std::size_t steps);
+
+	std::size_t patches() const; // Including the null patch
+	std::size_t grids() const;
+	const cell *cells() const;
+	const float *energy(std::size_t channel) const;
+	const float *unshot(std::size_t channel) const;
+	const grid_size *grid_sizes() const;
+	const std::uint32_t *grid_indices() const; // The indices of every grid's rows, one grid after another
+
+	// What radiosity_scene::residual and ambient need about the steps so far
+	double emitted_power() const;
+	double shot_power() const;
+	double landed_power() const;
+
+private:
+	struct header {
+		char magic[8];
+		std::uint32_t version;
+		std::uint32_t settings_size;
+		std::uint64_t scene_hash;
+		std::uint32_t patches;
+		std::uint32_t grids;
+		std::uint64_t grid_cells;
+		double emitted_power;
+		double shot_power;
+		double landed_power;
+	};
+
+	// Byte offsets of the arrays after the header
+	struct layout {
+		layout(const header &h);
+
+		std::size_t cells;
+		std::size_t energy;
+		std::size_t unshot;
+		std::size_t grid_sizes;
+		std::size_t grid_indices;
+		std::size_t end;
+	};
+
+	radiosity_snapshot(std::unique_ptr<mapped_file> file);
+
+	const header &head() const;
+	bool valid() const; // Whether the arrays are consistent, so that radiosity_scene can index with them
+
+	std::unique_ptr<mapped_file> file_;
+	layout layout_;
+};
+
+}
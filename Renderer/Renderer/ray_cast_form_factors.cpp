@@ -0,0 +1,116 @@
+#include "ray_cast_form_factors.h"
+#include "math.h"
+#include "prng.h"
+#include "config.h"
+
+#include <optional.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <thread>
+
+namespace rt {
+
+using std::experimental::optional;
+
+ray_cast_form_factors::ray_cast_form_factors(const scene &scn, std::size_t rays, std::size_t threads) :
+	scn_(scn),
+	strata_(std::max(std::size_t(std::sqrt(double(rays))), std::size_t(1))),
+	threads_(std::max(threads, std::size_t(1))),
+	calls_(0)
+{
+	thread_ffs_.resize(threads_ - 1);
+}
+
+std::size_t ray_cast_form_factors::rays() const {
+	return strata_*strata_;
+}
+
+// Maps a point of the unit square to the unit disk ("A Low Distortion Map Between Disk and Square", Shirley & Chiu).
+static vec2 concentric_disk(float u, float v) {
+	auto a(2.0f*u - 1.0f);
+	auto b(2.0f*v - 1.0f);
+	if(a == 0.0f && b == 0.0f) {
+		return vec2(0.0f, 0.0f);
+	}
+	float r;
+	float phi;
+	if(std::abs(a) > std::abs(b)) {
+		r = a;
+		phi = RT_PI/4.0f*(b/a);
+	} else {
+		r = b;
+		phi = RT_PI/2.0f - RT_PI/4.0f*(a/b);
+	}
+	return vec2(r*std::cos(phi), r*std::sin(phi));
+}
+
+std::uint32_t ray_cast_form_factors::patch_index(const primitive &pr, const vec2 &uv) const {
+	// Same lookup as radiosity_object_tracer without interpolation.
+	auto &indices(*pr.radiosity_patches);
+	auto x{std::min(int(uv[0]*indices[0].size()), int(indices[0].size() - 1))};
+	auto y{std::min(int(uv[1]*indices.size()), int(indices.size() - 1))};
+	return indices[std::max(y, 0)][std::max(x, 0)];
+}
+
+void ray_cast_form_factors::compute(const patch &p, std::vector<float> &ffs) {
+	auto center(p.center());
+	auto normal(p.normal());
+	auto right(normalize(cross(normal, p.surface_dir()))); // The same frame as the hemicube
+	auto front(normalize(cross(right, normal)));
+	auto origin(center + normal*RT_RAY_EPSILON);
+	auto n(strata_);
+	auto weight(1.0f/float(n*n));
+	auto call(++calls_);
+
+	// Each thread casts the rays of every threads_-th row of cells, with a generator seeded by the row so that the result does not depend on the thread count.
+	auto work([&](std::size_t id, std::vector<float> &buf) {
+		std::fill(buf.begin(), buf.end(), 0.0f);
+		std::uniform_real_distribution<float> jitter(0.0f, 1.0f);
+		primitive *pr;
+		intersect_info info;
+		optional<ray> r;
+		for(auto row(id); row < n; row += threads_) {
+			prng gen(call, std::uint32_t(row) + 1, 0x9e3779b9u, 0x85ebca6bu);
+			for(std::size_t col(0); col != n; ++col) {
+				auto d(concentric_disk((col + jitter(gen))/n, (row + jitter(gen))/n));
+				auto z(std::sqrt(std::max(0.0f, 1.0f - d.x*d.x - d.y*d.y)));
+				auto dir(right*d.x + front*d.y + normal*z);
+				r.emplace(origin, dir);
+				for(;;) {
+					if(!scn_.intersect(*r, info, pr)) {
+						buf[0] += weight;
+						break;
+					}
+					if(pr->radiosity_patches) {
+						buf[patch_index(*pr, info.uv)] += weight;
+						break;
+					}
+					// Primitives without patches are not drawn into the hemicube either, so the ray goes on past them.
+					r.emplace(r->position(info.t) + dir*RT_RAY_EPSILON, dir);
+				}
+			}
+		}
+	});
+
+	for(auto &buf : thread_ffs_) {
+		buf.resize(ffs.size());
+	}
+	std::vector<std::thread> workers;
+	workers.reserve(threads_ - 1);
+	for(std::size_t i(1); i != threads_; ++i) {
+		workers.emplace_back(work, i, std::ref(thread_ffs_[i - 1]));
+	}
+	work(0, ffs);
+	for(auto &t : workers) {
+		t.join();
+	}
+	for(auto &buf : thread_ffs_) {
+		for(std::size_t j(0); j != ffs.size(); ++j) {
+			ffs[j] += buf[j];
+		}
+	}
+}
+
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "scene.h"
+#include "patch.h"
+
+#include <vector>
+#include <cstdint>
+
+namespace rt {
+
+// Computes form factors on the CPU by casting rays from the center of the shooting patch through the scene's acceleration structure,
+// so that radiosity can run without an OpenGL context.
+// The hemisphere over the patch is split into strata x strata cells of equal projected area (the unit square mapped to the disk with
+// "A Low Distortion Map Between Disk and Square", Shirley & Chiu, and lifted onto the hemisphere), and one jittered ray is cast per cell.
+// The form factor to a patch is then the fraction of rays hitting it ("Radiosity and Realistic Image Synthesis", Cohen & Wallace, Section 4.9.5).
+struct ray_cast_form_factors {
+	// scn: The scene whose primitives hold the patches (see primitive::radiosity_patches).
+	// rays: Rays cast per patch, rounded down to a square number (at least 1).
+	// threads: Number of threads casting the rays of a patch.
+	ray_cast_form_factors(const scene &scn, std::size_t rays, std::size_t threads);
+	ray_cast_form_factors(const ray_cast_form_factors &) = delete;
+
+	// Fills ffs with the form factors from p to every patch, like the hemicube: ffs[0] gets the rays that leave the scene.
+	void compute(const patch &p, std::vector<float> &ffs);
+
+	std::size_t rays() const; // Rays actually cast per patch
+
+private:
+	std::uint32_t patch_index(const primitive &pr, const vec2 &uv) const;
+
+	const scene &scn_;
+	std::size_t strata_; // Cells along each side of the unit square
+	std::size_t threads_;
+	std::vector<std::vector<float>> thread_ffs_; // Form factors summed by each thread other than the calling one
+	std::uint32_t calls_; // Number of compute calls so far, which seeds the jitter
+};
+
+}
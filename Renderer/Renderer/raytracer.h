@@ -12,14 +12,119 @@
 #include "timer.h"
 #include "scene.h"
 #include "radiosity_scene.h"
+#include "radiosity_snapshot.h"
+#include "tile_scheduler.h"
 
 #include <iostream>
 #include <random>
 #include <memory>
 #include <cstdint>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <type_traits>
+#include <utility>
 
 namespace rt {
 
+namespace detail {
+
+inline RGBQUAD to_rgbquad(const vec3 &color) {
+	RGBQUAD q;
+	q.rgbRed = u08(color.r*255);
+	q.rgbGreen = u08(color.g*255);
+	q.rgbBlue = u08(color.b*255);
+	q.rgbReserved = 255;
+	return q;
+}
+
+// Computes the color of pixel (x, y). Shared by the serial and parallel renderers so that both produce the same output.
+template <bool SuperSampling, size_t SS_XSamples, size_t SS_YSamples, typename ObjectTracer, typename RayComputer>
+RGBQUAD render_pixel(ObjectTracer &tracer, RayComputer &rc, prng &gen, std::size_t x, std::size_t y, float w, float h) {
+	static constexpr auto xsamples(SuperSampling ? SS_XSamples : 1);
+	static constexpr auto ysamples(SuperSampling ? SS_YSamples : 1);
+
+	float xc[xsamples];
+	float yc[ysamples];
+	std::uniform_real_distribution<float> cdist(-0.5f, 0.5f);
+
+	vec3 color(0.0f, 0.0f, 0.0f);
+	if(SuperSampling) {
+		for(auto it(std::begin(xc)); it != std::end(xc); ++it) {
+			*it = x + cdist(gen);
+		}
+		for(auto it(std::begin(yc)); it != std::end(yc); ++it) {
+			*it = y + cdist(gen);
+		}
+	} else {
+		xc[0] = float(x);
+		yc[0] = float(y);
+	}
+	for(auto i(0); i != xsamples; ++i) {
+		for(auto j(0); j != ysamples; ++j) {
+			auto sx(float(xc[i] + 0.5f)/w);
+			auto sy(float(yc[j] + 0.5f)/h);
+			auto r(rc.compute_ray(sx, sy));
+			auto L(tracer.trace(r));
+			color += L;
+		}
+	}
+	color /= xsamples*ysamples;
+	return to_rgbquad(color);
+}
+
+// Whether ObjectTracer has shade(r, pr, info), coloring a hit found elsewhere, which render_tile_packets needs.
+template <typename ObjectTracer, typename = void>
+struct has_shade : std::false_type {
+};
+
+template <typename ObjectTracer>
+struct has_shade<ObjectTracer, decltype(void(std::declval<ObjectTracer &>().shade(std::declval<const ray &>(), std::declval<primitive *>(), std::declval<const intersect_info &>())))> : std::true_type {
+};
+
+// Computes the colors of the pixels of t in packet_size x packet_size blocks (see raytrace_scene_parallel). The primary rays of each block
+// are intersected together with scene::intersect_packet; shading, and with it every shadow, reflection and refraction ray, is done a ray at a time.
+template <typename ObjectTracer, typename RayComputer>
+void render_tile_packets(const scene &scn, ObjectTracer &tracer, RayComputer &rc, const tile &t, std::size_t packet_size, float w, float h, std::size_t width, RGBQUAD *pixels) {
+	std::vector<ray> rays;
+	rays.reserve(RT_PACKET_MAX_SIZE);
+	intersect_info info[RT_PACKET_MAX_SIZE];
+	primitive *pr[RT_PACKET_MAX_SIZE];
+	for(auto py(t.y0); py < t.y1; py += packet_size) {
+		for(auto px(t.x0); px < t.x1; px += packet_size) {
+			auto x1(std::min(px + packet_size, t.x1));
+			auto y1(std::min(py + packet_size, t.y1));
+			rays.clear();
+			for(auto y(py); y != y1; ++y) {
+				for(auto x(px); x != x1; ++x) {
+					rays.push_back(rc.compute_ray((float(x) + 0.5f)/w, (float(y) + 0.5f)/h));
+				}
+			}
+			scn.intersect_packet(rays.data(), rays.size(), info, pr);
+			std::size_t i(0);
+			for(auto y(py); y != y1; ++y) {
+				for(auto x(px); x != x1; ++x, ++i) {
+					pixels[y*width + x] = to_rgbquad(tracer.shade(rays[i], pr[i], info[i]));
+				}
+			}
+		}
+	}
+}
+
+// Tracers without shade are never given packets (see raytrace_scene_parallel).
+template <typename ObjectTracer, typename RayComputer>
+void render_tile_packets(const scene &, ObjectTracer &, RayComputer &, const tile &, std::size_t, float, float, std::size_t, RGBQUAD *, std::false_type) {
+	assert(!"ObjectTracer has no shade");
+}
+
+template <typename ObjectTracer, typename RayComputer>
+void render_tile_packets(const scene &scn, ObjectTracer &tracer, RayComputer &rc, const tile &t, std::size_t packet_size, float w, float h, std::size_t width, RGBQUAD *pixels, std::true_type) {
+	render_tile_packets(scn, tracer, rc, t, packet_size, w, h, width, pixels);
+}
+
+}
+
 template <
 	typename ObjectTracer = object_tracer,
 	typename RayComputer = pinhole_ray_computer, // How to compute ray directions for image plane points
@@ -41,48 +146,115 @@ void raytrace_scene(const scene &scn, const char *outname, size_t width, size_t
 	const auto aspect(w/h);
 
 	RayComputer rc(scn.cam, aspect, rc_params);
-
-	float xc[xsamples];
-	float yc[ysamples];
 	prng gen;
-	std::uniform_real_distribution<float> cdist(-0.5f, 0.5f);
 
 	ObjectTracer tracer(scn);
 	for(std::size_t y(0); y != height; ++y) {
 		for(std::size_t x(0); x != width; ++x) {
-			vec3 color(0.0f, 0.0f, 0.0f);
-			if(SuperSampling) {
-				for(auto it(std::begin(xc)); it != std::end(xc); ++it) {
-					*it = x + cdist(gen);
-				}
-				for(auto it(std::begin(yc)); it != std::end(yc); ++it) {
-					*it = y + cdist(gen);
-				}
+			auto q(detail::render_pixel<SuperSampling, SS_XSamples, SS_YSamples>(tracer, rc, gen, x, y, w, h));
+			img.setPixelColor(x, y, &q);
+		}
+	}
+
+	render_timer.stopTimer();
+	std::cout << "Rendered scene in " << render_timer.getTime() << " sec (" << width*height*xsamples*ysamples/render_timer.getTime() << " primary rays/sec)" << std::endl;
+
+	std::cout << "Writing " << outname << std::endl;
+	img.save(outname);
+
+	std::cout << std::endl;
+}
+
+// Like raytrace_scene, but splits the image into tile_size x tile_size tiles which are rendered by `threads` worker threads (see tile_scheduler).
+// Every worker owns its own ObjectTracer, RayComputer and prng, so the tracers do not need to be thread-safe (the scene is only read).
+// Without supersampling the output is identical to raytrace_scene, and the primary rays are traced in packets of packet_size x packet_size
+// (clamped to 8x8, see detail::render_tile_packets), which pays off with accelerators that override accel::intersect_packet. A packet_size of 1 traces every ray on its own,
+// and so do tracers without shade() (see detail::has_shade).
+template <
+	typename ObjectTracer = object_tracer,
+	typename RayComputer = pinhole_ray_computer,
+	bool SuperSampling = false,
+	size_t SS_XSamples = 4,
+	size_t SS_YSamples = 4
+>
+void raytrace_scene_parallel(const scene &scn, const char *outname, size_t width, size_t height, const typename RayComputer::params &rc_params = {}, size_t threads = std::thread::hardware_concurrency(), size_t tile_size = 32, size_t packet_size = 8) {
+	struct worker_stats {
+		double time = 0.0;
+		std::size_t tiles = 0;
+		std::size_t stolen = 0;
+	};
+
+	static constexpr auto xsamples(SuperSampling ? SS_XSamples : 1);
+	static constexpr auto ysamples(SuperSampling ? SS_YSamples : 1);
+
+	threads = std::max(threads, size_t(1));
+	// render_tile_packets keeps a packet's hits on the stack
+	while(packet_size*packet_size > RT_PACKET_MAX_SIZE) {
+		--packet_size;
+	}
+	const auto packets(!SuperSampling && packet_size > 1 && detail::has_shade<ObjectTracer>::value);
+
+	Timer render_timer;
+	render_timer.startTimer();
+
+	const auto w{float(width)};
+	const auto h{float(height)};
+	const auto aspect(w/h);
+
+	std::vector<RGBQUAD> pixels(width*height);
+	std::vector<worker_stats> stats(threads);
+	tile_scheduler sched(width, height, tile_size, threads);
+
+	auto work([&](std::size_t id) {
+		Timer worker_timer;
+		worker_timer.startTimer();
+		RayComputer rc(scn.cam, aspect, rc_params);
+		prng gen;
+		ObjectTracer tracer(scn);
+		auto &st(stats[id]);
+		tile t;
+		bool stolen;
+		while(sched.next(id, t, stolen)) {
+			if(packets) {
+				detail::render_tile_packets(scn, tracer, rc, t, packet_size, w, h, width, pixels.data(), detail::has_shade<ObjectTracer>());
 			} else {
-				xc[0] = float(x);
-				yc[0] = float(y);
-			}
-			for(auto i(0); i != xsamples; ++i) {
-				for(auto j(0); j != ysamples; ++j) {
-					auto sx(float(xc[i] + 0.5f)/w);
-					auto sy(float(yc[j] + 0.5f)/h);
-					auto r(rc.compute_ray(sx, sy));
-					auto L(tracer.trace(r));
-					color += L;
+				for(auto y(t.y0); y != t.y1; ++y) {
+					for(auto x(t.x0); x != t.x1; ++x) {
+						pixels[y*width + x] = detail::render_pixel<SuperSampling, SS_XSamples, SS_YSamples>(tracer, rc, gen, x, y, w, h);
+					}
 				}
 			}
-			color /= xsamples*ysamples;
-			RGBQUAD q;
-			q.rgbRed = u08(color.r*255);
-			q.rgbGreen = u08(color.g*255);
-			q.rgbBlue = u08(color.b*255);
-			q.rgbReserved = 255;
-			img.setPixelColor(x, y, &q);
+			++st.tiles;
+			if(stolen) {
+				++st.stolen;
+			}
+		}
+		worker_timer.stopTimer();
+		st.time = worker_timer.getTime();
+	});
+
+	std::vector<std::thread> workers;
+	workers.reserve(threads - 1);
+	for(std::size_t i(1); i != threads; ++i) {
+		workers.emplace_back(work, i);
+	}
+	work(0);
+	for(auto &t : workers) {
+		t.join();
+	}
+
+	fipImage img(FIT_BITMAP, width, height, 24);
+	for(std::size_t y(0); y != height; ++y) {
+		for(std::size_t x(0); x != width; ++x) {
+			img.setPixelColor(x, y, &pixels[y*width + x]);
 		}
 	}
 
 	render_timer.stopTimer();
-	std::cout << "Rendered scene in " << render_timer.getTime() << " sec" << std::endl;
+	for(std::size_t i(0); i != threads; ++i) {
+		std::cout << "  Thread " << i << ": " << stats[i].tiles << " tiles (" << stats[i].stolen << " stolen) in " << stats[i].time << " sec" << std::endl;
+	}
+	std::cout << "Rendered scene (" << sched.num_tiles() << " tiles, " << threads << " threads) in " << render_timer.getTime() << " sec (" << width*height*xsamples*ysamples/render_timer.getTime() << " primary rays/sec)" << std::endl;
 
 	std::cout << "Writing " << outname << std::endl;
 	img.save(outname);
@@ -90,16 +262,17 @@ void raytrace_scene(const scene &scn, const char *outname, size_t width, size_t
 	std::cout << std::endl;
 }
 
-std::unique_ptr<scene> load_scene(const char *filename, const shader_bindings &bindings = {}) {
+std::unique_ptr<scene> load_scene(const char *filename, const shader_bindings &bindings = {}, accel_type accel = accel_type::kd_tree) {
 	Timer total_timer;
 	Timer scn_timer;
 	total_timer.startTimer();
 	scn_timer.startTimer();
 	auto scn_io(readScene(filename));
-	std::unique_ptr<scene> scn(new scene(scn_io, bindings));
+	std::unique_ptr<scene> scn(new scene(scn_io, bindings, accel));
 	std::cout << "Loading " << filename << std::endl;
 	scn_timer.stopTimer();
 	std::cout << "Loaded scene in " << scn_timer.getTime() << " sec" << std::endl;
+	scn->acceleration().print_stats(std::cout);
 	return scn;
 }
 
@@ -109,17 +282,55 @@ std::unique_ptr<radiosity_scene> load_radiosity_scene(const char *filename, std:
 	Timer radiosity_timer;
 	scn_timer.startTimer();
 	auto scn_io(readScene(filename));
-	std::unique_ptr<radiosity_scene> scn(new radiosity_scene(scn_io, params, bindings));
+	// A snapshot saved for the same scene file and settings spares running radiosity again
+	std::uint64_t scene_hash(0);
+	std::vector<char> settings;
+	std::unique_ptr<radiosity_snapshot> snapshot;
+	if(!params.snapshot.empty()) {
+		scene_hash = radiosity_snapshot::hash_file(filename);
+		settings = radiosity_snapshot::settings(params, steps);
+		snapshot = radiosity_snapshot::open(params.snapshot, scene_hash, settings);
+	}
+	std::unique_ptr<radiosity_scene> scn(new radiosity_scene(scn_io, params, bindings, snapshot.get()));
 	std::cout << "Loading " << filename << std::endl;
 	scn_timer.stopTimer();
 	std::cout << "Loaded scene in " << scn_timer.getTime() << " sec" << std::endl;
+	scn->acceleration().print_stats(std::cout);
+	if(scn->restored()) {
+		std::cout << "Restored radiosity from " << params.snapshot << ", residual " << scn->residual() << std::endl;
+		scn->print_stats(std::cout);
+		return scn;
+	}
 	std::cout << "Running radiosity..." << std::endl;
 	radiosity_timer.startTimer();
-	for(auto i(0); i != steps; ++i) {
-		scn->step();
+	// Stop after `steps` steps, or earlier once the scene has converged to params.target_residual or params.time_budget has run out
+	auto start(std::chrono::steady_clock::now());
+	auto k(std::max(scn->params.shooters_per_step, std::size_t(1)));
+	std::size_t performed(0);
+	std::size_t refined(0);
+	while(performed < steps && scn->residual() > scn->params.target_residual) {
+		if(scn->params.time_budget > 0.0 && std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() >= scn->params.time_budget) {
+			break;
+		}
+		auto n(std::min(k, steps - performed));
+		if(n == 1) {
+			scn->step();
+		} else {
+			scn->step_batch(n);
+		}
+		performed += n;
+		if(scn->params.refine_steps != 0 && refined < scn->params.refine_passes && performed >= (refined + 1)*scn->params.refine_steps) {
+			auto split(scn->refine());
+			++refined;
+			std::cout << "Split " << split << " patches after " << performed << " radiosity steps" << std::endl;
+		}
 	}
 	radiosity_timer.stopTimer();
-	std::cout << "Performed " << steps << " radiosity steps in " << radiosity_timer.getTime() << " sec" << std::endl;
+	std::cout << "Performed " << performed << " radiosity steps in " << radiosity_timer.getTime() << " sec, residual " << scn->residual() << std::endl;
+	scn->print_stats(std::cout);
+	if(!params.snapshot.empty() && radiosity_snapshot::save(params.snapshot, scene_hash, settings, *scn)) {
+		std::cout << "Saved radiosity to " << params.snapshot << std::endl;
+	}
 	return scn;
 }
 
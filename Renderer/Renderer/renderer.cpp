@@ -11,47 +11,83 @@
 #include <GLFW/glfw3.h>
 #include <iostream>
 #include <sstream>
+#include <cstring>
 
 typedef unsigned char u08;
 
+// Usage: Renderer [hemicube | ray_cast | software_hemicube]
+// The argument picks how form factors are computed (hemicube by default). Only hemicube needs OpenGL, so the others run without a display.
 int main(int argc, char *argv[]) {
 	using namespace rt;
 
-	if(!glfwInit()) {
-		std::cerr << "glfwInit() failed" << std::endl;
-		return 1;
-	}
-
-	// Create an invisible window so we can use OpenGL.
-	auto window(glfwCreateWindow(800, 800, "Radiosity", NULL, NULL));
-	glfwMakeContextCurrent(window);
-	if(glewInit() != GLEW_OK) {
-		std::cerr << "glewInit() failed" << std::endl;
-		return 1;
-	}
-	glfwHideWindow(window);
-
 	radiosity_scene::params_type params;
 	params.patch_area = 0.01f;
 	params.hc_res = 700;
+	if(argc > 1) {
+		if(std::strcmp(argv[1], "ray_cast") == 0) {
+			params.form_factors = form_factor_method::ray_cast;
+		} else if(std::strcmp(argv[1], "software_hemicube") == 0) {
+			params.form_factors = form_factor_method::software_hemicube;
+		} else if(std::strcmp(argv[1], "hemicube") != 0) {
+			std::cerr << "Unknown form factor method " << argv[1] << std::endl;
+			return 1;
+		}
+	}
+
+	GLFWwindow *window(nullptr);
+	if(params.form_factors == form_factor_method::hemicube) {
+		if(!glfwInit()) {
+			std::cerr << "glfwInit() failed" << std::endl;
+			return 1;
+		}
+
+		// Create an invisible window so we can use OpenGL.
+		window = glfwCreateWindow(800, 800, "Radiosity", NULL, NULL);
+		glfwMakeContextCurrent(window);
+		if(glewInit() != GLEW_OK) {
+			std::cerr << "glewInit() failed" << std::endl;
+			return 1;
+		}
+		glfwHideWindow(window);
+	}
 
 	// Examples
 	{
 		auto scn(load_radiosity_scene("../Scenes/box.ascii", 4096, params));
-		raytrace_scene<radiosity_object_tracer<true>>(*scn, "../Output/box.png", 1500, 1500);
-		raytrace_scene<radiosity_object_tracer<false>>(*scn, "../Output/box-nointerp.png", 1500, 1500);
+		raytrace_scene_parallel<radiosity_object_tracer<true>>(*scn, "../Output/box.png", 1500, 1500);
+		raytrace_scene_parallel<radiosity_object_tracer<false>>(*scn, "../Output/box-nointerp.png", 1500, 1500);
+	}
+
+	{
+		// Lighting variants: with the form factor matrix, re-solving for new light colors only takes a few steps
+		auto matrix_params(params);
+		matrix_params.patch_area = 0.05f;
+		matrix_params.solver = radiosity_solver::matrix;
+		matrix_params.target_residual = 1e-4f;
+		auto scn(load_radiosity_scene("../Scenes/box.ascii", 64, matrix_params));
+		raytrace_scene_parallel<radiosity_object_tracer<true>>(*scn, "../Output/box-matrix.png", 1500, 1500);
+		for(std::uint32_t i(1); i != scn->patches.size(); ++i) {
+			auto mat(scn->patches[i]->mat());
+			if(mat.emiss_color != vec3(0.0f)) {
+				scn->set_patch_material(i, vec3(mat.emiss_color.r, mat.emiss_color.g*0.6f, mat.emiss_color.b*0.3f), mat.diff_color);
+			}
+		}
+		for(std::size_t k(0); k != 64 && scn->residual() > matrix_params.target_residual; ++k) {
+			scn->step();
+		}
+		raytrace_scene_parallel<radiosity_object_tracer<true>>(*scn, "../Output/box-matrix-warm.png", 1500, 1500);
 	}
 
 	{
 		auto scn(load_radiosity_scene("../Scenes/sphere.ascii", 4096, params));
-		raytrace_scene<radiosity_object_tracer<true>>(*scn, "../Output/sphere.png", 1500, 1500);
-		raytrace_scene<radiosity_object_tracer<false>>(*scn, "../Output/sphere-nointerp.png", 1500, 1500);
+		raytrace_scene_parallel<radiosity_object_tracer<true>>(*scn, "../Output/sphere.png", 1500, 1500);
+		raytrace_scene_parallel<radiosity_object_tracer<false>>(*scn, "../Output/sphere-nointerp.png", 1500, 1500);
 	}
 
 	{
 		auto scn(load_radiosity_scene("../Scenes/specular.ascii", 4096, params));
-		raytrace_scene<radiosity_object_tracer<true>>(*scn, "../Output/specular.png", 1500, 1500);
-		raytrace_scene<radiosity_object_tracer<false>>(*scn, "../Output/specular-nointerp.png", 1500, 1500);
+		raytrace_scene_parallel<radiosity_object_tracer<true>>(*scn, "../Output/specular.png", 1500, 1500);
+		raytrace_scene_parallel<radiosity_object_tracer<false>>(*scn, "../Output/specular-nointerp.png", 1500, 1500);
 	}
 
 	{
@@ -66,22 +102,24 @@ int main(int argc, char *argv[]) {
 			{6, {&default_intersection_shader, mat_shader}},
 			{7, {&default_intersection_shader, mat_shader}}
 		}));
-		raytrace_scene<radiosity_object_tracer<true>>(*scn, "../Output/box-shaders.png", 1500, 1500);
-		raytrace_scene<radiosity_object_tracer<false>>(*scn, "../Output/box-shaders-nointerp.png", 1500, 1500);
+		raytrace_scene_parallel<radiosity_object_tracer<true>>(*scn, "../Output/box-shaders.png", 1500, 1500);
+		raytrace_scene_parallel<radiosity_object_tracer<false>>(*scn, "../Output/box-shaders-nointerp.png", 1500, 1500);
 	}
 
 	{
 		auto scn(load_radiosity_scene("../Scenes/banner.ascii", 4096, params));
-		raytrace_scene<radiosity_object_tracer<true>>(*scn, "../Output/banner.png", 1500, 1500);
-		raytrace_scene<radiosity_object_tracer<false>>(*scn, "../Output/banner-nointerp.png", 1500, 1500);
+		raytrace_scene_parallel<radiosity_object_tracer<true>>(*scn, "../Output/banner.png", 1500, 1500);
+		raytrace_scene_parallel<radiosity_object_tracer<false>>(*scn, "../Output/banner-nointerp.png", 1500, 1500);
 	}
 
-	if(glfwGetWindowAttrib(window, GLFW_VISIBLE)) {
-		glfwSwapBuffers(window);
-		while(!glfwWindowShouldClose(window)) {
-			glfwPollEvents();
+	if(window) {
+		if(glfwGetWindowAttrib(window, GLFW_VISIBLE)) {
+			glfwSwapBuffers(window);
+			while(!glfwWindowShouldClose(window)) {
+				glfwPollEvents();
+			}
 		}
+		glfwTerminate();
 	}
-	glfwTerminate();
 	return 0;
 }
\ No newline at end of file
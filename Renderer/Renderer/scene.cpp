@@ -56,7 +56,7 @@ done:
 	return triangle_uv(uvs[0], uvs[1], uvs[2]);
 }
 
-scene::scene(SceneIO *io, const shader_bindings &bindings) {
+scene::scene(SceneIO *io, const shader_bindings &bindings, accel_type accel) {
 	// Parse camera.
 	cam.pos = io->camera->position;
 	cam.dir = normalize(vec3(io->camera->viewDirection));
@@ -158,48 +158,31 @@ scene::scene(SceneIO *io, const shader_bindings &bindings) {
 		}
 		objects.emplace_back(std::move(obj));
 	}
-#ifdef RT_TREE
-	// Build primitive tree.
+	// Build the acceleration structure.
 	{
 		std::vector<primitive *> prims;
 		prims.reserve(primitives.size());
 		std::transform(primitives.begin(), primitives.end(), std::back_inserter(prims), [](const std::unique_ptr<primitive> &p) {
 			return p.get();
 		});
-		tree_.emplace(prims);
+		accel_ = make_accel(accel, prims);
 	}
-#endif
+}
+
+const accel &scene::acceleration() const {
+	return *accel_;
 }
 
 bool scene::intersect(const ray &r, intersect_info &info, primitive *&pr) const {
-#ifdef RT_TREE
-	return tree_->intersect(r, info, pr);
-#else
-	auto hit(false);
-	intersect_info info_min;
-	info_min.t = std::numeric_limits<float>::infinity();
-	const primitive *pr_min(nullptr);
-	{
-		intersect_info info;
-		for(auto &pr : primitives) {
-			if(pr->intersect(r, info)) {
-				hit = true;
-				if(info.t < info_min.t) {
-					info_min = info;
-					pr_min = pr.get();
-				}
-			}
-		}
-	}
-	if(hit) {
-		assert(pr_min != nullptr);
-		pr = const_cast<primitive *>(pr_min);
-		info = info_min;
-		return true;
-	} else {
-		return false;
-	}
-#endif
+	return accel_->intersect(r, info, pr);
+}
+
+bool scene::occluded(const ray &r, float t_max, const any_hit_fn &any_hit) const {
+	return accel_->occluded(r, t_max, any_hit);
+}
+
+void scene::intersect_packet(const ray *rays, std::size_t count, intersect_info *info, primitive **pr) const {
+	accel_->intersect_packet(rays, count, info, pr);
 }
 
 }
\ No newline at end of file
@@ -6,7 +6,7 @@
 #include "camera.h"
 #include "light.h"
 #include "ray.h"
-#include "primitive_tree.h"
+#include "accel.h"
 #include "material.h"
 #include "vec3.h"
 #include "config.h"
@@ -24,10 +24,17 @@ namespace rt {
 using std::experimental::optional;
 
 struct scene {
-	scene(SceneIO *io, const shader_bindings &bindings = {});
+	// accel: The acceleration structure intersect uses.
+	scene(SceneIO *io, const shader_bindings &bindings = {}, accel_type accel = accel_type::kd_tree);
 	scene(const scene &) = delete;
 
 	bool intersect(const ray &r, intersect_info &info, primitive *&pr) const;
+	// Whether anything hit by r within [0, t_max] is accepted by any_hit (see accel::occluded); with no any_hit, whether anything is hit at all.
+	bool occluded(const ray &r, float t_max, const any_hit_fn &any_hit = {}) const;
+	// Intersects a packet of coherent rays, such as the primary rays of a block of pixels (see accel::intersect_packet).
+	void intersect_packet(const ray *rays, std::size_t count, intersect_info *info, primitive **pr) const;
+
+	const accel &acceleration() const;
 
 	camera cam;
 	std::vector<light> lights;
@@ -35,9 +42,7 @@ struct scene {
 	std::vector<std::unique_ptr<primitive>> primitives;
 
 private:
-#ifdef RT_TREE
-	optional<primitive_tree> tree_;
-#endif
+	std::unique_ptr<accel> accel_;
 };
 
 }
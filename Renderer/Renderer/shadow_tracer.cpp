@@ -73,6 +73,26 @@ vec3 shadow_tracer::trace(const vec3 &origin, const light &l) const {
 	auto dir(mpark::visit(compute_ray_direction(origin), l.info));
 	float max_t(mpark::visit(compute_max_t(origin), l.info));
 	auto shadow(l.color*f_att);
+	// Most shadow rays only need to know whether an opaque surface is in the way, which the first one found answers.
+	// Only when a transparent surface is found are the hits walked in order to attenuate the light by each of them.
+	ray shadow_ray(origin, dir);
+	auto transparent(false);
+	auto blocked(scn_.occluded(shadow_ray, max_t, [&](primitive *pr, const hit_info &h) {
+		intersect_info info;
+		pr->surface_interaction(shadow_ray, h, info);
+		shader_params params{shadow_ray.position(info.t), info.normal, info.uv};
+		if(!pr->obj()->intersect_shader(params)) {
+			return false;
+		}
+		pr->obj()->mat_shader(info.mat, params);
+		transparent = info.mat.ktran >= std::numeric_limits<float>::epsilon();
+		return true;
+	}));
+	if(!blocked) {
+		return shadow;
+	} else if(!transparent) {
+		return vec3(0.0f, 0.0f, 0.0f);
+	}
 	optional<ray> r;
 	r.emplace(origin, dir);
 	primitive *pr;
@@ -0,0 +1,86 @@
+#include "simd.h"
+#include "config.h"
+
+#if defined(RT_SIMD_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(RT_SIMD_X86)
+#include <cpuid.h>
+#endif
+
+namespace rt {
+
+#ifdef RT_SIMD_X86
+
+static void cpuid(int leaf, int subleaf, int regs[4]) {
+#ifdef _MSC_VER
+	__cpuidex(regs, leaf, subleaf);
+#else
+	unsigned a, b, c, d;
+	__cpuid_count(leaf, subleaf, a, b, c, d);
+	regs[0] = int(a);
+	regs[1] = int(b);
+	regs[2] = int(c);
+	regs[3] = int(d);
+#endif
+}
+
+// Which register states the OS saves on context switches (XCR0).
+static unsigned long long xgetbv0() {
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	unsigned a, d;
+	__asm__ volatile("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+	return (static_cast<unsigned long long>(d) << 32) | a;
+#endif
+}
+
+static simd_level detect_simd_level() {
+	int regs[4];
+	cpuid(0, 0, regs);
+	auto max_leaf(regs[0]);
+	cpuid(1, 0, regs);
+	auto sse2((regs[3] & (1 << 26)) != 0);
+	auto osxsave((regs[2] & (1 << 27)) != 0);
+	auto avx((regs[2] & (1 << 28)) != 0);
+	if(!sse2) {
+		return simd_level::scalar;
+	}
+	// AVX needs the OS to save the upper halves of the ymm registers (XCR0 bits 1 and 2).
+	if(max_leaf >= 7 && osxsave && avx && (xgetbv0() & 6) == 6) {
+		cpuid(7, 0, regs);
+		if((regs[1] & (1 << 5)) != 0) {
+			return simd_level::avx2;
+		}
+	}
+	return simd_level::sse;
+}
+
+#else
+
+static simd_level detect_simd_level() {
+	return simd_level::scalar;
+}
+
+#endif
+
+simd_level cpu_simd_level() {
+	static const auto level(detect_simd_level());
+	return level;
+}
+
+const char *simd_level_name(simd_level level) {
+	switch(level) {
+		case simd_level::scalar:
+			return "scalar";
+		case simd_level::sse:
+			return "SSE";
+		case simd_level::avx2:
+			return "AVX2";
+		default:
+			assert(!"Unexpected simd_level");
+			return "";
+	}
+}
+
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+// SIMD code paths are compiled on every x86 host regardless of the compiler's instruction set flags, and picked at runtime with cpu_simd_level().
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define RT_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Marks a function which uses AVX2 intrinsics. GCC and Clang only accept these in functions compiled for AVX2; MSVC accepts them anywhere.
+#if defined(RT_SIMD_X86) && defined(__GNUC__)
+#define RT_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define RT_TARGET_AVX2
+#endif
+
+namespace rt {
+
+enum class simd_level {
+	scalar,
+	sse, // SSE2, 4 floats wide
+	avx2 // 8 floats wide
+};
+
+// The widest instruction set supported by both the CPU and the OS.
+simd_level cpu_simd_level();
+
+const char *simd_level_name(simd_level level);
+
+}
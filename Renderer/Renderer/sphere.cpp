@@ -14,9 +14,9 @@ sphere::sphere(object *obj, const vec3 &center, float radius) :
 {
 }
 
-void sphere::output_result(const ray &r, float t, intersect_info &info) const {
-	info.t = t;
-	auto p(r.position(t) - center);
+void sphere::surface_interaction(const ray &r, const hit_info &h, intersect_info &info) const {
+	info.t = h.t;
+	auto p(r.position(h.t) - center);
 	info.normal = normalize(p);
 	auto u(1.0f/RT_PI*std::atan2(p.x, p.z));
 	if(std::signbit(u)) {
@@ -30,7 +30,7 @@ void sphere::output_result(const ray &r, float t, intersect_info &info) const {
 	info.mat = obj()->materials[0];
 }
 
-bool sphere::intersect(const ray &r, intersect_info &info) const {
+bool sphere::hit(const ray &r, hit_info &h) const {
 	auto v(r.origin - center);
 	const auto b(2.0f*dot(r.dir, r.origin - center));
 	const auto c(dot(v, v) - radius*radius);
@@ -43,12 +43,12 @@ bool sphere::intersect(const ray &r, intersect_info &info) const {
 		std::size_t n(0);
 		t = (-b - s)/2.0f;
 		if(!std::signbit(t)) {
-			output_result(r, t, info);
+			h.t = t;
 			return true;
 		}
 		t = (-b + s)/2.0f;
 		if(!std::signbit(t)) {
-			output_result(r, t, info);
+			h.t = t;
 			return true;
 		}
 		return false;
@@ -13,13 +13,10 @@ namespace rt {
 struct sphere : primitive {
     sphere(object *obj, const vec3 &center, float radius);
 
-	bool intersect(const ray &r, intersect_info &info) const;
+	bool hit(const ray &r, hit_info &h) const;
+	void surface_interaction(const ray &r, const hit_info &h, intersect_info &info) const;
     const aabb &bounds() const;
 
-private:
-	void output_result(const ray &r, float t, intersect_info &info) const;
-
-public:
     const vec3 center;
     const float radius;
 
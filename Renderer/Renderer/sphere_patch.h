@@ -1,7 +1,6 @@
 #pragma once
 
 #include "patch.h"
-#include "patch_state.h"
 
 namespace rt {
 
@@ -0,0 +1,60 @@
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace rt {
+
+tile_scheduler::tile_scheduler(std::size_t width, std::size_t height, std::size_t tile_size, std::size_t workers) :
+	num_tiles_(0)
+{
+	assert(tile_size > 0);
+	assert(workers > 0);
+	std::vector<tile> tiles;
+	for(std::size_t y(0); y < height; y += tile_size) {
+		for(std::size_t x(0); x < width; x += tile_size) {
+			tiles.emplace_back(tile{x, y, std::min(x + tile_size, width), std::min(y + tile_size, height)});
+		}
+	}
+	num_tiles_ = tiles.size();
+	// Give each worker a contiguous band of tiles so neighbouring tiles (which touch similar parts of the scene) tend to stay on one thread.
+	queues_.reserve(workers);
+	for(std::size_t w(0); w != workers; ++w) {
+		std::unique_ptr<queue> q(new queue());
+		auto begin(tiles.size()*w/workers);
+		auto end(tiles.size()*(w + 1)/workers);
+		q->tiles.assign(tiles.begin() + begin, tiles.begin() + end);
+		queues_.emplace_back(std::move(q));
+	}
+}
+
+bool tile_scheduler::next(std::size_t worker, tile &t, bool &stolen) {
+	{
+		auto &q(*queues_[worker]);
+		std::lock_guard<std::mutex> lock(q.m);
+		if(!q.tiles.empty()) {
+			t = q.tiles.front();
+			q.tiles.pop_front();
+			stolen = false;
+			return true;
+		}
+	}
+	// Own queue is empty, steal from the back of the other queues (the tiles their owners would get to last).
+	for(std::size_t i(1); i != queues_.size(); ++i) {
+		auto &q(*queues_[(worker + i) % queues_.size()]);
+		std::lock_guard<std::mutex> lock(q.m);
+		if(!q.tiles.empty()) {
+			t = q.tiles.back();
+			q.tiles.pop_back();
+			stolen = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+std::size_t tile_scheduler::num_tiles() const {
+	return num_tiles_;
+}
+
+}
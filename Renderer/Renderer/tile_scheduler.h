@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace rt {
+
+// A rectangular region of the image: [x0, x1) x [y0, y1).
+struct tile {
+	std::size_t x0;
+	std::size_t y0;
+	std::size_t x1;
+	std::size_t y1;
+};
+
+// Hands out image tiles to a fixed set of workers.
+// Each worker starts with a contiguous run of tiles in its own queue; once it runs dry it steals tiles from the back of the other workers' queues.
+struct tile_scheduler {
+	tile_scheduler(std::size_t width, std::size_t height, std::size_t tile_size, std::size_t workers);
+	tile_scheduler(const tile_scheduler &) = delete;
+
+	// Fetches the next tile for `worker`. Returns false once every tile has been handed out.
+	// `stolen` is set if the tile was taken from another worker's queue.
+	bool next(std::size_t worker, tile &t, bool &stolen);
+
+	std::size_t num_tiles() const;
+
+private:
+	struct queue {
+		std::mutex m;
+		std::deque<tile> tiles;
+	};
+
+	std::vector<std::unique_ptr<queue>> queues_;
+	std::size_t num_tiles_;
+};
+
+}
@@ -183,7 +183,7 @@ struct triangle : primitive {
 		}
 	}
 
-	bool intersect(const ray &r, intersect_info &info) const {
+	bool hit(const ray &r, hit_info &h) const {
 		auto denom(dot(face_normal_, r.dir));
 		if(std::abs(denom) < std::numeric_limits<float>::epsilon()) {
 			return false;
@@ -216,16 +216,23 @@ struct triangle : primitive {
 			}
 		}
 		if(alpha >= 0.0f && (alpha + beta) <= 1.0f) {
-			info.t = t;
-			info.normal = normal->normal(alpha, beta);
-			info.uv = uv.uv(alpha, beta);
-			info.mat = mat->mat(obj(), alpha, beta);
+			h.t = t;
+			h.alpha = alpha;
+			h.beta = beta;
 			return true;
 		} else {
 			return false;
 		}
 	}
 
+	// The hit point is a + h.alpha*(b - a) + h.beta*(c - a).
+	void surface_interaction(const ray &r, const hit_info &h, intersect_info &info) const {
+		info.t = h.t;
+		info.normal = normal->normal(h.alpha, h.beta);
+		info.uv = uv.uv(h.alpha, h.beta);
+		info.mat = mat->mat(obj(), h.alpha, h.beta);
+	}
+
 	const aabb &bounds() const {
 		return bounds_;
 	}
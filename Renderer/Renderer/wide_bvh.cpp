@@ -0,0 +1,555 @@
+#include "wide_bvh.h"
+#include "config.h"
+#include "triangle.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+namespace rt {
+
+namespace detail {
+
+// A ray in the form the SIMD kernels want it.
+struct wide_ray {
+	wide_ray(const ray &r) :
+		origin{r.origin.x, r.origin.y, r.origin.z},
+		dir{r.dir.x, r.dir.y, r.dir.z},
+		idir{r.idir.x, r.idir.y, r.idir.z},
+		near{std::signbit(r.dir.x), std::signbit(r.dir.y), std::signbit(r.dir.z)}
+	{
+	}
+
+	float origin[3];
+	float dir[3];
+	float idir[3];
+	std::size_t near[3]; // Per axis, whether the near side of a box is its maximum (index into wide_bvh_node::bounds)
+};
+
+// A kernel provides two tests, each of which returns a bit mask of the lanes that were hit:
+//
+// children() intersects the ray with every child box of a node ("An Efficient and Robust Ray-Box Intersection Algorithm", like aabb::intersect, but without branches)
+// and writes the distance at which the ray enters each box to t_near. Picking the near and far planes by the sign of the ray direction also makes the empty bounds of unused children miss.
+//
+// triangles() intersects the ray with every triangle of a block (Moller-Trumbore) and writes the distance and the barycentric coordinates (alpha, beta as in hit_info) of each hit.
+//
+// Only hits within [0, t_max] are reported.
+
+template <std::size_t N>
+struct kernel_scalar {
+	static unsigned children(const wide_bvh_node<N> &node, const wide_ray &r, float t_max, float *t_near) {
+		unsigned mask(0);
+		for(std::size_t i(0); i != N; ++i) {
+			auto t_enter(0.0f);
+			auto t_exit(t_max);
+			for(std::size_t axis(0); axis != 3; ++axis) {
+				auto t0((node.bounds[r.near[axis]][axis][i] - r.origin[axis])*r.idir[axis]);
+				auto t1((node.bounds[1 - r.near[axis]][axis][i] - r.origin[axis])*r.idir[axis]);
+				t_enter = std::max(t_enter, t0);
+				t_exit = std::min(t_exit, t1);
+			}
+			t_near[i] = t_enter;
+			if(t_enter <= t_exit) {
+				mask |= 1u << i;
+			}
+		}
+		return mask;
+	}
+
+	static unsigned triangles(const primitive_block<N> &block, const wide_ray &r, float t_max, float *t, float *alpha, float *beta) {
+		unsigned mask(0);
+		for(std::size_t i(0); i != N; ++i) {
+			vec3 e1(block.e1[0][i], block.e1[1][i], block.e1[2][i]);
+			vec3 e2(block.e2[0][i], block.e2[1][i], block.e2[2][i]);
+			vec3 d(r.dir[0], r.dir[1], r.dir[2]);
+			auto p(cross(d, e2));
+			auto det(dot(e1, p));
+			if(det == 0.0f) {
+				continue;
+			}
+			auto inv_det(1.0f/det);
+			vec3 tv(r.origin[0] - block.v0[0][i], r.origin[1] - block.v0[1][i], r.origin[2] - block.v0[2][i]);
+			auto q(cross(tv, e1));
+			alpha[i] = dot(tv, p)*inv_det;
+			beta[i] = dot(d, q)*inv_det;
+			t[i] = dot(e2, q)*inv_det;
+			if(alpha[i] >= 0.0f && beta[i] >= 0.0f && alpha[i] + beta[i] <= 1.0f && t[i] >= 0.0f && t[i] <= t_max) {
+				mask |= 1u << i;
+			}
+		}
+		return mask;
+	}
+};
+
+#ifdef RT_SIMD_X86
+
+struct kernel_sse {
+	static unsigned children(const wide_bvh_node<4> &node, const wide_ray &r, float t_max, float *t_near) {
+		auto t_enter(_mm_setzero_ps());
+		auto t_exit(_mm_set1_ps(t_max));
+		for(std::size_t axis(0); axis != 3; ++axis) {
+			auto o(_mm_set1_ps(r.origin[axis]));
+			auto idir(_mm_set1_ps(r.idir[axis]));
+			auto t0(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[r.near[axis]][axis]), o), idir));
+			auto t1(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[1 - r.near[axis]][axis]), o), idir));
+			t_enter = _mm_max_ps(t_enter, t0);
+			t_exit = _mm_min_ps(t_exit, t1);
+		}
+		_mm_storeu_ps(t_near, t_enter);
+		return unsigned(_mm_movemask_ps(_mm_cmple_ps(t_enter, t_exit)));
+	}
+
+	static unsigned triangles(const primitive_block<4> &block, const wide_ray &r, float t_max, float *t, float *alpha, float *beta) {
+		auto dx(_mm_set1_ps(r.dir[0]));
+		auto dy(_mm_set1_ps(r.dir[1]));
+		auto dz(_mm_set1_ps(r.dir[2]));
+		auto e1x(_mm_loadu_ps(block.e1[0]));
+		auto e1y(_mm_loadu_ps(block.e1[1]));
+		auto e1z(_mm_loadu_ps(block.e1[2]));
+		auto e2x(_mm_loadu_ps(block.e2[0]));
+		auto e2y(_mm_loadu_ps(block.e2[1]));
+		auto e2z(_mm_loadu_ps(block.e2[2]));
+		// p = d x e2
+		auto px(_mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y)));
+		auto py(_mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z)));
+		auto pz(_mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x)));
+		auto det(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz)));
+		auto inv_det(_mm_div_ps(_mm_set1_ps(1.0f), det));
+		auto tx(_mm_sub_ps(_mm_set1_ps(r.origin[0]), _mm_loadu_ps(block.v0[0])));
+		auto ty(_mm_sub_ps(_mm_set1_ps(r.origin[1]), _mm_loadu_ps(block.v0[1])));
+		auto tz(_mm_sub_ps(_mm_set1_ps(r.origin[2]), _mm_loadu_ps(block.v0[2])));
+		// q = (origin - v0) x e1
+		auto qx(_mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y)));
+		auto qy(_mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z)));
+		auto qz(_mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x)));
+		auto a(_mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inv_det));
+		auto b(_mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv_det));
+		auto tt(_mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv_det));
+		auto zero(_mm_setzero_ps());
+		auto hit(_mm_cmpneq_ps(det, zero));
+		hit = _mm_and_ps(hit, _mm_cmpge_ps(a, zero));
+		hit = _mm_and_ps(hit, _mm_cmpge_ps(b, zero));
+		hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(a, b), _mm_set1_ps(1.0f)));
+		hit = _mm_and_ps(hit, _mm_cmpge_ps(tt, zero));
+		hit = _mm_and_ps(hit, _mm_cmple_ps(tt, _mm_set1_ps(t_max)));
+		_mm_storeu_ps(t, tt);
+		_mm_storeu_ps(alpha, a);
+		_mm_storeu_ps(beta, b);
+		return unsigned(_mm_movemask_ps(hit));
+	}
+};
+
+// The AVX2 functions are not inlined into the traversal loop, which is compiled for the host's baseline instruction set.
+// Each one clears the upper halves of the ymm registers before returning, to avoid AVX-SSE transition penalties in the (non-VEX) code it returns to.
+
+RT_TARGET_AVX2 static unsigned children_avx2(const wide_bvh_node<8> &node, const wide_ray &r, float t_max, float *t_near) {
+	auto t_enter(_mm256_setzero_ps());
+	auto t_exit(_mm256_set1_ps(t_max));
+	for(std::size_t axis(0); axis != 3; ++axis) {
+		auto o(_mm256_set1_ps(r.origin[axis]));
+		auto idir(_mm256_set1_ps(r.idir[axis]));
+		auto t0(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[r.near[axis]][axis]), o), idir));
+		auto t1(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(node.bounds[1 - r.near[axis]][axis]), o), idir));
+		t_enter = _mm256_max_ps(t_enter, t0);
+		t_exit = _mm256_min_ps(t_exit, t1);
+	}
+	_mm256_storeu_ps(t_near, t_enter);
+	auto mask(unsigned(_mm256_movemask_ps(_mm256_cmp_ps(t_enter, t_exit, _CMP_LE_OQ))));
+	_mm256_zeroupper();
+	return mask;
+}
+
+RT_TARGET_AVX2 static unsigned triangles_avx2(const primitive_block<8> &block, const wide_ray &r, float t_max, float *t, float *alpha, float *beta) {
+	auto dx(_mm256_set1_ps(r.dir[0]));
+	auto dy(_mm256_set1_ps(r.dir[1]));
+	auto dz(_mm256_set1_ps(r.dir[2]));
+	auto e1x(_mm256_loadu_ps(block.e1[0]));
+	auto e1y(_mm256_loadu_ps(block.e1[1]));
+	auto e1z(_mm256_loadu_ps(block.e1[2]));
+	auto e2x(_mm256_loadu_ps(block.e2[0]));
+	auto e2y(_mm256_loadu_ps(block.e2[1]));
+	auto e2z(_mm256_loadu_ps(block.e2[2]));
+	auto px(_mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y)));
+	auto py(_mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z)));
+	auto pz(_mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x)));
+	auto det(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz)));
+	auto inv_det(_mm256_div_ps(_mm256_set1_ps(1.0f), det));
+	auto tx(_mm256_sub_ps(_mm256_set1_ps(r.origin[0]), _mm256_loadu_ps(block.v0[0])));
+	auto ty(_mm256_sub_ps(_mm256_set1_ps(r.origin[1]), _mm256_loadu_ps(block.v0[1])));
+	auto tz(_mm256_sub_ps(_mm256_set1_ps(r.origin[2]), _mm256_loadu_ps(block.v0[2])));
+	auto qx(_mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y)));
+	auto qy(_mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z)));
+	auto qz(_mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x)));
+	auto a(_mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inv_det));
+	auto b(_mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv_det));
+	auto tt(_mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv_det));
+	auto zero(_mm256_setzero_ps());
+	auto hit(_mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(a, zero, _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(b, zero, _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(_mm256_add_ps(a, b), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(tt, zero, _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(tt, _mm256_set1_ps(t_max), _CMP_LE_OQ));
+	_mm256_storeu_ps(t, tt);
+	_mm256_storeu_ps(alpha, a);
+	_mm256_storeu_ps(beta, b);
+	auto mask(unsigned(_mm256_movemask_ps(hit)));
+	_mm256_zeroupper();
+	return mask;
+}
+
+struct kernel_avx2 {
+	static unsigned children(const wide_bvh_node<8> &node, const wide_ray &r, float t_max, float *t_near) {
+		return children_avx2(node, r, t_max, t_near);
+	}
+
+	static unsigned triangles(const primitive_block<8> &block, const wide_ray &r, float t_max, float *t, float *alpha, float *beta) {
+		return triangles_avx2(block, r, t_max, t, alpha, beta);
+	}
+};
+
+#endif
+
+// The SIMD kernel for width N.
+template <std::size_t N>
+struct kernel_simd;
+
+#ifdef RT_SIMD_X86
+
+template <>
+struct kernel_simd<4> : kernel_sse {
+};
+
+template <>
+struct kernel_simd<8> : kernel_avx2 {
+};
+
+#else
+
+template <std::size_t N>
+struct kernel_simd : kernel_scalar<N> {
+};
+
+#endif
+
+}
+
+template <std::size_t N>
+static simd_level matching_level(simd_level level) {
+	// N = 4 uses SSE (also on AVX2 hosts), N = 8 needs AVX2.
+	if(N == 4 && level != simd_level::scalar) {
+		return simd_level::sse;
+	} else if(N == 8 && level == simd_level::avx2) {
+		return simd_level::avx2;
+	}
+	return simd_level::scalar;
+}
+
+template <std::size_t N>
+wide_bvh<N>::wide_bvh(const std::vector<primitive *> &primitives, simd_level level) :
+	level_(matching_level<N>(level)),
+	depth_(0)
+{
+	auto start(std::chrono::steady_clock::now());
+	if(!primitives.empty()) {
+		bvh binary(primitives, N);
+		primitives_ = binary.primitives();
+		auto &root(binary.nodes()[0]);
+		if(root.leaf()) {
+			collapse(binary, {0}, 0);
+		} else {
+			collapse(binary, {1, root.right}, 0);
+		}
+	}
+	build_time_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <std::size_t N>
+std::uint32_t wide_bvh<N>::collapse(const bvh &binary, std::vector<std::uint32_t> children, std::size_t depth) {
+	// Pull the grandchildren of the binary tree up into this node, always opening the interior child with the largest surface area
+	// (the one most likely to be hit), until there are N children.
+	auto &bin_nodes(binary.nodes());
+	while(children.size() < N) {
+		auto best(children.end());
+		auto best_sa(-1.0f);
+		for(auto it(children.begin()); it != children.end(); ++it) {
+			auto &c(bin_nodes[*it]);
+			if(!c.leaf() && c.bounds.surface_area() > best_sa) {
+				best = it;
+				best_sa = c.bounds.surface_area();
+			}
+		}
+		if(best == children.end()) {
+			break;
+		}
+		auto opened(*best);
+		*best = opened + 1;
+		children.push_back(bin_nodes[opened].right);
+	}
+	depth_ = std::max(depth_, depth);
+	auto index(std::uint32_t(nodes_.size()));
+	nodes_.emplace_back();
+	for(std::size_t i(0); i != N; ++i) {
+		auto &n(nodes_[index]);
+		if(i >= children.size()) {
+			for(std::size_t axis(0); axis != 3; ++axis) {
+				n.bounds[0][axis][i] = std::numeric_limits<float>::infinity();
+				n.bounds[1][axis][i] = -std::numeric_limits<float>::infinity();
+			}
+			n.children[i] = detail::wide_bvh_node<N>::empty;
+			n.num_blocks[i] = 0;
+			continue;
+		}
+		auto &c(bin_nodes[children[i]]);
+		for(std::size_t axis(0); axis != 3; ++axis) {
+			n.bounds[0][axis][i] = c.bounds.minmax[0][axis];
+			n.bounds[1][axis][i] = c.bounds.minmax[1][axis];
+		}
+		if(c.leaf()) {
+			n.children[i] = detail::wide_bvh_node<N>::leaf_bit | make_blocks(c.primitives_offset, c.num_primitives);
+			n.num_blocks[i] = (c.num_primitives + N - 1)/N;
+		} else {
+			auto child(collapse(binary, {children[i] + 1, c.right}, depth + 1));
+			nodes_[index].children[i] = child;
+			nodes_[index].num_blocks[i] = 0;
+		}
+	}
+	return index;
+}
+
+template <std::size_t N>
+std::uint32_t wide_bvh<N>::make_blocks(std::uint32_t first, std::uint32_t count) {
+	auto index(std::uint32_t(blocks_.size()));
+	for(std::uint32_t i(0); i != count; ++i) {
+		if(i % N == 0) {
+			blocks_.emplace_back();
+			auto &block(blocks_.back());
+			std::fill(std::begin(block.primitives), std::end(block.primitives), detail::primitive_block<N>::empty);
+		}
+		auto &block(blocks_.back());
+		auto lane(i % N);
+		auto *p(primitives_[first + i]);
+		block.primitives[lane] = first + i;
+		if(p->type() == type_triangle) {
+			auto *tri(static_cast<const triangle *>(p));
+			auto e1(tri->b - tri->a);
+			auto e2(tri->c - tri->a);
+			for(std::size_t axis(0); axis != 3; ++axis) {
+				block.v0[axis][lane] = tri->a[axis];
+				block.e1[axis][lane] = e1[axis];
+				block.e2[axis][lane] = e2[axis];
+			}
+		} else {
+			block.others |= 1u << lane;
+		}
+	}
+	return index;
+}
+
+template <std::size_t N>
+bool wide_bvh<N>::intersect(const ray &r, intersect_info &info, primitive *&pr) const {
+	// level_ is either scalar or the level matching N (see matching_level).
+	if(level_ != simd_level::scalar) {
+		return intersect_<detail::kernel_simd<N>>(r, info, pr);
+	} else {
+		return intersect_<detail::kernel_scalar<N>>(r, info, pr);
+	}
+}
+
+template <std::size_t N>
+template <typename Kernel>
+bool wide_bvh<N>::intersect_(const ray &r, intersect_info &info, primitive *&pr) const {
+	struct stack_entry {
+		std::uint32_t child;
+		std::uint32_t num_blocks;
+		float t_near;
+	};
+	// Every visited node replaces its entry by at most N, so the stack grows by at most N - 1 entries per level of the tree.
+	stack_entry intersect_stack[RT_BVH_MAX_DEPTH*(N - 1) + 1];
+	std::size_t stack_size(0);
+	if(nodes_.empty()) {
+		return false;
+	}
+	detail::wide_ray wr(r);
+	hit_info h_closest;
+	h_closest.t = std::numeric_limits<float>::infinity();
+	primitive *pr_closest(nullptr);
+	hit_info h;
+	intersect_stack[stack_size++] = stack_entry{0, 0, 0.0f};
+	while(stack_size != 0) {
+		auto e(intersect_stack[--stack_size]);
+		if(e.t_near > h_closest.t + RT_RAY_EPSILON) {
+			continue;
+		}
+		if(e.num_blocks != 0) {
+			auto begin(blocks_.begin() + (e.child & ~detail::wide_bvh_node<N>::leaf_bit));
+			auto end(begin + e.num_blocks);
+			for(auto it(begin); it != end; ++it) {
+				auto &block(*it);
+				float t[N];
+				float alpha[N];
+				float beta[N];
+				auto mask(Kernel::triangles(block, wr, h_closest.t, t, alpha, beta));
+				for(std::size_t i(0); mask != 0; ++i, mask >>= 1) {
+					if((mask & 1) != 0 && t[i] < h_closest.t) {
+						h_closest = hit_info{t[i], alpha[i], beta[i]};
+						pr_closest = primitives_[block.primitives[i]];
+					}
+				}
+				for(std::size_t i(0), others(block.others); others != 0; ++i, others >>= 1) {
+					if((others & 1) != 0) {
+						auto p(primitives_[block.primitives[i]]);
+						if(p->hit(r, h) && h.t < h_closest.t) {
+							h_closest = h;
+							pr_closest = p;
+						}
+					}
+				}
+			}
+			continue;
+		}
+		auto &node(nodes_[e.child]);
+		float t_near[N];
+		auto mask(Kernel::children(node, wr, h_closest.t + RT_RAY_EPSILON, t_near));
+		// Push the children that were hit farthest first, so that the nearest one is visited next.
+		auto first(stack_size);
+		for(std::size_t i(0); i != N; ++i) {
+			if((mask & (1u << i)) == 0) {
+				continue;
+			}
+			stack_entry entry{node.children[i], node.num_blocks[i], t_near[i]};
+			auto j(stack_size++);
+			for(; j != first && intersect_stack[j - 1].t_near < entry.t_near; --j) {
+				intersect_stack[j] = intersect_stack[j - 1];
+			}
+			intersect_stack[j] = entry;
+		}
+		assert(stack_size <= RT_BVH_MAX_DEPTH*(N - 1) + 1);
+	}
+	if(pr_closest == nullptr) {
+		return false;
+	}
+	pr_closest->surface_interaction(r, h_closest, info);
+	pr = pr_closest;
+	return true;
+}
+
+template <std::size_t N>
+bool wide_bvh<N>::occluded(const ray &r, float t_max, const any_hit_fn &any_hit) const {
+	if(level_ != simd_level::scalar) {
+		return occluded_<detail::kernel_simd<N>>(r, t_max, any_hit);
+	} else {
+		return occluded_<detail::kernel_scalar<N>>(r, t_max, any_hit);
+	}
+}
+
+template <std::size_t N>
+template <typename Kernel>
+bool wide_bvh<N>::occluded_(const ray &r, float t_max, const any_hit_fn &any_hit) const {
+	// Same traversal as intersect_, but the first accepted hit ends it, so the children are pushed unsorted.
+	struct stack_entry {
+		std::uint32_t child;
+		std::uint32_t num_blocks;
+	};
+	stack_entry intersect_stack[RT_BVH_MAX_DEPTH*(N - 1) + 1];
+	std::size_t stack_size(0);
+	if(nodes_.empty()) {
+		return false;
+	}
+	detail::wide_ray wr(r);
+	hit_info h;
+	intersect_stack[stack_size++] = stack_entry{0, 0};
+	while(stack_size != 0) {
+		auto e(intersect_stack[--stack_size]);
+		if(e.num_blocks != 0) {
+			auto begin(blocks_.begin() + (e.child & ~detail::wide_bvh_node<N>::leaf_bit));
+			auto end(begin + e.num_blocks);
+			for(auto it(begin); it != end; ++it) {
+				auto &block(*it);
+				float t[N];
+				float alpha[N];
+				float beta[N];
+				auto mask(Kernel::triangles(block, wr, t_max, t, alpha, beta));
+				for(std::size_t i(0); mask != 0; ++i, mask >>= 1) {
+					if((mask & 1) != 0 && (!any_hit || any_hit(primitives_[block.primitives[i]], hit_info{t[i], alpha[i], beta[i]}))) {
+						return true;
+					}
+				}
+				for(std::size_t i(0), others(block.others); others != 0; ++i, others >>= 1) {
+					if((others & 1) != 0) {
+						auto p(primitives_[block.primitives[i]]);
+						if(p->hit(r, h) && h.t <= t_max && (!any_hit || any_hit(p, h))) {
+							return true;
+						}
+					}
+				}
+			}
+			continue;
+		}
+		auto &node(nodes_[e.child]);
+		float t_near[N];
+		auto mask(Kernel::children(node, wr, t_max + RT_RAY_EPSILON, t_near));
+		for(std::size_t i(0); mask != 0; ++i, mask >>= 1) {
+			if((mask & 1) != 0) {
+				intersect_stack[stack_size++] = stack_entry{node.children[i], node.num_blocks[i]};
+			}
+		}
+		assert(stack_size <= RT_BVH_MAX_DEPTH*(N - 1) + 1);
+	}
+	return false;
+}
+
+template <std::size_t N>
+double wide_bvh<N>::build_time() const {
+	return build_time_;
+}
+
+template <std::size_t N>
+std::size_t wide_bvh<N>::memory_usage() const {
+	return nodes_.size()*sizeof(detail::wide_bvh_node<N>) + blocks_.size()*sizeof(detail::primitive_block<N>) + primitives_.size()*sizeof(primitive *);
+}
+
+template <std::size_t N>
+void wide_bvh<N>::print_stats(std::ostream &os) const {
+	std::size_t children(0);
+	for(auto &n : nodes_) {
+		for(std::size_t i(0); i != N; ++i) {
+			if(n.children[i] != detail::wide_bvh_node<N>::empty) {
+				++children;
+			}
+		}
+	}
+	os << "Built " << N << "-wide BVH in " << build_time_ << " sec" << std::endl;
+	os << N << "-wide BVH (" << simd_level_name(level_) << "): " << nodes_.size() << " nodes (" << (nodes_.empty() ? 0.0f : float(children)/nodes_.size()) << " children per node), " << blocks_.size() << " primitive blocks (" << (blocks_.empty() ? 0.0f : float(primitives_.size())/blocks_.size()) << " primitives per block), depth " << depth_ << ", "
+	   << memory_usage()/1024.0 << " KB" << std::endl;
+}
+
+template <std::size_t N>
+simd_level wide_bvh<N>::level() const {
+	return level_;
+}
+
+template <std::size_t N>
+std::size_t wide_bvh<N>::depth() const {
+	return depth_;
+}
+
+template <std::size_t N>
+std::size_t wide_bvh<N>::num_nodes() const {
+	return nodes_.size();
+}
+
+template struct wide_bvh<4>;
+template struct wide_bvh<8>;
+
+std::unique_ptr<accel> make_wide_bvh(const std::vector<primitive *> &primitives, simd_level level) {
+	if(level == simd_level::avx2) {
+		return std::unique_ptr<accel>(new wide_bvh<8>(primitives, level));
+	} else {
+		return std::unique_ptr<accel>(new wide_bvh<4>(primitives, level));
+	}
+}
+
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "accel.h"
+#include "bvh.h"
+#include "simd.h"
+
+#include <vector>
+#include <cstdint>
+
+namespace rt {
+
+namespace detail {
+
+// A node of a wide_bvh with up to N children. The child boxes are stored as a structure of arrays so that a ray can be tested against all of them at once.
+template <std::size_t N>
+struct wide_bvh_node {
+	static const std::uint32_t leaf_bit = 0x80000000u;
+	static const std::uint32_t empty = 0xffffffffu;
+
+	float bounds[2][3][N]; // bounds[0][axis][i] is the minimum of child i along axis, bounds[1][axis][i] the maximum. Unused children have empty bounds.
+	std::uint32_t children[N]; // Interior children: index into wide_bvh::nodes_. Leaf children: leaf_bit | index of the leaf's first block in wide_bvh::blocks_. Unused children: empty.
+	std::uint32_t num_blocks[N]; // Number of primitive blocks of leaf children, 0 otherwise
+};
+
+// Up to N primitives of a wide_bvh leaf. Triangles are stored as a structure of arrays with the data Moller-Trumbore needs
+// ("Fast, Minimum Storage Ray/Triangle Intersection"), so that a ray can be tested against all of them at once.
+// Other primitives (and unused lanes) have zero edges, which the triangle test never reports as hit.
+template <std::size_t N>
+struct primitive_block {
+	static const std::uint32_t empty = 0xffffffffu;
+
+	float v0[3][N]; // v0[axis][i] is triangle::a of lane i
+	float e1[3][N]; // triangle::b - triangle::a
+	float e2[3][N]; // triangle::c - triangle::a
+	std::uint32_t primitives[N]; // Index into wide_bvh::primitives_, or empty
+	std::uint32_t others; // Bit mask of the lanes holding primitives which are not triangles, and which are tested with primitive::intersect
+};
+
+}
+
+// A non-owning BVH with N (4 or 8) children per node, made by collapsing a binary bvh
+// ("Shallow Bounding Volume Hierarchies for Fast SIMD Ray Tracing of Incoherent Rays", Dammertz et al.).
+// Each visited node tests the ray against all of its child boxes, and each leaf against blocks of N triangles, with SSE (N = 4) or AVX2 (N = 8),
+// or with a scalar loop if the CPU supports neither. The normal, uv and material are only computed for the closest hit.
+template <std::size_t N>
+struct wide_bvh : accel {
+	// level: Instruction set available for testing the child boxes. N = 4 uses SSE and N = 8 uses AVX2; if `level` does not include that, a scalar loop is used.
+	wide_bvh(const std::vector<primitive *> &primitives, simd_level level = cpu_simd_level());
+
+	// Safe to call from several threads at once: the traversal stack lives on the caller's stack.
+	bool intersect(const ray &r, intersect_info &info, primitive *&pr) const override;
+	bool occluded(const ray &r, float t_max, const any_hit_fn &any_hit) const override;
+
+	double build_time() const override;
+	std::size_t memory_usage() const override;
+	void print_stats(std::ostream &os) const override;
+
+	simd_level level() const;
+	std::size_t depth() const; // Depth of the deepest node (never more than that of the binary bvh, and so never more than RT_BVH_MAX_DEPTH)
+	std::size_t num_nodes() const;
+
+private:
+	template <typename Kernel>
+	bool intersect_(const ray &r, intersect_info &info, primitive *&pr) const;
+	template <typename Kernel>
+	bool occluded_(const ray &r, float t_max, const any_hit_fn &any_hit) const;
+	std::uint32_t collapse(const bvh &binary, std::vector<std::uint32_t> children, std::size_t depth);
+	std::uint32_t make_blocks(std::uint32_t first, std::uint32_t count); // Packs primitives_[first, first + count) into blocks and returns the index of the first
+
+	std::vector<detail::wide_bvh_node<N>> nodes_; // nodes_[0] is the root
+	std::vector<detail::primitive_block<N>> blocks_; // The primitives of every leaf, in consecutive blocks
+	std::vector<primitive *> primitives_;
+	simd_level level_;
+	std::size_t depth_;
+	double build_time_;
+};
+
+// A wide_bvh of the width best suited to this CPU (8 with AVX2, 4 otherwise).
+std::unique_ptr<accel> make_wide_bvh(const std::vector<primitive *> &primitives, simd_level level = cpu_simd_level());
+
+}